@@ -0,0 +1,432 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ell/ell.h>
+
+#include "rt.h"
+#include "capture.h"
+
+/*
+ * Capture file: a header followed by one variable length record per
+ * request: fixed fields, then the response PDU (function code first)
+ * as received. Timeouts have no PDU.
+ *
+ * Replay indexes a capture by (slave, function, address, quantity) and
+ * answers each request with the next recorded response for the same
+ * request, wrapping around at the end, after the recorded RTT. Polling
+ * intervals and RTTs are divided by the replay speed.
+ */
+
+#define CAPTURE_MAGIC		0x50434d4b	/* "KMCP" */
+#define CAPTURE_VERSION		1
+#define CAPTURE_BUFSIZE		(64 * 1024)
+
+/* Hash bucket: streams sharing it are told apart by their fields */
+#define REPLAY_KEY(id, fc, addr, qty)	\
+	((uint32_t) (id) << 24 ^ (uint32_t) (fc) << 16 ^ (addr) ^	\
+	 (uint32_t) (qty) << 5)
+
+struct capture_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint64_t start;		/* us, CLOCK_REALTIME */
+} __attribute__ ((packed));
+
+struct capture_record {
+	uint64_t timestamp;	/* us since start */
+	uint32_t rtt;		/* us */
+	uint8_t slave_id;
+	uint8_t status;
+	uint16_t address;
+	uint16_t quantity;
+	uint8_t function;
+	uint8_t len;		/* PDU bytes following the record */
+} __attribute__ ((packed));
+
+struct replay_stream {
+	struct replay_stream *chain;	/* Same bucket */
+	uint8_t slave_id;
+	uint8_t function;
+	uint16_t address;
+	uint16_t quantity;
+	const struct capture_record **records;
+	unsigned int count;
+	unsigned int size;
+	unsigned int next;
+};
+
+/* Records batched in the main loop, written by rt_work() once full */
+struct capture_chunk {
+	int fd;
+	int err;
+	size_t len;
+	uint8_t data[CAPTURE_BUFSIZE];
+};
+
+static int capture_fd = -1;
+static struct capture_chunk *capture_chunk;
+static uint64_t capture_start;
+
+static void *replay_map;
+static size_t replay_map_len;
+static struct l_hashmap *replay_index;
+static double replay_speed = 1.0;
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	ssize_t written;
+
+	while (len) {
+		written = write(fd, ptr, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0)
+			return -errno;
+
+		ptr += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static void chunk_write(void *user_data)
+{
+	struct capture_chunk *chunk = user_data;
+
+	chunk->err = write_all(chunk->fd, chunk->data, chunk->len);
+}
+
+static void chunk_done(void *user_data)
+{
+	struct capture_chunk *chunk = user_data;
+
+	/* Not closed meanwhile: stop capturing */
+	if (chunk->err < 0 && capture_chunk) {
+		l_error("capture: write failed (%s), stopping capture",
+			strerror(-chunk->err));
+		capture_close();
+	}
+}
+
+static void chunk_new(void)
+{
+	capture_chunk = l_new(struct capture_chunk, 1);
+	capture_chunk->fd = capture_fd;
+}
+
+static void chunk_flush(void)
+{
+	if (!capture_chunk->len)
+		return;
+
+	rt_work(chunk_write, chunk_done, capture_chunk, l_free);
+	chunk_new();
+}
+
+static void fd_close(void *user_data)
+{
+	if (close(L_PTR_TO_INT(user_data)) < 0)
+		l_error("capture: %s", strerror(errno));
+}
+
+int capture_open(const char *path)
+{
+	struct capture_header hdr;
+	struct timespec ts;
+	int err;
+
+	capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0600);
+	if (capture_fd < 0)
+		return -errno;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CAPTURE_MAGIC;
+	hdr.version = CAPTURE_VERSION;
+	hdr.start = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	err = write_all(capture_fd, &hdr, sizeof(hdr));
+	if (err < 0) {
+		close(capture_fd);
+		capture_fd = -1;
+		return err;
+	}
+
+	chunk_new();
+	capture_start = l_time_now();
+
+	l_info("Capturing requests to %s", path);
+
+	return 0;
+}
+
+void capture_close(void)
+{
+	if (!capture_chunk)
+		return;
+
+	/* Closed after the pending writes */
+	chunk_flush();
+	l_free(capture_chunk);
+	capture_chunk = NULL;
+
+	rt_work(fd_close, NULL, L_INT_TO_PTR(capture_fd), NULL);
+	capture_fd = -1;
+}
+
+void capture_record(uint8_t slave_id, uint8_t function, uint16_t address,
+		    uint16_t quantity, enum capture_status status,
+		    uint64_t sent_at, uint64_t rtt,
+		    const uint8_t *pdu, uint8_t len)
+{
+	struct capture_record rec;
+
+	if (likely(!capture_chunk))
+		return;
+
+	rec.timestamp = sent_at > capture_start ? sent_at - capture_start : 0;
+	rec.rtt = rtt > UINT32_MAX ? UINT32_MAX : rtt;
+	rec.slave_id = slave_id;
+	rec.status = status;
+	rec.address = address;
+	rec.quantity = quantity;
+	rec.function = function;
+	rec.len = (status == CAPTURE_STATUS_RESPONSE ? len : 0);
+
+	if (capture_chunk->len + sizeof(rec) + rec.len > CAPTURE_BUFSIZE)
+		chunk_flush();
+
+	memcpy(capture_chunk->data + capture_chunk->len, &rec, sizeof(rec));
+	capture_chunk->len += sizeof(rec);
+
+	if (rec.len) {
+		memcpy(capture_chunk->data + capture_chunk->len, pdu, rec.len);
+		capture_chunk->len += rec.len;
+	}
+}
+
+static void stream_free(void *data)
+{
+	struct replay_stream *stream = data;
+	struct replay_stream *next;
+
+	for (; stream; stream = next) {
+		next = stream->chain;
+		l_free(stream->records);
+		l_free(stream);
+	}
+}
+
+static struct replay_stream *stream_find(struct replay_stream *stream,
+					 uint8_t slave_id, uint8_t function,
+					 uint16_t address, uint16_t quantity)
+{
+	for (; stream; stream = stream->chain) {
+		if (stream->slave_id == slave_id &&
+		    stream->function == function &&
+		    stream->address == address &&
+		    stream->quantity == quantity)
+			return stream;
+	}
+
+	return NULL;
+}
+
+static void replay_index_add(const struct capture_record *rec)
+{
+	struct replay_stream *bucket;
+	struct replay_stream *stream;
+	unsigned int key = REPLAY_KEY(rec->slave_id, rec->function,
+				      rec->address, rec->quantity);
+
+	bucket = l_hashmap_lookup(replay_index, L_UINT_TO_PTR(key));
+	stream = stream_find(bucket, rec->slave_id, rec->function,
+			     rec->address, rec->quantity);
+	if (!stream) {
+		stream = l_new(struct replay_stream, 1);
+		stream->slave_id = rec->slave_id;
+		stream->function = rec->function;
+		stream->address = rec->address;
+		stream->quantity = rec->quantity;
+
+		/* New head: replaces the previous one in the bucket */
+		stream->chain = bucket;
+		l_hashmap_replace(replay_index, L_UINT_TO_PTR(key), stream,
+				  NULL);
+	}
+
+	if (stream->count == stream->size) {
+		stream->size = stream->size ? stream->size * 2 : 64;
+		stream->records = l_realloc(stream->records,
+				stream->size * sizeof(*stream->records));
+	}
+
+	stream->records[stream->count++] = rec;
+}
+
+int replay_open(const char *path, double speed)
+{
+	const struct capture_header *hdr;
+	const struct capture_record *rec;
+	const uint8_t *ptr;
+	const uint8_t *end;
+	struct stat st;
+	unsigned int count = 0;
+	int fd;
+	int err;
+
+	if (speed <= 0)
+		return -EINVAL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if ((size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EBADMSG;
+	}
+
+	replay_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay_map == MAP_FAILED) {
+		replay_map = NULL;
+		return -errno;
+	}
+
+	replay_map_len = st.st_size;
+
+	hdr = replay_map;
+	if (hdr->magic != CAPTURE_MAGIC || hdr->version != CAPTURE_VERSION) {
+		l_error("replay: %s is not a capture file", path);
+		replay_close();
+		return -EBADMSG;
+	}
+
+	replay_index = l_hashmap_new();
+	replay_speed = speed;
+
+	/* Records aren't aligned: accessed through packed structs */
+	ptr = (const uint8_t *) (hdr + 1);
+	end = (const uint8_t *) replay_map + replay_map_len;
+
+	while (ptr + sizeof(*rec) <= end) {
+		rec = (const struct capture_record *) ptr;
+		if (ptr + sizeof(*rec) + rec->len > end)
+			break;
+
+		replay_index_add(rec);
+		ptr += sizeof(*rec) + rec->len;
+		count++;
+	}
+
+	l_info("Replaying %u requests from %s (speed x%.2f)", count, path,
+	       speed);
+
+	return 0;
+}
+
+void replay_close(void)
+{
+	l_hashmap_destroy(replay_index, stream_free);
+	replay_index = NULL;
+
+	if (replay_map)
+		munmap(replay_map, replay_map_len);
+
+	replay_map = NULL;
+	replay_map_len = 0;
+	replay_speed = 1.0;
+}
+
+bool replay_enabled(void)
+{
+	return replay_index != NULL;
+}
+
+uint32_t replay_scale(uint32_t ms)
+{
+	uint32_t scaled;
+
+	if (!replay_index)
+		return ms;
+
+	scaled = ms / replay_speed;
+
+	return scaled ? scaled : 1;
+}
+
+/*
+ * Next recorded response: returns 0 and the PDU, -ETIMEDOUT if the
+ * request timed out when captured, or -ENOENT if it was never seen.
+ */
+int replay_lookup(uint8_t slave_id, uint8_t function, uint16_t address,
+		  uint16_t quantity, uint64_t *rtt, const uint8_t **pdu,
+		  uint8_t *len)
+{
+	const struct capture_record *rec;
+	struct replay_stream *stream;
+	unsigned int key = REPLAY_KEY(slave_id, function, address, quantity);
+
+	stream = stream_find(l_hashmap_lookup(replay_index,
+					      L_UINT_TO_PTR(key)),
+			     slave_id, function, address, quantity);
+	if (!stream)
+		return -ENOENT;
+
+	rec = stream->records[stream->next];
+	stream->next = (stream->next + 1) % stream->count;
+
+	*rtt = rec->rtt / replay_speed;
+
+	if (rec->status == CAPTURE_STATUS_TIMEOUT)
+		return -ETIMEDOUT;
+
+	*pdu = (const uint8_t *) (rec + 1);
+	*len = rec->len;
+
+	return 0;
+}
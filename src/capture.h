@@ -0,0 +1,41 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+enum capture_status {
+	CAPTURE_STATUS_RESPONSE,	/* Normal or exception PDU */
+	CAPTURE_STATUS_TIMEOUT,		/* No PDU */
+};
+
+int capture_open(const char *path);
+void capture_close(void);
+void capture_record(uint8_t slave_id, uint8_t function, uint16_t address,
+		    uint16_t quantity, enum capture_status status,
+		    uint64_t sent_at, uint64_t rtt,
+		    const uint8_t *pdu, uint8_t len);
+
+int replay_open(const char *path, double speed);
+void replay_close(void);
+bool replay_enabled(void);
+uint32_t replay_scale(uint32_t ms);
+int replay_lookup(uint8_t slave_id, uint8_t function, uint16_t address,
+		  uint16_t quantity, uint64_t *rtt, const uint8_t **pdu,
+		  uint8_t *len);
@@ -0,0 +1,850 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <ell/ell.h>
+
+#include "stream.h"
+#include "uplink.h"
+#include "source.h"
+#include "compute.h"
+
+/*
+ * Computed sources: values derived from other sources, exported as
+ * regular Source1 objects ("/computed/source_XXXX", type "computed")
+ * whose Value is a big endian IEEE 754 double.
+ *
+ * The expression is compiled once into a stack bytecode. Operands are
+ * numbers and input items: "$N" is the first register (or bit) of
+ * input N, "$N[k]" its k-th one, read as unsigned 16-bit. Operators
+ * are + - * / and unary minus; functions decode multi-word values:
+ *
+ *   s16(x)  u32(hi, lo)  s32(hi, lo)  f32(hi, lo)  abs(x)
+ *   min(a, b)  max(a, b)
+ *
+ * e.g. "u32($0[0], $0[1]) * 0.001" or "$0 * $1 / 1000".
+ *
+ * Every input keeps the list of computed sources depending on it: an
+ * expression is evaluated again only when one of its inputs changes.
+ * Inputs must exist when an expression is created, computed ones
+ * included, so the dependency graph can't have cycles. Chains of
+ * computed sources are limited to COMPUTE_CHAIN_MAX, as changes
+ * propagate along them recursively.
+ */
+
+#define COMPUTE_STACK_MAX	32
+#define COMPUTE_CHAIN_MAX	16
+#define COMPUTE_CODE_MAX	256
+#define COMPUTE_VALUE_LEN	8	/* double */
+
+enum opcode {
+	OP_CONST,
+	OP_LOAD,
+	OP_NEG,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_S16,
+	OP_U32,
+	OP_S32,
+	OP_F32,
+	OP_ABS,
+	OP_MIN,
+	OP_MAX,
+};
+
+struct insn {
+	uint8_t op;
+	uint8_t input;		/* OP_LOAD */
+	uint16_t index;		/* OP_LOAD: register/bit */
+	double value;		/* OP_CONST */
+};
+
+struct computed {
+	struct source *source;
+	struct source **inputs;	/* NULL once removed */
+	unsigned int count;
+	struct insn *code;
+	unsigned int len;
+	unsigned int level;	/* 1 + deepest computed input */
+};
+
+struct compiler {
+	const char *expression;
+	const char *pos;
+	struct source **inputs;
+	unsigned int count;
+	struct insn code[COMPUTE_CODE_MAX];
+	unsigned int len;
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned int nesting;	/* Parentheses, calls and unary minus */
+	const char *error;
+};
+
+static const struct {
+	const char *name;
+	unsigned int args;
+	enum opcode op;
+} functions[] = {
+	{ "s16", 1, OP_S16 },
+	{ "u32", 2, OP_U32 },
+	{ "s32", 2, OP_S32 },
+	{ "f32", 2, OP_F32 },
+	{ "abs", 1, OP_ABS },
+	{ "min", 2, OP_MIN },
+	{ "max", 2, OP_MAX },
+	{ }
+};
+
+static struct l_queue *computed_list;
+static struct l_hashmap *dependents;	/* Input source: computed list */
+static uint16_t computed_index;
+
+static bool emit(struct compiler *c, const struct insn *insn, int pushed)
+{
+	if (c->len == COMPUTE_CODE_MAX) {
+		c->error = "expression too long";
+		return false;
+	}
+
+	c->code[c->len++] = *insn;
+	c->depth += pushed;
+
+	if (c->depth > c->max_depth)
+		c->max_depth = c->depth;
+
+	if (c->max_depth > COMPUTE_STACK_MAX) {
+		c->error = "expression too deep";
+		return false;
+	}
+
+	return true;
+}
+
+/* Parser recursion is bounded like the evaluation stack */
+static bool nest_enter(struct compiler *c)
+{
+	if (c->nesting == COMPUTE_STACK_MAX) {
+		c->error = "expression too deep";
+		return false;
+	}
+
+	c->nesting++;
+
+	return true;
+}
+
+static void nest_leave(struct compiler *c)
+{
+	c->nesting--;
+}
+
+static void skip_spaces(struct compiler *c)
+{
+	while (isspace((unsigned char) *c->pos))
+		c->pos++;
+}
+
+static bool parse_expr(struct compiler *c);
+
+static bool parse_input(struct compiler *c)
+{
+	struct insn insn = { .op = OP_LOAD };
+	unsigned long input;
+	unsigned long index = 0;
+	char *end;
+
+	input = strtoul(c->pos, &end, 10);
+	if (end == c->pos || input >= c->count) {
+		c->error = "unknown input";
+		return false;
+	}
+
+	c->pos = end;
+	skip_spaces(c);
+
+	if (*c->pos == '[') {
+		c->pos++;
+		index = strtoul(c->pos, &end, 10);
+		if (end == c->pos || *end != ']') {
+			c->error = "invalid index";
+			return false;
+		}
+
+		c->pos = end + 1;
+	}
+
+	if (index >= source_get_size(c->inputs[input])) {
+		c->error = "index out of range";
+		return false;
+	}
+
+	insn.input = input;
+	insn.index = index;
+
+	return emit(c, &insn, 1);
+}
+
+static bool parse_call(struct compiler *c)
+{
+	struct insn insn;
+	const char *name = c->pos;
+	size_t len;
+	unsigned int i;
+	unsigned int args;
+
+	while (isalnum((unsigned char) *c->pos))
+		c->pos++;
+
+	len = c->pos - name;
+
+	for (i = 0; functions[i].name; i++) {
+		if (strlen(functions[i].name) == len &&
+		    strncmp(functions[i].name, name, len) == 0)
+			break;
+	}
+
+	if (!functions[i].name) {
+		c->error = "unknown function";
+		return false;
+	}
+
+	skip_spaces(c);
+	if (*c->pos != '(') {
+		c->error = "'(' expected";
+		return false;
+	}
+
+	c->pos++;
+
+	if (!nest_enter(c))
+		return false;
+
+	for (args = 0; args < functions[i].args; args++) {
+		if (args) {
+			skip_spaces(c);
+			if (*c->pos != ',') {
+				c->error = "',' expected";
+				return false;
+			}
+
+			c->pos++;
+		}
+
+		if (!parse_expr(c))
+			return false;
+	}
+
+	nest_leave(c);
+
+	skip_spaces(c);
+	if (*c->pos != ')') {
+		c->error = "')' expected";
+		return false;
+	}
+
+	c->pos++;
+
+	memset(&insn, 0, sizeof(insn));
+	insn.op = functions[i].op;
+
+	/* Pops its arguments, pushes the result */
+	return emit(c, &insn, 1 - (int) functions[i].args);
+}
+
+static bool parse_primary(struct compiler *c)
+{
+	struct insn insn;
+	char *end;
+
+	skip_spaces(c);
+
+	if (*c->pos == '$') {
+		c->pos++;
+		return parse_input(c);
+	}
+
+	if (*c->pos == '(') {
+		c->pos++;
+		if (!nest_enter(c) || !parse_expr(c))
+			return false;
+
+		nest_leave(c);
+
+		skip_spaces(c);
+		if (*c->pos != ')') {
+			c->error = "')' expected";
+			return false;
+		}
+
+		c->pos++;
+		return true;
+	}
+
+	if (isalpha((unsigned char) *c->pos))
+		return parse_call(c);
+
+	memset(&insn, 0, sizeof(insn));
+	insn.op = OP_CONST;
+	insn.value = strtod(c->pos, &end);
+	if (end == c->pos) {
+		c->error = "operand expected";
+		return false;
+	}
+
+	c->pos = end;
+
+	return emit(c, &insn, 1);
+}
+
+static bool parse_unary(struct compiler *c)
+{
+	struct insn insn = { .op = OP_NEG };
+
+	skip_spaces(c);
+
+	if (*c->pos != '-')
+		return parse_primary(c);
+
+	c->pos++;
+	if (!nest_enter(c) || !parse_unary(c))
+		return false;
+
+	nest_leave(c);
+
+	return emit(c, &insn, 0);
+}
+
+static bool parse_term(struct compiler *c)
+{
+	struct insn insn;
+	char op;
+
+	if (!parse_unary(c))
+		return false;
+
+	for (;;) {
+		skip_spaces(c);
+		op = *c->pos;
+		if (op != '*' && op != '/')
+			return true;
+
+		c->pos++;
+		if (!parse_unary(c))
+			return false;
+
+		memset(&insn, 0, sizeof(insn));
+		insn.op = (op == '*' ? OP_MUL : OP_DIV);
+		if (!emit(c, &insn, -1))
+			return false;
+	}
+}
+
+static bool parse_expr(struct compiler *c)
+{
+	struct insn insn;
+	char op;
+
+	if (!parse_term(c))
+		return false;
+
+	for (;;) {
+		skip_spaces(c);
+		op = *c->pos;
+		if (op != '+' && op != '-')
+			return true;
+
+		c->pos++;
+		if (!parse_term(c))
+			return false;
+
+		memset(&insn, 0, sizeof(insn));
+		insn.op = (op == '+' ? OP_ADD : OP_SUB);
+		if (!emit(c, &insn, -1))
+			return false;
+	}
+}
+
+static int compile(struct computed *computed, const char *expression)
+{
+	struct compiler *c;
+	int err = 0;
+
+	c = l_new(struct compiler, 1);
+	c->expression = expression;
+	c->pos = expression;
+	c->inputs = computed->inputs;
+	c->count = computed->count;
+
+	if (parse_expr(c)) {
+		skip_spaces(c);
+		if (*c->pos != '\0')
+			c->error = "unexpected character";
+	}
+
+	if (c->error) {
+		l_error("compute: \"%s\": %s at offset %d", expression,
+			c->error, (int) (c->pos - expression));
+		err = -EINVAL;
+	} else {
+		computed->code = l_memdup(c->code,
+					  c->len * sizeof(*c->code));
+		computed->len = c->len;
+	}
+
+	l_free(c);
+
+	return err;
+}
+
+static bool load(const struct source *source, uint16_t index, double *value)
+{
+	uint8_t buf[2];
+	int len;
+
+	len = source_read(source, source_get_address(source) + index, 1, 0,
+			  buf);
+	if (len < 0)
+		return false;
+
+	/* A single bit, or a big endian register */
+	*value = (len == 1 ? buf[0] & 1 : buf[0] << 8 | buf[1]);
+
+	return true;
+}
+
+/*
+ * Low 16 bits of an operand. Casting a negative or huge double to a
+ * narrower integer is undefined: go through int64_t, rejecting values
+ * (and NaN, infinity) it can't hold.
+ */
+static bool word(double value, uint16_t *out)
+{
+	if (!isfinite(value) || fabs(value) >= (double) INT64_MAX)
+		return false;
+
+	*out = (int64_t) value & 0xffff;
+
+	return true;
+}
+
+static bool words(double hi, double lo, uint32_t *out)
+{
+	uint16_t h;
+	uint16_t l;
+
+	if (!word(hi, &h) || !word(lo, &l))
+		return false;
+
+	*out = (uint32_t) h << 16 | l;
+
+	return true;
+}
+
+static bool evaluate(const struct computed *computed, double *result)
+{
+	double stack[COMPUTE_STACK_MAX];
+	const struct insn *insn;
+	unsigned int sp = 0;
+	unsigned int i;
+	uint32_t u32;
+	uint16_t u16;
+	float f32;
+
+	for (i = 0; i < computed->len; i++) {
+		insn = &computed->code[i];
+
+		switch ((enum opcode) insn->op) {
+		case OP_CONST:
+			stack[sp++] = insn->value;
+			break;
+		case OP_LOAD:
+			if (!computed->inputs[insn->input] ||
+			    !load(computed->inputs[insn->input], insn->index,
+				  &stack[sp]))
+				return false;
+			sp++;
+			break;
+		case OP_NEG:
+			stack[sp - 1] = -stack[sp - 1];
+			break;
+		case OP_ADD:
+			sp--;
+			stack[sp - 1] += stack[sp];
+			break;
+		case OP_SUB:
+			sp--;
+			stack[sp - 1] -= stack[sp];
+			break;
+		case OP_MUL:
+			sp--;
+			stack[sp - 1] *= stack[sp];
+			break;
+		case OP_DIV:
+			sp--;
+			stack[sp - 1] /= stack[sp];
+			break;
+		case OP_S16:
+			if (!word(stack[sp - 1], &u16))
+				return false;
+			stack[sp - 1] = (int16_t) u16;
+			break;
+		case OP_U32:
+			sp--;
+			if (!words(stack[sp - 1], stack[sp], &u32))
+				return false;
+			stack[sp - 1] = u32;
+			break;
+		case OP_S32:
+			sp--;
+			if (!words(stack[sp - 1], stack[sp], &u32))
+				return false;
+			stack[sp - 1] = (int32_t) u32;
+			break;
+		case OP_F32:
+			sp--;
+			if (!words(stack[sp - 1], stack[sp], &u32))
+				return false;
+			memcpy(&f32, &u32, sizeof(f32));
+			stack[sp - 1] = f32;
+			break;
+		case OP_ABS:
+			stack[sp - 1] = fabs(stack[sp - 1]);
+			break;
+		case OP_MIN:
+			sp--;
+			if (stack[sp] < stack[sp - 1])
+				stack[sp - 1] = stack[sp];
+			break;
+		case OP_MAX:
+			sp--;
+			if (stack[sp] > stack[sp - 1])
+				stack[sp - 1] = stack[sp];
+			break;
+		}
+	}
+
+	/* Division by zero, or f32() of a NaN: nothing to publish */
+	if (!isfinite(stack[0]))
+		return false;
+
+	*result = stack[0];
+
+	return true;
+}
+
+static void computed_update(struct computed *computed)
+{
+	uint8_t value[COMPUTE_VALUE_LEN];
+	uint64_t bits;
+	double result;
+	int i;
+
+	if (!evaluate(computed, &result))
+		return;
+
+	memcpy(&bits, &result, sizeof(bits));
+	for (i = COMPUTE_VALUE_LEN - 1; i >= 0; i--, bits >>= 8)
+		value[i] = bits & 0xff;
+
+	if (!source_update(computed->source, value, sizeof(value)))
+		return;
+
+	stream_publish(computed->source, value, sizeof(value));
+	uplink_publish(computed->source, value, sizeof(value));
+
+	/* Computed sources may depend on this one */
+	compute_source_changed(computed->source);
+}
+
+static bool match_ptr(const void *a, const void *b)
+{
+	return a == b;
+}
+
+static void dependent_add(struct source *input, struct computed *computed)
+{
+	struct l_queue *queue;
+
+	queue = l_hashmap_lookup(dependents, input);
+	if (!queue) {
+		queue = l_queue_new();
+		l_hashmap_insert(dependents, input, queue);
+	}
+
+	/* Same input used twice: evaluated once */
+	if (!l_queue_find(queue, match_ptr, computed))
+		l_queue_push_tail(queue, computed);
+}
+
+static void dependent_remove(struct source *input, struct computed *computed)
+{
+	struct l_queue *queue;
+
+	queue = l_hashmap_lookup(dependents, input);
+	if (!queue)
+		return;
+
+	l_queue_remove(queue, computed);
+	if (!l_queue_isempty(queue))
+		return;
+
+	l_hashmap_remove(dependents, input);
+	l_queue_destroy(queue, NULL);
+}
+
+static void computed_free(void *data)
+{
+	struct computed *computed = data;
+	unsigned int i;
+
+	for (i = 0; i < computed->count; i++) {
+		if (computed->inputs[i])
+			dependent_remove(computed->inputs[i], computed);
+	}
+
+	/* Also its dependents: they see an input removed */
+	source_destroy(computed->source);
+
+	l_free(computed->inputs);
+	l_free(computed->code);
+	l_free(computed);
+}
+
+static bool path_match(const void *a, const void *b)
+{
+	const struct computed *computed = a;
+
+	return strcmp(source_get_path(computed->source), b) == 0;
+}
+
+static bool source_match(const void *a, const void *b)
+{
+	const struct computed *computed = a;
+
+	return computed->source == b;
+}
+
+static bool index_match(const void *a, const void *b)
+{
+	const struct computed *computed = a;
+
+	return source_get_address(computed->source) == L_PTR_TO_UINT(b);
+}
+
+/* Next index not used by a computed source, 0 if none is left */
+static uint16_t index_next(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < UINT16_MAX; i++) {
+		/* 0 skipped: indexes start at 1 */
+		if (!++computed_index)
+			computed_index++;
+
+		if (!l_queue_find(computed_list, index_match,
+				  L_UINT_TO_PTR(computed_index)))
+			return computed_index;
+	}
+
+	return 0;
+}
+
+/* Longest chain of computed sources ending at 'computed' */
+static unsigned int chain_level(const struct computed *computed)
+{
+	const struct computed *input;
+	unsigned int level = 0;
+	unsigned int i;
+
+	for (i = 0; i < computed->count; i++) {
+		input = l_queue_find(computed_list, source_match,
+				     computed->inputs[i]);
+		if (input && input->level > level)
+			level = input->level;
+	}
+
+	return level + 1;
+}
+
+struct source *compute_create(const char *name, const char *expression,
+			      struct source **inputs, unsigned int count)
+{
+	struct computed *computed;
+	uint16_t index;
+	unsigned int i;
+
+	if (unlikely(!name || !expression || count > UINT8_MAX))
+		return NULL;
+
+	computed = l_new(struct computed, 1);
+	computed->inputs = l_memdup(inputs, count * sizeof(*inputs));
+	computed->count = count;
+	computed->level = chain_level(computed);
+
+	if (computed->level > COMPUTE_CHAIN_MAX) {
+		l_error("compute: \"%s\": chain of computed sources "
+			"longer than %d", expression, COMPUTE_CHAIN_MAX);
+		l_free(computed->inputs);
+		l_free(computed);
+		return NULL;
+	}
+
+	index = index_next();
+	if (!index) {
+		l_error("compute: no computed source index left");
+		l_free(computed->inputs);
+		l_free(computed);
+		return NULL;
+	}
+
+	if (compile(computed, expression) < 0) {
+		l_free(computed->inputs);
+		l_free(computed);
+		return NULL;
+	}
+
+	/* Four registers: the double value */
+	computed->source = source_create("/computed", name, "computed",
+					 index, 4, 0);
+	if (!computed->source || !source_register(computed->source)) {
+		source_destroy(computed->source);
+		l_free(computed->code);
+		l_free(computed->inputs);
+		l_free(computed);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++)
+		dependent_add(inputs[i], computed);
+
+	/* Newest first: see compute_stop() */
+	l_queue_push_head(computed_list, computed);
+
+	l_info("Computed(%p): (%s) \"%s\": %u instructions", computed,
+	       source_get_path(computed->source), expression, computed->len);
+
+	computed_update(computed);
+
+	return computed->source;
+}
+
+int compute_remove(const char *path)
+{
+	struct computed *computed;
+
+	computed = l_queue_remove_if(computed_list, path_match, path);
+	if (!computed)
+		return -ENOENT;
+
+	computed_free(computed);
+
+	return 0;
+}
+
+struct source *compute_find(const char *path)
+{
+	struct computed *computed;
+
+	computed = l_queue_find(computed_list, path_match, path);
+
+	return computed ? computed->source : NULL;
+}
+
+/* Value of 'source' changed: evaluate what depends on it */
+void compute_source_changed(struct source *source)
+{
+	const struct l_queue_entry *entry;
+	struct l_queue *queue;
+
+	if (!dependents)
+		return;
+
+	queue = l_hashmap_lookup(dependents, source);
+	if (!queue)
+		return;
+
+	for (entry = l_queue_get_entries(queue); entry; entry = entry->next)
+		computed_update(entry->data);
+}
+
+static void input_detach(void *data, void *user_data)
+{
+	struct computed *computed = data;
+	unsigned int i;
+
+	/* Last value kept: not evaluated anymore */
+	for (i = 0; i < computed->count; i++) {
+		if (computed->inputs[i] == user_data)
+			computed->inputs[i] = NULL;
+	}
+}
+
+void compute_source_removed(struct source *source)
+{
+	struct l_queue *queue;
+
+	if (!dependents)
+		return;
+
+	queue = l_hashmap_remove(dependents, source);
+	if (!queue)
+		return;
+
+	l_queue_foreach(queue, input_detach, source);
+	l_queue_destroy(queue, NULL);
+}
+
+int compute_start(void)
+{
+	l_info("Starting computed sources ...");
+
+	computed_list = l_queue_new();
+	dependents = l_hashmap_new();
+
+	return 0;
+}
+
+void compute_stop(void)
+{
+	struct computed *computed;
+
+	/* Dependents first: they were created after their inputs */
+	while ((computed = l_queue_pop_head(computed_list)))
+		computed_free(computed);
+
+	l_queue_destroy(computed_list, NULL);
+	computed_list = NULL;
+	l_hashmap_destroy(dependents, NULL);
+	dependents = NULL;
+}
@@ -51,6 +51,20 @@ struct l_dbus_message *dbus_error_errno(struct l_dbus_message *msg,
 	return reply;
 }
 
+void dbus_append_dict_entry_basic(struct l_dbus_message_builder *builder,
+				  const char *key, const char type,
+				  const void *value)
+{
+	const char strtype[] = { type, '\0' };
+
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', key);
+	l_dbus_message_builder_enter_variant(builder, strtype);
+	l_dbus_message_builder_append_basic(builder, type, value);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
 static void dbus_disconnect_callback(void *user_data)
 {
 }
@@ -22,6 +22,10 @@
 #define KNOT_MODBUS_SERVICE		"br.org.cesar.modbus"
 #define SLAVE_IFACE			KNOT_MODBUS_SERVICE".Slave1"
 #define SOURCE_IFACE			KNOT_MODBUS_SERVICE".Source1"
+#define STATISTICS_IFACE		KNOT_MODBUS_SERVICE".Statistics1"
+#define TRACE_IFACE			KNOT_MODBUS_SERVICE".Trace1"
+#define LOOP_IFACE			KNOT_MODBUS_SERVICE".Loop1"
+#define GROUP_IFACE			KNOT_MODBUS_SERVICE".Group1"
 
 typedef void (*dbus_setup_completed_func_t) (void *user_data);
 
@@ -33,3 +37,7 @@ struct l_dbus *dbus_get_bus(void);
 struct l_dbus_message *dbus_error_invalid_args(struct l_dbus_message *msg);
 struct l_dbus_message *dbus_error_errno(struct l_dbus_message *msg,
 					const char *suffix, int err);
+
+void dbus_append_dict_entry_basic(struct l_dbus_message_builder *builder,
+				  const char *key, const char type,
+				  const void *value);
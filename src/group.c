@@ -0,0 +1,493 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <ell/ell.h>
+
+#include "dbus.h"
+#include "watchdog.h"
+#include "sched.h"
+#include "capture.h"
+#include "stream.h"
+#include "uplink.h"
+#include "compute.h"
+#include "source.h"
+#include "slave.h"
+#include "group.h"
+
+/*
+ * Sample groups: sources, possibly on different slaves, read at the same
+ * instant. A group has a single scheduler entry: when its deadline
+ * expires every member is read at once, ahead of the periodic polls of
+ * its slave, so reads on distinct slaves run in parallel over their own
+ * connections. Once all of them complete, the values are published in a
+ * single Snapshot signal along with the spread of their acquisition
+ * times. A round with a failed read is dropped: snapshots are complete
+ * or not sent at all. Reads and values reuse the buffers of the
+ * previous round, so a round doesn't allocate memory.
+ */
+
+/* Read of a member, holding a group reference */
+struct sample {
+	struct group *group;
+	unsigned int index;
+};
+
+struct member {
+	char *path;		/* Sources may go away: resolved every round */
+	struct sample sample;	/* Rounds don't overlap */
+	uint8_t *value;
+	uint16_t len;
+	uint64_t acquired;	/* Response received (us) */
+};
+
+struct group {
+	int refs;
+	bool removed;
+	char *name;
+	char *path;
+	uint16_t interval;	/* ms */
+	struct sched_entry *entry;
+	struct member *members;
+	unsigned int count;
+	unsigned int pending;	/* Reads of the current round */
+	bool failed;		/* Current round is incomplete */
+	uint64_t deadline;	/* Current round (us) */
+	uint64_t snapshots;
+	uint64_t incomplete;
+	uint64_t overruns;
+};
+
+static group_find_func_t find_source;
+static unsigned int group_index;
+
+static void group_free(struct group *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->count; i++) {
+		l_free(group->members[i].path);
+		l_free(group->members[i].value);
+	}
+
+	l_free(group->members);
+	l_free(group->name);
+	l_free(group->path);
+	l_free(group);
+}
+
+static struct group *group_ref(struct group *group)
+{
+	if (unlikely(!group))
+		return NULL;
+
+	__sync_fetch_and_add(&group->refs, 1);
+
+	return group;
+}
+
+static void group_unref(struct group *group)
+{
+	if (unlikely(!group))
+		return;
+
+	if (__sync_sub_and_fetch(&group->refs, 1))
+		return;
+
+	group_free(group);
+}
+
+static void snapshot_emit(struct group *group, uint64_t spread)
+{
+	struct l_dbus_message *signal;
+	struct l_dbus_message_builder *builder;
+	struct member *member;
+	unsigned int i;
+	uint16_t j;
+
+	signal = l_dbus_message_new_signal(dbus_get_bus(), group->path,
+					   GROUP_IFACE, "Snapshot");
+	builder = l_dbus_message_builder_new(signal);
+
+	l_dbus_message_builder_append_basic(builder, 't', &group->deadline);
+	l_dbus_message_builder_append_basic(builder, 't', &spread);
+	l_dbus_message_builder_enter_array(builder, "(oay)");
+
+	for (i = 0; i < group->count; i++) {
+		member = &group->members[i];
+
+		l_dbus_message_builder_enter_struct(builder, "oay");
+		l_dbus_message_builder_append_basic(builder, 'o',
+						    member->path);
+		l_dbus_message_builder_enter_array(builder, "y");
+		for (j = 0; j < member->len; j++)
+			l_dbus_message_builder_append_basic(builder, 'y',
+							&member->value[j]);
+		l_dbus_message_builder_leave_array(builder);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), signal);
+}
+
+static void round_complete(struct group *group)
+{
+	uint64_t first = UINT64_MAX;
+	uint64_t last = 0;
+	unsigned int i;
+
+	if (group->failed) {
+		group->incomplete++;
+		return;
+	}
+
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].acquired < first)
+			first = group->members[i].acquired;
+
+		if (group->members[i].acquired > last)
+			last = group->members[i].acquired;
+	}
+
+	group->snapshots++;
+	snapshot_emit(group, last - first);
+}
+
+static void round_release(struct group *group)
+{
+	if (--group->pending == 0)
+		round_complete(group);
+}
+
+static void sample_cb(int err, const uint8_t *pdu, int len, void *user_data)
+{
+	struct sample *sample = user_data;
+	struct group *group = sample->group;
+	struct member *member;
+	struct source *source;
+	struct slave *slave;
+	uint16_t data_len;
+
+	if (group->removed)
+		goto done;
+
+	member = &group->members[sample->index];
+	source = find_source(member->path, &slave);
+
+	if (err < 0 || !source || len < 2 ||
+	    pdu[0] != source_get_function(source)) {
+		group->failed = true;
+		goto release;
+	}
+
+	data_len = source_get_data_len(source);
+	if (pdu[1] != data_len || len < 2 + data_len) {
+		group->failed = true;
+		goto release;
+	}
+
+	member->acquired = l_time_now();
+	if (member->len != data_len) {
+		l_free(member->value);
+		member->value = l_malloc(data_len);
+		member->len = data_len;
+	}
+
+	memcpy(member->value, pdu + 2, data_len);
+
+	/* Also a regular sample of the source */
+	if (source_update(source, pdu + 2, data_len)) {
+		stream_publish(source, pdu + 2, data_len);
+		uplink_publish(source, pdu + 2, data_len);
+		compute_source_changed(source);
+	}
+
+release:
+	round_release(group);
+done:
+	group_unref(group);
+}
+
+static void group_expired(uint64_t deadline, void *user_data)
+{
+	struct group *group = user_data;
+	struct sample *sample;
+	struct source *source;
+	struct slave *slave;
+	unsigned int i;
+
+	/* Previous snapshot still being acquired */
+	if (group->pending) {
+		group->overruns++;
+		return;
+	}
+
+	group->deadline = deadline;
+	group->failed = false;
+
+	/* Held while issuing: reads may fail synchronously */
+	group->pending = 1;
+
+	for (i = 0; i < group->count; i++) {
+		source = find_source(group->members[i].path, &slave);
+		if (!source) {
+			group->failed = true;
+			continue;
+		}
+
+		sample = &group->members[i].sample;
+		group_ref(group);
+		group->pending++;
+
+		if (slave_sample(slave, source, sample_cb, sample) < 0) {
+			group->pending--;
+			group->failed = true;
+			group_unref(group);
+		}
+	}
+
+	round_release(group);
+}
+
+static bool property_get_name(struct l_dbus *dbus,
+			      struct l_dbus_message *msg,
+			      struct l_dbus_message_builder *builder,
+			      void *user_data)
+{
+	struct group *group = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 's', group->name);
+
+	return true;
+}
+
+static bool property_get_interval(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct group *group = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'q', &group->interval);
+
+	return true;
+}
+
+static bool property_get_sources(struct l_dbus *dbus,
+				 struct l_dbus_message *msg,
+				 struct l_dbus_message_builder *builder,
+				 void *user_data)
+{
+	struct group *group = user_data;
+	unsigned int i;
+
+	l_dbus_message_builder_enter_array(builder, "o");
+	for (i = 0; i < group->count; i++)
+		l_dbus_message_builder_append_basic(builder, 'o',
+						    group->members[i].path);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static bool property_get_snapshots(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct group *group = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 't', &group->snapshots);
+
+	return true;
+}
+
+static bool property_get_incomplete(struct l_dbus *dbus,
+				    struct l_dbus_message *msg,
+				    struct l_dbus_message_builder *builder,
+				    void *user_data)
+{
+	struct group *group = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 't', &group->incomplete);
+
+	return true;
+}
+
+static bool property_get_overruns(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct group *group = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 't', &group->overruns);
+
+	return true;
+}
+
+static void setup_interface(struct l_dbus_interface *interface)
+{
+	/* Deadline (us, monotonic), spread of acquisition times (us) */
+	l_dbus_interface_signal(interface, "Snapshot", 0, "tta(oay)",
+				"timestamp", "spread", "values");
+
+	if (!l_dbus_interface_property(interface, "Name", 0, "s",
+				       property_get_name,
+				       NULL))
+		l_error("Can't add 'Name' property");
+
+	/* Sampling interval: ms */
+	if (!l_dbus_interface_property(interface, "Interval", 0, "q",
+				       property_get_interval,
+				       NULL))
+		l_error("Can't add 'Interval' property");
+
+	if (!l_dbus_interface_property(interface, "Sources", 0, "ao",
+				       property_get_sources,
+				       NULL))
+		l_error("Can't add 'Sources' property");
+
+	if (!l_dbus_interface_property(interface, "Snapshots", 0, "t",
+				       property_get_snapshots,
+				       NULL))
+		l_error("Can't add 'Snapshots' property");
+
+	/* Rounds dropped: a member failed or was not connected */
+	if (!l_dbus_interface_property(interface, "Incomplete", 0, "t",
+				       property_get_incomplete,
+				       NULL))
+		l_error("Can't add 'Incomplete' property");
+
+	/* Deadlines skipped: previous round still in progress */
+	if (!l_dbus_interface_property(interface, "Overruns", 0, "t",
+				       property_get_overruns,
+				       NULL))
+		l_error("Can't add 'Overruns' property");
+}
+
+struct group *group_create(const char *name, uint16_t interval,
+			   const char **paths, unsigned int count)
+{
+	struct group *group;
+	struct slave *slave;
+	unsigned int i;
+
+	if (unlikely(!name || !paths || !count || !interval))
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if (!find_source(paths[i], &slave))
+			return NULL;
+	}
+
+	group = l_new(struct group, 1);
+	group->refs = 0;
+	group->name = l_strdup(name);
+	group->path = l_strdup_printf("/group_%04x", group_index++);
+	group->interval = interval;
+	group->count = count;
+	group->members = l_new(struct member, count);
+
+	for (i = 0; i < count; i++) {
+		group->members[i].path = l_strdup(paths[i]);
+		group->members[i].sample.group = group;
+		group->members[i].sample.index = i;
+	}
+
+	if (!l_dbus_register_object(dbus_get_bus(),
+				    group->path,
+				    group_ref(group),
+				    (l_dbus_destroy_func_t) group_unref,
+				    GROUP_IFACE, group,
+				    L_DBUS_INTERFACE_PROPERTIES, group,
+				    NULL)) {
+		l_error("Can not register: %s", group->path);
+		group_free(group);
+		return NULL;
+	}
+
+	/* One entry: all members share the same absolute deadline */
+	group->entry = sched_add(group, replay_scale(interval),
+				 group_expired, group);
+
+	l_info("Group(%p): (%s) name: (%s) sources: %u interval: %u",
+	       group, group->path, name, count, interval);
+
+	return group_ref(group);
+}
+
+void group_destroy(struct group *group)
+{
+	if (unlikely(!group))
+		return;
+
+	sched_remove(group->entry);
+	group->entry = NULL;
+
+	/* Reads still in flight release their references later */
+	group->removed = true;
+
+	l_dbus_unregister_object(dbus_get_bus(), group->path);
+	group_unref(group);
+}
+
+const char *group_get_path(const struct group *group)
+{
+	if (unlikely(!group))
+		return NULL;
+
+	return group->path;
+}
+
+int group_start(group_find_func_t find)
+{
+	l_info("Starting sample groups ...");
+
+	find_source = find;
+
+	if (!l_dbus_register_interface(dbus_get_bus(),
+				       GROUP_IFACE,
+				       setup_interface,
+				       NULL, false)) {
+		l_error("dbus: unable to register %s", GROUP_IFACE);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void group_stop(void)
+{
+	l_dbus_unregister_interface(dbus_get_bus(), GROUP_IFACE);
+	find_source = NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+struct slave;
+struct source;
+
+/* Resolves a source object path, and the slave it belongs to */
+typedef struct source *(*group_find_func_t) (const char *path,
+					     struct slave **slave);
+
+int group_start(group_find_func_t find);
+void group_stop(void);
+
+struct group;
+struct group *group_create(const char *name, uint16_t interval,
+			   const char **paths, unsigned int count);
+void group_destroy(struct group *group);
+const char *group_get_path(const struct group *group);
@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <getopt.h>
 
@@ -32,7 +33,12 @@
 
 #include "manager.h"
 
-static const char *config_file;
+static struct manager_options options = {
+	.storage_dir = STORAGEDIR,
+	.uplink_topic = "knot/modbus",
+	.replay_speed = 1.0,
+	.realtime_cpu = -1,
+};
 
 static void signal_handler(uint32_t signo, void *user_data)
 {
@@ -47,6 +53,19 @@ static void signal_handler(uint32_t signo, void *user_data)
 
 static const struct option main_options[] = {
 	{ "config",		required_argument,	NULL, 'c' },
+	{ "storage",		required_argument,	NULL, 's' },
+	{ "lazy-sources",	no_argument,		NULL, 'l' },
+	{ "capture",		required_argument,	NULL, 'C' },
+	{ "replay",		required_argument,	NULL, 'R' },
+	{ "replay-speed",	required_argument,	NULL, 'S' },
+	{ "listen",		required_argument,	NULL, 'L' },
+	{ "max-age",		required_argument,	NULL, 'A' },
+	{ "stream",		required_argument,	NULL, 't' },
+	{ "profiles",		required_argument,	NULL, 'P' },
+	{ "uplink",		required_argument,	NULL, 'U' },
+	{ "uplink-topic",	required_argument,	NULL, 'T' },
+	{ "realtime",		required_argument,	NULL, 'r' },
+	{ "cpu",		required_argument,	NULL, 'a' },
 	{ "help",		no_argument,		NULL, 'h' },
 	{ }
 };
@@ -56,14 +75,59 @@ static int parse_args(int argc, char *argv[])
 	int opt;
 
 	for (;;) {
-		opt = getopt_long(argc, argv, "c:",
+		opt = getopt_long(argc, argv, "c:s:lC:R:S:L:A:t:P:U:T:r:a:",
 				  main_options, NULL);
 		if (opt < 0)
 			break;
 
 		switch (opt) {
 		case 'c':
-			config_file = optarg;
+			options.config_file = optarg;
+			break;
+		case 's':
+			options.storage_dir = optarg;
+			break;
+		case 'l':
+			options.lazy_sources = true;
+			break;
+		case 'C':
+			options.capture_file = optarg;
+			break;
+		case 'R':
+			options.replay_file = optarg;
+			break;
+		case 'S':
+			options.replay_speed = strtod(optarg, NULL);
+			if (options.replay_speed <= 0)
+				return -EINVAL;
+			break;
+		case 'L':
+			options.server_address = optarg;
+			break;
+		case 'A':
+			options.server_max_age = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			options.stream_path = optarg;
+			break;
+		case 'P':
+			options.profile_dir = optarg;
+			break;
+		case 'U':
+			options.uplink_address = optarg;
+			break;
+		case 'T':
+			options.uplink_topic = optarg;
+			break;
+		case 'r':
+			options.realtime_priority = strtol(optarg, NULL, 0);
+			if (options.realtime_priority <= 0)
+				return -EINVAL;
+			break;
+		case 'a':
+			options.realtime_cpu = strtol(optarg, NULL, 0);
+			if (options.realtime_cpu < 0)
+				return -EINVAL;
 			break;
 		default:
 			return -EINVAL;
@@ -91,7 +155,7 @@ int main(int argc, char *argv[])
 
 	l_log_set_stderr();
 
-	if (manager_start(config_file) < 0)
+	if (manager_start(&options) < 0)
 		goto main_exit;
 
 	l_main_run_with_signal(signal_handler, NULL);
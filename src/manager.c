@@ -25,18 +25,73 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 #include <ell/ell.h>
 
 #include "dbus.h"
+#include "watchdog.h"
+#include "storage.h"
+#include "sched.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "server.h"
+#include "stream.h"
+#include "source.h"
 #include "slave.h"
+#include "group.h"
+#include "profile.h"
+#include "compute.h"
+#include "uplink.h"
+#include "rt.h"
+#include "store.h"
 #include "manager.h"
 
 #define MANAGER_INTERFACE		"br.org.cesar.modbus.Manager1"
+#define RELOAD_DELAY_MS			250
+#define LIST_MAX_COUNT			1000
+#define RT_FORWARD_RESERVE		128	/* Forwarded/sample requests */
+#define RT_STREAM_RESERVE		64	/* Stream batches, 16 kB each */
 
-typedef void (*foreach_source_func) (const char *id, const char *address, const char *name);
+typedef void (*foreach_source_func) (const char *id, const char *address,
+				     const char *name, const char *profile,
+				     bool enable, void *user_data);
+
+/* slaves.conf entry, indexed by slave id */
+struct conf_slave {
+	bool valid;
+	bool enable;
+	char *name;
+	char *address;
+	char *profile;
+};
+
+/* Bus name subscribed to value changes: dropped when it leaves */
+struct subscriber {
+	char *name;
+	unsigned int watch;
+	struct l_queue *paths;	/* Sources, by path: they may go away */
+};
 
 static struct l_settings *settings;
 static struct l_queue *slave_list;
+static struct l_queue *subscriber_list;
+static struct l_queue *group_list;
+static const char *config_path;
+static bool lazy_sources;
+static const char *server_address;
+static uint32_t server_max_age;
+static const char *stream_path;
+static char *profile_dir;
+static const char *uplink_address;
+static const char *uplink_topic;
+static const char *storage_dir;
+static int realtime_priority;
+static char *config_name;
+static struct l_io *inotify_io;
+static struct l_timeout *reload_to;
 
 static void settings_debug(const char *str, void *userdata)
 {
@@ -45,14 +100,28 @@ static void settings_debug(const char *str, void *userdata)
 
 static bool path_cmp(const void *a, const void *b)
 {
-	const char *a1 = a;
+	const struct slave *slave = a;
 	const char *b1 = b;
 
-	return (strcmp(a1, b1) == 0 ? true : false);
+	return (strcmp(slave_get_path(slave), b1) == 0 ? true : false);
+}
+
+static bool id_cmp(const void *a, const void *b)
+{
+	const struct slave *slave = a;
+	uint8_t id = L_PTR_TO_UINT(b);
+
+	return (slave_get_id(slave) == id ? true : false);
+}
+
+static struct slave *find_slave(uint8_t id)
+{
+	return l_queue_find(slave_list, id_cmp, L_UINT_TO_PTR(id));
 }
 
-static void create_from_storage(const char *id,
-				const char *address, const char *name)
+static void create_from_storage(const char *id, const char *address,
+				const char *name, const char *profile,
+				bool enable, void *user_data)
 {
 	struct slave *slave;
 	int slave_id;
@@ -60,11 +129,47 @@ static void create_from_storage(const char *id,
 	if (sscanf(id, "%x", &slave_id) != 1)
 		return;
 
+	if (find_slave(slave_id))
+		return;
+
 	slave = slave_create(slave_id, name, address);
 	if (!slave)
 		return;
 
 	l_queue_push_head(slave_list, slave);
+
+	if (profile && slave_set_profile(slave, profile) < 0)
+		l_error("slave %s: profile %s not found", id, profile);
+
+	/* Asynchronous: connections are paced by the slave module */
+	if (enable)
+		slave_enable(slave);
+}
+
+/* "/slave_XXXX/source_YYYY" */
+static struct source *find_slave_source(const char *path,
+					struct slave **slave)
+{
+	unsigned int id;
+
+	if (sscanf(path, "/slave_%4x/", &id) != 1 || id > UINT8_MAX)
+		return NULL;
+
+	*slave = find_slave(id);
+	if (!*slave)
+		return NULL;
+
+	return slave_find_source_by_path(*slave, path);
+}
+
+static struct source *find_source(const char *path)
+{
+	struct slave *slave;
+
+	if (strncmp(path, "/computed/", 10) == 0)
+		return compute_find(path);
+
+	return find_slave_source(path, &slave);
 }
 
 static void foreach_slave_register(const struct l_settings *settings,
@@ -73,6 +178,8 @@ static void foreach_slave_register(const struct l_settings *settings,
 	char **groups;
 	char *name;
 	char *address;
+	char *profile;
+	bool enable;
 	int index;
 
 	groups = l_settings_get_groups(settings);
@@ -93,8 +200,24 @@ static void foreach_slave_register(const struct l_settings *settings,
 			continue;
 		}
 
-		func(groups[index], address, name);
+		if (!l_settings_get_bool(settings, groups[index],
+					 "Enable", &enable))
+			enable = false;
+
+		/* Optional: register map shared with identical devices */
+		profile = l_settings_get_string(settings,
+						groups[index], "Profile");
+		if (profile && strlen(profile) > STORAGE_PROFILE_MAX) {
+			l_error("%s: profile name too long", groups[index]);
+			l_free(profile);
+			l_free(address);
+			l_free(name);
+			continue;
+		}
+
+		func(groups[index], address, name, profile, enable, user_data);
 
+		l_free(profile);
 		l_free(address);
 		l_free(name);
 	}
@@ -102,6 +225,285 @@ static void foreach_slave_register(const struct l_settings *settings,
 	l_strfreev(groups);
 }
 
+static void restore_slave(uint8_t id, const char *name,
+			  const char *address, void *user_data)
+{
+	struct slave *slave;
+
+	/* slaves.conf takes precedence over slaves added at runtime */
+	if (find_slave(id))
+		return;
+
+	slave = slave_create(id, name, address);
+	if (!slave)
+		return;
+
+	l_queue_push_head(slave_list, slave);
+}
+
+static void restore_source(uint8_t slave_id, const char *name,
+			   const char *type, uint16_t address,
+			   uint16_t size, uint16_t interval, uint8_t priority,
+			   uint8_t max_backoff, void *user_data)
+{
+	struct slave **table = user_data;
+
+	if (!table[slave_id])
+		return;
+
+	slave_add_source(table[slave_id], name, type, address, size, interval,
+			 priority, max_backoff);
+}
+
+static void restore_hole(uint8_t slave_id, uint8_t function,
+			 uint16_t address, uint16_t count, void *user_data)
+{
+	struct slave **table = user_data;
+
+	if (!table[slave_id])
+		return;
+
+	slave_add_hole(table[slave_id], function, address, count);
+}
+
+static void restore_profile(uint8_t slave_id, const char *profile,
+			    void *user_data)
+{
+	struct slave **table = user_data;
+
+	if (!table[slave_id])
+		return;
+
+	if (slave_set_profile(table[slave_id], profile) < 0)
+		l_error("slave 0x%02x: profile %s not found", slave_id,
+			profile);
+}
+
+static void table_add_slave(void *data, void *user_data)
+{
+	struct slave *slave = data;
+	struct slave **table = user_data;
+
+	table[slave_get_id(slave)] = slave;
+}
+
+static void conf_fill(const char *id, const char *address,
+		      const char *name, const char *profile, bool enable,
+		      void *user_data)
+{
+	struct conf_slave *conf = user_data;
+	int slave_id;
+
+	if (sscanf(id, "%x", &slave_id) != 1 || slave_id > UINT8_MAX)
+		return;
+
+	/* First group wins, as in create_from_storage() */
+	if (conf[slave_id].valid)
+		return;
+
+	conf[slave_id].valid = true;
+	conf[slave_id].enable = enable;
+	conf[slave_id].name = l_strdup(name);
+	conf[slave_id].address = l_strdup(address);
+	conf[slave_id].profile = l_strdup(profile);
+}
+
+static void conf_free(struct conf_slave *conf)
+{
+	int i;
+
+	for (i = 0; i <= UINT8_MAX; i++) {
+		l_free(conf[i].name);
+		l_free(conf[i].address);
+		l_free(conf[i].profile);
+	}
+
+	l_free(conf);
+}
+
+/*
+ * Applies the difference between two slaves.conf revisions to the live
+ * slave list. Slaves whose entry didn't change are not touched at all:
+ * their connection and polling entries survive the reload.
+ */
+static void config_apply(const struct conf_slave *old,
+			 const struct conf_slave *new)
+{
+	struct slave *table[UINT8_MAX + 1];
+	struct slave *slave;
+	unsigned int created = 0;
+	unsigned int modified = 0;
+	unsigned int removed = 0;
+	int id;
+
+	memset(table, 0, sizeof(table));
+
+	for (id = 0; id <= UINT8_MAX; id++) {
+		slave = find_slave(id);
+
+		if (!new[id].valid) {
+			if (!old[id].valid || !slave)
+				continue;
+
+			l_queue_remove(slave_list, slave);
+			slave_destroy(slave);
+			removed++;
+			continue;
+		}
+
+		if (!slave) {
+			slave = slave_create(id, new[id].name,
+					     new[id].address);
+			if (!slave)
+				continue;
+
+			l_queue_push_head(slave_list, slave);
+			table[id] = slave;
+			created++;
+
+			if (new[id].profile &&
+			    slave_set_profile(slave, new[id].profile) < 0)
+				l_error("slave 0x%02x: profile %s not found",
+					id, new[id].profile);
+
+			if (new[id].enable)
+				slave_enable(slave);
+			continue;
+		}
+
+		if (old[id].valid &&
+		    old[id].enable == new[id].enable &&
+		    strcmp(old[id].name, new[id].name) == 0 &&
+		    strcmp(old[id].address, new[id].address) == 0 &&
+		    l_streq0(old[id].profile, new[id].profile))
+			continue;
+
+		slave_set_name(slave, new[id].name);
+		if (slave_set_address(slave, new[id].address) < 0)
+			continue;
+
+		if (slave_set_profile(slave, new[id].profile) < 0)
+			l_error("slave 0x%02x: profile %s not found",
+				id, new[id].profile);
+
+		if (new[id].enable && (!old[id].valid || !old[id].enable))
+			slave_enable(slave);
+		else if (!new[id].enable && old[id].valid && old[id].enable)
+			slave_disable(slave);
+
+		modified++;
+	}
+
+	/* Sources added at runtime to (re)created slaves */
+	if (created) {
+		storage_foreach_source(restore_source, table);
+		storage_foreach_hole(restore_hole, table);
+	}
+
+	l_info("%s reloaded: %u created, %u modified, %u removed",
+	       config_path, created, modified, removed);
+}
+
+static void reload_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct l_settings *new_settings;
+	struct conf_slave *old;
+	struct conf_slave *new;
+	WATCHDOG_SCOPE("config reload");
+
+	l_timeout_remove(reload_to);
+	reload_to = NULL;
+
+	new_settings = l_settings_new();
+	l_settings_set_debug(new_settings, settings_debug, NULL, NULL);
+	if (!l_settings_load_from_file(new_settings, config_path)) {
+		l_error("Can't load %s: keeping current slaves", config_path);
+		l_settings_free(new_settings);
+		return;
+	}
+
+	old = l_new(struct conf_slave, UINT8_MAX + 1);
+	new = l_new(struct conf_slave, UINT8_MAX + 1);
+	memset(old, 0, sizeof(*old) * (UINT8_MAX + 1));
+	memset(new, 0, sizeof(*new) * (UINT8_MAX + 1));
+
+	foreach_slave_register(settings, conf_fill, old);
+	foreach_slave_register(new_settings, conf_fill, new);
+
+	config_apply(old, new);
+
+	conf_free(old);
+	conf_free(new);
+
+	l_settings_free(settings);
+	settings = new_settings;
+}
+
+static bool inotify_read_cb(struct l_io *io, void *user_data)
+{
+	char buf[4096] __attribute__ ((aligned(8)));
+	const struct inotify_event *event;
+	bool changed = false;
+	ssize_t len;
+	char *ptr;
+	WATCHDOG_SCOPE("inotify");
+
+	len = read(l_io_get_fd(io), buf, sizeof(buf));
+	if (len <= 0)
+		return true;
+
+	for (ptr = buf; ptr < buf + len;
+	     ptr += sizeof(struct inotify_event) + event->len) {
+		event = (const struct inotify_event *) ptr;
+		if (event->len && strcmp(event->name, config_name) == 0)
+			changed = true;
+	}
+
+	if (!changed)
+		return true;
+
+	/* Editors write in several steps: wait for the file to settle */
+	if (reload_to)
+		l_timeout_modify_ms(reload_to, RELOAD_DELAY_MS);
+	else
+		reload_to = l_timeout_create_ms(RELOAD_DELAY_MS,
+						reload_to_expired, NULL, NULL);
+
+	return true;
+}
+
+static void config_watch(const char *path)
+{
+	char *dir_copy;
+	char *name_copy;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		l_error("inotify: %s", strerror(errno));
+		return;
+	}
+
+	/* Watch the directory: files are often replaced, not rewritten */
+	dir_copy = l_strdup(path);
+	name_copy = l_strdup(path);
+	config_name = l_strdup(basename(name_copy));
+
+	if (inotify_add_watch(fd, dirname(dir_copy), IN_CLOSE_WRITE |
+			      IN_MOVED_TO | IN_CREATE) < 0) {
+		l_error("inotify: %s: %s", path, strerror(errno));
+		close(fd);
+		goto done;
+	}
+
+	inotify_io = l_io_new(fd);
+	l_io_set_close_on_destroy(inotify_io, true);
+	l_io_set_read_handler(inotify_io, inotify_read_cb, NULL, NULL);
+done:
+	l_free(dir_copy);
+	l_free(name_copy);
+}
+
 static struct l_dbus_message *method_slave_add(struct l_dbus *dbus,
 						struct l_dbus_message *msg,
 						void *user_data)
@@ -114,7 +516,9 @@ static struct l_dbus_message *method_slave_add(struct l_dbus *dbus,
 	const char *key = NULL;
 	const char *name = NULL;
 	const char *address = NULL;
+	const char *profile = NULL;
 	uint8_t slave_id = 0;
+	WATCHDOG_SCOPE("AddSlave");
 
 	if (!l_dbus_message_get_arguments(msg, "a{sv}", &dict))
 		return dbus_error_invalid_args(msg);
@@ -122,7 +526,9 @@ static struct l_dbus_message *method_slave_add(struct l_dbus *dbus,
 	/*
 	 * "Id": modbus slave id (1 - 247)
 	 * "Name": Friendly/local name
-	 * "Address: host:port or /dev/ttyACM0, /dev/ttyUSB0, ...
+	 * "Address: host:port, tcp://, rtu+tcp://, udp:// or rtu:// URI:
+	 *	see transport_parse()
+	 * "Profile": device profile providing the sources (optional)
 	 */
 	while (l_dbus_message_iter_next_entry(&dict, &key, &value)) {
 		if (strcmp(key, "Name") == 0)
@@ -131,6 +537,8 @@ static struct l_dbus_message *method_slave_add(struct l_dbus *dbus,
 			l_dbus_message_iter_get_variant(&value, "s", &address);
 		else if (strcmp(key, "Id") == 0)
 			l_dbus_message_iter_get_variant(&value, "y", &slave_id);
+		else if (strcmp(key, "Profile") == 0)
+			l_dbus_message_iter_get_variant(&value, "s", &profile);
 		else
 			return dbus_error_invalid_args(msg);
 	}
@@ -140,13 +548,31 @@ static struct l_dbus_message *method_slave_add(struct l_dbus *dbus,
 	if (!address || slave_id == 0)
 		return dbus_error_invalid_args(msg);
 
-	/* TODO: Add to storage and create slave object */
+	/* Stored as is: a truncated name would restore another profile */
+	if (profile && strlen(profile) > STORAGE_PROFILE_MAX)
+		return dbus_error_invalid_args(msg);
+
+	if (find_slave(slave_id))
+		return dbus_error_errno(msg, "AlreadyExists", EEXIST);
+
 	slave = slave_create(slave_id, name ? : address, address);
 	if (!slave)
 		return dbus_error_invalid_args(msg);
 
+	if (profile && slave_set_profile(slave, profile) < 0) {
+		slave_destroy(slave);
+		return dbus_error_errno(msg, "ProfileNotFound", ENOENT);
+	}
+
 	l_queue_push_head(slave_list, slave);
 
+	if (storage_slave_add(slave_id, name ? : address, address) < 0)
+		l_error("storage: unable to store slave 0x%02x", slave_id);
+
+	if (profile && storage_profile_set(slave_id, profile) < 0)
+		l_error("storage: unable to store profile of 0x%02x",
+			slave_id);
+
 	/* Add object path to reply message */
 	reply = l_dbus_message_new_method_return(msg);
 	builder = l_dbus_message_builder_new(reply);
@@ -173,13 +599,410 @@ static struct l_dbus_message *method_slave_remove(struct l_dbus *dbus,
 	if (!slave)
 		return dbus_error_invalid_args(msg);
 
+	storage_slave_remove(slave_get_id(slave));
 	slave_destroy(slave);
 
-	/* TODO: remove from storage and destroy slave object */
+	return l_dbus_message_new_method_return(msg);
+}
+
+/* All or nothing: an empty array applies to every slave */
+static struct l_dbus_message *slaves_apply(struct l_dbus_message *msg,
+					   void (*func) (struct slave *))
+{
+	const struct l_queue_entry *entry;
+	struct l_dbus_message_iter iter;
+	const char *path;
+	bool all = true;
+
+	if (!l_dbus_message_get_arguments(msg, "ao", &iter))
+		return dbus_error_invalid_args(msg);
+
+	while (l_dbus_message_iter_next_entry(&iter, &path)) {
+		if (!l_queue_find(slave_list, path_cmp, path))
+			return dbus_error_invalid_args(msg);
+
+		all = false;
+	}
+
+	if (all) {
+		for (entry = l_queue_get_entries(slave_list); entry;
+		     entry = entry->next)
+			func(entry->data);
+
+		return l_dbus_message_new_method_return(msg);
+	}
+
+	l_dbus_message_get_arguments(msg, "ao", &iter);
+	while (l_dbus_message_iter_next_entry(&iter, &path))
+		func(l_queue_find(slave_list, path_cmp, path));
 
 	return l_dbus_message_new_method_return(msg);
 }
 
+static struct l_dbus_message *method_slaves_pause(struct l_dbus *dbus,
+						  struct l_dbus_message *msg,
+						  void *user_data)
+{
+	return slaves_apply(msg, slave_pause);
+}
+
+static struct l_dbus_message *method_slaves_resume(struct l_dbus *dbus,
+						   struct l_dbus_message *msg,
+						   void *user_data)
+{
+	return slaves_apply(msg, slave_resume);
+}
+
+static struct l_dbus_message *method_slave_list(struct l_dbus *dbus,
+						struct l_dbus_message *msg,
+						void *user_data)
+{
+	const struct l_queue_entry *entry;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	struct slave *slave;
+	uint32_t offset;
+	uint32_t count;
+	WATCHDOG_SCOPE("ListSlaves");
+
+	if (!l_dbus_message_get_arguments(msg, "uu", &offset, &count))
+		return dbus_error_invalid_args(msg);
+
+	if (count > LIST_MAX_COUNT)
+		count = LIST_MAX_COUNT;
+
+	entry = l_queue_get_entries(slave_list);
+	for (; entry && offset; entry = entry->next, offset--)
+		;
+
+	reply = l_dbus_message_new_method_return(msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "(oa{sv})");
+
+	for (; entry && count; entry = entry->next, count--) {
+		slave = entry->data;
+
+		l_dbus_message_builder_enter_struct(builder, "oa{sv}");
+		l_dbus_message_builder_append_basic(builder, 'o',
+						    slave_get_path(slave));
+		slave_append_properties(slave, builder);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static bool subscriber_match(const void *a, const void *b)
+{
+	const struct subscriber *subscriber = a;
+
+	return strcmp(subscriber->name, b) == 0;
+}
+
+static bool path_match(const void *a, const void *b)
+{
+	return strcmp(a, b) == 0;
+}
+
+static void subscriber_unwatch_path(void *data, void *user_data)
+{
+	struct subscriber *subscriber = user_data;
+	struct source *source = find_source(data);
+
+	/* Re-created source with the same path: not watched by this name */
+	if (source)
+		source_unwatch(source, subscriber->name);
+}
+
+static void subscriber_free(void *data)
+{
+	struct subscriber *subscriber = data;
+
+	l_queue_foreach(subscriber->paths, subscriber_unwatch_path,
+			subscriber);
+	l_queue_destroy(subscriber->paths, l_free);
+	l_free(subscriber->name);
+	l_free(subscriber);
+}
+
+static void subscriber_remove(struct subscriber *subscriber)
+{
+	l_queue_remove(subscriber_list, subscriber);
+
+	/* Also frees the subscriber: see subscriber_get() */
+	l_dbus_remove_watch(dbus_get_bus(), subscriber->watch);
+}
+
+static void watch_remove_idle(void *user_data)
+{
+	l_dbus_remove_watch(dbus_get_bus(), L_PTR_TO_UINT(user_data));
+}
+
+static void subscriber_disconnected(struct l_dbus *dbus, void *user_data)
+{
+	struct subscriber *subscriber = user_data;
+
+	l_info("Subscriber %s left", subscriber->name);
+
+	/* Not from within the watch callback itself */
+	l_queue_remove(subscriber_list, subscriber);
+	l_idle_oneshot(watch_remove_idle, L_UINT_TO_PTR(subscriber->watch),
+		       NULL);
+}
+
+static struct subscriber *subscriber_get(const char *name)
+{
+	struct subscriber *subscriber;
+
+	subscriber = l_queue_find(subscriber_list, subscriber_match, name);
+	if (subscriber)
+		return subscriber;
+
+	subscriber = l_new(struct subscriber, 1);
+	subscriber->name = l_strdup(name);
+	subscriber->paths = l_queue_new();
+	subscriber->watch = l_dbus_add_disconnect_watch(dbus_get_bus(), name,
+							subscriber_disconnected,
+							subscriber,
+							subscriber_free);
+	l_queue_push_tail(subscriber_list, subscriber);
+
+	return subscriber;
+}
+
+static struct l_dbus_message *method_subscribe(struct l_dbus *dbus,
+					       struct l_dbus_message *msg,
+					       void *user_data)
+{
+	struct subscriber *subscriber;
+	struct l_dbus_message_iter iter;
+	struct source *source;
+	const char *sender = l_dbus_message_get_sender(msg);
+	const char *path;
+
+	if (!l_dbus_message_get_arguments(msg, "ao", &iter))
+		return dbus_error_invalid_args(msg);
+
+	/* All or nothing: check every path first */
+	while (l_dbus_message_iter_next_entry(&iter, &path)) {
+		if (!find_source(path))
+			return dbus_error_invalid_args(msg);
+	}
+
+	subscriber = subscriber_get(sender);
+
+	l_dbus_message_get_arguments(msg, "ao", &iter);
+	while (l_dbus_message_iter_next_entry(&iter, &path)) {
+		source = find_source(path);
+
+		/* Lazily exported sources: signals need the object */
+		source_register(source);
+
+		if (source_watch(source, sender))
+			l_queue_push_tail(subscriber->paths, l_strdup(path));
+	}
+
+	if (l_queue_isempty(subscriber->paths))
+		subscriber_remove(subscriber);
+
+	return l_dbus_message_new_method_return(msg);
+}
+
+static struct l_dbus_message *method_unsubscribe(struct l_dbus *dbus,
+						 struct l_dbus_message *msg,
+						 void *user_data)
+{
+	struct subscriber *subscriber;
+	struct l_dbus_message_iter iter;
+	struct source *source;
+	const char *sender = l_dbus_message_get_sender(msg);
+	const char *path;
+
+	if (!l_dbus_message_get_arguments(msg, "ao", &iter))
+		return dbus_error_invalid_args(msg);
+
+	subscriber = l_queue_find(subscriber_list, subscriber_match, sender);
+	if (!subscriber)
+		return l_dbus_message_new_method_return(msg);
+
+	while (l_dbus_message_iter_next_entry(&iter, &path)) {
+		l_free(l_queue_remove_if(subscriber->paths, path_match, path));
+
+		source = find_source(path);
+		if (source)
+			source_unwatch(source, sender);
+	}
+
+	if (l_queue_isempty(subscriber->paths))
+		subscriber_remove(subscriber);
+
+	return l_dbus_message_new_method_return(msg);
+}
+
+static bool group_path_cmp(const void *a, const void *b)
+{
+	const struct group *group = a;
+
+	return strcmp(group_get_path(group), b) == 0;
+}
+
+static struct l_dbus_message *method_group_add(struct l_dbus *dbus,
+					       struct l_dbus_message *msg,
+					       void *user_data)
+{
+	struct group *group;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message_iter iter;
+	const char **paths = NULL;
+	const char *name;
+	const char *path;
+	uint16_t interval;
+	unsigned int count = 0;
+
+	if (!l_dbus_message_get_arguments(msg, "sqao", &name, &interval,
+					  &iter))
+		return dbus_error_invalid_args(msg);
+
+	/* Paths point into the message: valid until it is released */
+	while (l_dbus_message_iter_next_entry(&iter, &path)) {
+		paths = l_realloc(paths, (count + 1) * sizeof(*paths));
+		paths[count++] = path;
+	}
+
+	group = group_create(name, interval, paths, count);
+	l_free(paths);
+	if (!group)
+		return dbus_error_invalid_args(msg);
+
+	l_queue_push_tail(group_list, group);
+
+	reply = l_dbus_message_new_method_return(msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_append_basic(builder, 'o',
+					    group_get_path(group));
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static struct l_dbus_message *method_group_remove(struct l_dbus *dbus,
+						  struct l_dbus_message *msg,
+						  void *user_data)
+{
+	struct group *group;
+	const char *path;
+
+	if (!l_dbus_message_get_arguments(msg, "o", &path))
+		return dbus_error_invalid_args(msg);
+
+	group = l_queue_remove_if(group_list, group_path_cmp, path);
+	if (!group)
+		return dbus_error_invalid_args(msg);
+
+	group_destroy(group);
+
+	return l_dbus_message_new_method_return(msg);
+}
+
+static struct l_dbus_message *method_computed_add(struct l_dbus *dbus,
+						  struct l_dbus_message *msg,
+						  void *user_data)
+{
+	struct source *source;
+	struct source **inputs = NULL;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message_iter iter;
+	const char *name;
+	const char *expression;
+	const char *path;
+	unsigned int count = 0;
+
+	if (!l_dbus_message_get_arguments(msg, "ssao", &name, &expression,
+					  &iter))
+		return dbus_error_invalid_args(msg);
+
+	/* "$N" in the expression refers to the N-th input */
+	while (l_dbus_message_iter_next_entry(&iter, &path)) {
+		inputs = l_realloc(inputs, (count + 1) * sizeof(*inputs));
+		inputs[count] = find_source(path);
+		if (!inputs[count]) {
+			l_free(inputs);
+			return dbus_error_invalid_args(msg);
+		}
+
+		count++;
+	}
+
+	source = compute_create(name, expression, inputs, count);
+	l_free(inputs);
+	if (!source)
+		return dbus_error_invalid_args(msg);
+
+	reply = l_dbus_message_new_method_return(msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_append_basic(builder, 'o',
+					    source_get_path(source));
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static struct l_dbus_message *method_computed_remove(struct l_dbus *dbus,
+						     struct l_dbus_message *msg,
+						     void *user_data)
+{
+	const char *path;
+
+	if (!l_dbus_message_get_arguments(msg, "o", &path))
+		return dbus_error_invalid_args(msg);
+
+	if (compute_remove(path) < 0)
+		return dbus_error_invalid_args(msg);
+
+	return l_dbus_message_new_method_return(msg);
+}
+
+static void append_profile(uint32_t interval, const unsigned int *slots,
+			   void *user_data)
+{
+	struct l_dbus_message_builder *builder = user_data;
+	uint32_t load;
+	int i;
+
+	l_dbus_message_builder_enter_struct(builder, "uau");
+	l_dbus_message_builder_append_basic(builder, 'u', &interval);
+	l_dbus_message_builder_enter_array(builder, "u");
+
+	for (i = 0; i < SCHED_PHASE_SLOTS; i++) {
+		load = slots[i];
+		l_dbus_message_builder_append_basic(builder, 'u', &load);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_struct(builder);
+}
+
+static bool property_get_load_profile(struct l_dbus *dbus,
+				      struct l_dbus_message *msg,
+				      struct l_dbus_message_builder *builder,
+				      void *user_data)
+{
+	/* Scheduled sources per phase slot, for each polling interval */
+	l_dbus_message_builder_enter_array(builder, "(uau)");
+	sched_foreach_profile(append_profile, builder);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
 static void setup_interface(struct l_dbus_interface *interface)
 {
 	/* Add/Remove slaves (a.k.a variables)  */
@@ -189,10 +1012,53 @@ static void setup_interface(struct l_dbus_interface *interface)
 
 	l_dbus_interface_method(interface, "RemoveSlave", 0,
 				method_slave_remove, "", "o", "path");
+
+	/* Maintenance: suspend polling, connections are kept */
+	l_dbus_interface_method(interface, "PauseSlaves", 0,
+				method_slaves_pause, "", "ao", "slaves");
+
+	l_dbus_interface_method(interface, "ResumeSlaves", 0,
+				method_slaves_resume, "", "ao", "slaves");
+
+	/* Paged alternative to GetManagedObjects */
+	l_dbus_interface_method(interface, "ListSlaves", 0,
+				method_slave_list, "a(oa{sv})", "uu",
+				"slaves", "offset", "count");
+
+	/* Source1.Value changes are signalled to subscribed sources only */
+	l_dbus_interface_method(interface, "Subscribe", 0,
+				method_subscribe, "", "ao", "sources");
+
+	l_dbus_interface_method(interface, "Unsubscribe", 0,
+				method_unsubscribe, "", "ao", "sources");
+
+	/* Sources sampled together: see Group1 */
+	l_dbus_interface_method(interface, "AddGroup", 0,
+				method_group_add, "o", "sqao",
+				"path", "name", "interval", "sources");
+
+	l_dbus_interface_method(interface, "RemoveGroup", 0,
+				method_group_remove, "", "o", "path");
+
+	/* Source1 objects derived from other sources: see compute.c */
+	l_dbus_interface_method(interface, "AddComputed", 0,
+				method_computed_add, "o", "ssao",
+				"path", "name", "expression", "inputs");
+
+	l_dbus_interface_method(interface, "RemoveComputed", 0,
+				method_computed_remove, "", "o", "path");
+
+	if (!l_dbus_interface_property(interface, "LoadProfile", 0, "a(uau)",
+				       property_get_load_profile,
+				       NULL))
+		l_error("Can't add 'LoadProfile' property");
 }
 
 static void ready_cb(void *user_data)
 {
+	struct slave *table[UINT8_MAX + 1];
+	int err;
+
 	if (!l_dbus_register_interface(dbus_get_bus(),
 				       MANAGER_INTERFACE,
 				       setup_interface,
@@ -205,6 +1071,29 @@ static void ready_cb(void *user_data)
 					 NULL))
 		l_error("dbus: unable to add %s to '/'", MANAGER_INTERFACE);
 
+	stats_start();
+
+	/* Totals across all slaves */
+	if (!l_dbus_object_add_interface(dbus_get_bus(),
+					 "/",
+					 STATISTICS_IFACE,
+					 stats_global()))
+		l_error("dbus: unable to add %s to '/'", STATISTICS_IFACE);
+
+	if (trace_start(storage_dir) == 0 &&
+	    !l_dbus_object_add_interface(dbus_get_bus(),
+					 "/",
+					 TRACE_IFACE,
+					 NULL))
+		l_error("dbus: unable to add %s to '/'", TRACE_IFACE);
+
+	if (watchdog_start() == 0 &&
+	    !l_dbus_object_add_interface(dbus_get_bus(),
+					 "/",
+					 LOOP_IFACE,
+					 NULL))
+		l_error("dbus: unable to add %s to '/'", LOOP_IFACE);
+
 	if (!l_dbus_object_add_interface(dbus_get_bus(),
 					 "/",
 					 L_DBUS_INTERFACE_PROPERTIES,
@@ -212,16 +1101,74 @@ static void ready_cb(void *user_data)
 		l_error("dbus: unable to add %s to '/'",
 			L_DBUS_INTERFACE_PROPERTIES);
 
-	slave_start(user_data);
+	slave_start(user_data, lazy_sources);
 
 	/* Registering all slaves */
 	foreach_slave_register(settings, create_from_storage, NULL);
+
+	config_watch(config_path);
+
+	/* Slaves and sources added at runtime */
+	storage_foreach_slave(restore_slave, NULL);
+
+	/* Slave id is 8-bit wide: direct lookup table */
+	memset(table, 0, sizeof(table));
+	l_queue_foreach(slave_list, table_add_slave, table);
+	storage_foreach_profile(restore_profile, table);
+	storage_foreach_source(restore_source, table);
+	storage_foreach_hole(restore_hole, table);
+
+	group_start(find_slave_source);
+
+	if (server_address) {
+		err = server_start(server_address, server_max_age,
+				   find_slave);
+		if (err < 0)
+			l_error("server: %s: %s", server_address,
+				strerror(-err));
+	}
+
+	if (stream_path) {
+		err = stream_start(stream_path, find_source);
+		if (err < 0)
+			l_error("stream: %s: %s", stream_path,
+				strerror(-err));
+	}
+
+	if (uplink_address) {
+		err = uplink_start(uplink_address, uplink_topic, storage_dir);
+		if (err < 0)
+			l_error("uplink: %s: %s", uplink_address,
+				strerror(-err));
+	}
+
+	/* Last: locks and prefaults what was allocated so far */
+	if (realtime_priority) {
+		slave_reserve(RT_FORWARD_RESERVE);
+		stream_reserve(RT_STREAM_RESERVE);
+
+		err = rt_start(realtime_priority);
+		if (err < 0)
+			l_error("realtime: %s (%d)", strerror(-err), -err);
+	}
 }
 
-int manager_start(const char *config_file)
+int manager_start(const struct manager_options *options)
 {
+	const char *config_file = options->config_file;
+	char *dir_copy;
+	int err;
+
 	l_info("Starting manager ...");
 
+	/* Even without real-time priority: less migration, warmer caches */
+	if (options->realtime_cpu >= 0) {
+		err = rt_pin(options->realtime_cpu);
+		if (err < 0)
+			l_error("cpu %d: %s", options->realtime_cpu,
+				strerror(-err));
+	}
+
 	/* Slave settings file */
 	settings = l_settings_new();
 	if (settings == NULL)
@@ -231,15 +1178,99 @@ int manager_start(const char *config_file)
 	if (!l_settings_load_from_file(settings, config_file))
 		return -EIO;
 
+	err = storage_open(options->storage_dir);
+	if (err < 0)
+		l_error("storage: %s (%d): changes won't be persisted",
+			strerror(-err), -err);
+
+	if (options->capture_file) {
+		err = capture_open(options->capture_file);
+		if (err < 0) {
+			l_error("capture: %s: %s", options->capture_file,
+				strerror(-err));
+			return err;
+		}
+	}
+
+	if (options->replay_file) {
+		err = replay_open(options->replay_file,
+				  options->replay_speed);
+		if (err < 0) {
+			l_error("replay: %s: %s", options->replay_file,
+				strerror(-err));
+			capture_close();
+			return err;
+		}
+	}
+
+	/* Next to slaves.conf unless told otherwise */
+	if (options->profile_dir) {
+		profile_dir = l_strdup(options->profile_dir);
+	} else {
+		dir_copy = l_strdup(config_file);
+		profile_dir = l_strdup_printf("%s/profiles",
+					      dirname(dir_copy));
+		l_free(dir_copy);
+	}
+
+	profile_start(profile_dir);
+
 	slave_list = l_queue_new();
+	subscriber_list = l_queue_new();
+	group_list = l_queue_new();
+
+	store_start();
+	sched_start();
+	compute_start();
+
+	config_path = config_file;
+	lazy_sources = options->lazy_sources;
+	server_address = options->server_address;
+	server_max_age = options->server_max_age;
+	stream_path = options->stream_path;
+	uplink_address = options->uplink_address;
+	uplink_topic = options->uplink_topic;
+	storage_dir = options->storage_dir;
+	realtime_priority = options->realtime_priority;
 
 	return dbus_start(ready_cb, (void *) config_file);
 }
 
 void manager_stop(void)
 {
+	struct subscriber *subscriber;
+
 	l_info("Stopping manager ...");
+	rt_stop();
+	l_io_destroy(inotify_io);
+	l_timeout_remove(reload_to);
+	l_free(config_name);
+
+	/* Subscribers refer to sources: release them first */
+	while ((subscriber = l_queue_peek_head(subscriber_list)))
+		subscriber_remove(subscriber);
+
+	l_queue_destroy(subscriber_list, NULL);
+	l_queue_destroy(group_list, (l_queue_destroy_func_t) group_destroy);
+	group_stop();
+	compute_stop();
 	l_queue_destroy(slave_list, (l_queue_destroy_func_t) slave_destroy);
+	server_stop();
+	stream_stop();
+	uplink_stop();
 	slave_stop();
+	profile_stop();
+	l_free(profile_dir);
+	stats_stop();
+	trace_stop();
+	watchdog_stop();
+	sched_stop();
+	storage_close();
+	capture_close();
+	replay_close();
+	l_settings_free(settings);
 	dbus_stop();
+
+	/* Last: sources are released with their D-Bus objects */
+	store_stop();
 }
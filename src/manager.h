@@ -19,5 +19,22 @@
  *
  */
 
-int manager_start(const char *config_file);
+struct manager_options {
+	const char *config_file;	/* slaves.conf */
+	const char *storage_dir;
+	bool lazy_sources;		/* Export sources on first access */
+	const char *capture_file;	/* Record requests and responses */
+	const char *replay_file;	/* Serve responses from a capture */
+	double replay_speed;
+	const char *server_address;	/* Modbus TCP server: [host:]port */
+	uint32_t server_max_age;	/* ms, 0: per source default */
+	const char *stream_path;	/* SOCK_SEQPACKET data plane */
+	const char *profile_dir;	/* Device profiles: <name>.conf */
+	const char *uplink_address;	/* MQTT broker: host:port */
+	const char *uplink_topic;
+	int realtime_priority;		/* SCHED_FIFO, 0: disabled */
+	int realtime_cpu;		/* -1: any, also without priority */
+};
+
+int manager_start(const struct manager_options *options);
 void manager_stop(void);
@@ -0,0 +1,288 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ell/ell.h>
+
+#include "source.h"
+#include "profile.h"
+
+/*
+ * Device profiles: register maps shared by identical devices, kept in
+ * "<dir>/<name>.conf". Each group of the file describes one source:
+ *
+ *   [voltage]
+ *   Type=holding
+ *   Address=1
+ *   Size=2
+ *   PollingInterval=1000
+ *   Priority=0
+ *
+ * A profile is parsed and validated the first time a slave references
+ * it, and compiled into an immutable table sorted by address. Every
+ * slave using the profile shares that table: provisioning a slave
+ * doesn't parse anything nor write source records to storage.
+ */
+
+#define PROFILE_MAX_ENTRIES	1024
+
+struct profile {
+	int refs;
+	char *name;
+	struct profile_entry *entries;
+	unsigned int count;
+};
+
+static char *profile_dir;
+static struct l_hashmap *profile_map;	/* Loaded profiles, by name */
+
+static void profile_free(struct profile *profile)
+{
+	unsigned int i;
+
+	for (i = 0; i < profile->count; i++) {
+		l_free(profile->entries[i].name);
+		l_free(profile->entries[i].type);
+	}
+
+	l_free(profile->entries);
+	l_free(profile->name);
+	l_free(profile);
+}
+
+static struct profile *profile_ref(struct profile *profile)
+{
+	if (unlikely(!profile))
+		return NULL;
+
+	__sync_fetch_and_add(&profile->refs, 1);
+
+	return profile;
+}
+
+void profile_unref(struct profile *profile)
+{
+	if (unlikely(!profile))
+		return;
+
+	if (__sync_sub_and_fetch(&profile->refs, 1))
+		return;
+
+	profile_free(profile);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct profile_entry *e1 = a;
+	const struct profile_entry *e2 = b;
+
+	return (int) e1->address - (int) e2->address;
+}
+
+static int entry_load(const struct l_settings *settings, const char *group,
+		      struct profile_entry *entry)
+{
+	unsigned int address;
+	unsigned int size;
+	unsigned int interval;
+	unsigned int priority;
+	unsigned int max_backoff;
+
+	entry->type = l_settings_get_string(settings, group, "Type");
+	if (!entry->type)
+		return -EINVAL;
+
+	if (!l_settings_get_uint(settings, group, "Address", &address) ||
+	    address == 0 || address > UINT16_MAX)
+		return -EINVAL;
+
+	if (!l_settings_get_uint(settings, group, "Size", &size) ||
+	    size > UINT16_MAX || !source_is_valid(entry->type, address, size))
+		return -EINVAL;
+
+	if (!l_settings_get_uint(settings, group, "PollingInterval",
+				 &interval))
+		interval = 1000;
+
+	if (interval == 0 || interval > UINT16_MAX)
+		return -EINVAL;
+
+	if (!l_settings_get_uint(settings, group, "Priority", &priority))
+		priority = 0;
+
+	if (priority > UINT8_MAX)
+		return -EINVAL;
+
+	if (!l_settings_get_uint(settings, group, "MaxBackoff", &max_backoff))
+		max_backoff = 0;
+
+	if (max_backoff > UINT8_MAX)
+		return -EINVAL;
+
+	entry->name = l_strdup(group);
+	entry->address = address;
+	entry->size = size;
+	entry->interval = interval;
+	entry->priority = priority;
+	entry->max_backoff = max_backoff;
+
+	return 0;
+}
+
+static struct profile *profile_load(const char *name)
+{
+	struct l_settings *settings;
+	struct profile *profile;
+	char **groups;
+	char *path;
+	unsigned int count;
+	unsigned int i;
+
+	path = l_strdup_printf("%s/%s.conf", profile_dir, name);
+	settings = l_settings_new();
+
+	if (!l_settings_load_from_file(settings, path)) {
+		l_error("profile: unable to load %s", path);
+		goto fail;
+	}
+
+	groups = l_settings_get_groups(settings);
+	count = groups ? l_strv_length(groups) : 0;
+	if (count == 0 || count > PROFILE_MAX_ENTRIES) {
+		l_error("profile: %s: %u sources", path, count);
+		l_strfreev(groups);
+		goto fail;
+	}
+
+	profile = l_new(struct profile, 1);
+	profile->refs = 0;
+	profile->name = l_strdup(name);
+	profile->entries = l_new(struct profile_entry, count);
+
+	for (i = 0; i < count; i++) {
+		profile->count++;
+		if (entry_load(settings, groups[i],
+			       &profile->entries[i]) < 0) {
+			l_error("profile: %s: invalid source [%s]", path,
+				groups[i]);
+			l_strfreev(groups);
+			profile_free(profile);
+			goto fail;
+		}
+	}
+
+	l_strfreev(groups);
+
+	qsort(profile->entries, profile->count, sizeof(*profile->entries),
+	      entry_cmp);
+
+	/* Source object paths are derived from the address */
+	for (i = 1; i < profile->count; i++) {
+		if (profile->entries[i].address !=
+		    profile->entries[i - 1].address)
+			continue;
+
+		l_error("profile: %s: duplicated address 0x%04x", path,
+			profile->entries[i].address);
+		profile_free(profile);
+		goto fail;
+	}
+
+	l_info("profile: %s: %u sources", name, profile->count);
+
+	l_settings_free(settings);
+	l_free(path);
+
+	return profile;
+
+fail:
+	l_settings_free(settings);
+	l_free(path);
+
+	return NULL;
+}
+
+/* Loaded on first use, then shared: the caller owns a reference */
+struct profile *profile_get(const char *name)
+{
+	struct profile *profile;
+
+	if (unlikely(!name || !profile_map))
+		return NULL;
+
+	/* Plain file name only: no path components */
+	if (*name == '\0' || *name == '.' || strchr(name, '/'))
+		return NULL;
+
+	profile = l_hashmap_lookup(profile_map, name);
+	if (profile)
+		return profile_ref(profile);
+
+	profile = profile_load(name);
+	if (!profile)
+		return NULL;
+
+	l_hashmap_insert(profile_map, profile->name, profile_ref(profile));
+
+	return profile_ref(profile);
+}
+
+const char *profile_get_name(const struct profile *profile)
+{
+	if (unlikely(!profile))
+		return NULL;
+
+	return profile->name;
+}
+
+const struct profile_entry *profile_get_entries(const struct profile *profile,
+						unsigned int *count)
+{
+	*count = profile->count;
+
+	return profile->entries;
+}
+
+int profile_start(const char *dir)
+{
+	l_info("Starting profiles: %s ...", dir);
+
+	profile_dir = l_strdup(dir);
+	profile_map = l_hashmap_string_new();
+
+	return 0;
+}
+
+void profile_stop(void)
+{
+	l_hashmap_destroy(profile_map, (l_hashmap_destroy_func_t) profile_unref);
+	profile_map = NULL;
+	l_free(profile_dir);
+	profile_dir = NULL;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/* Compiled register map entry: read-only, shared by every slave */
+struct profile_entry {
+	char *name;
+	char *type;
+	uint16_t address;
+	uint16_t size;
+	uint16_t interval;	/* ms */
+	uint8_t priority;
+	uint8_t max_backoff;	/* Adaptive polling: see slave_add_source() */
+};
+
+int profile_start(const char *dir);
+void profile_stop(void);
+
+struct profile;
+struct profile *profile_get(const char *name);
+void profile_unref(struct profile *profile);
+const char *profile_get_name(const struct profile *profile);
+const struct profile_entry *profile_get_entries(const struct profile *profile,
+						unsigned int *count);
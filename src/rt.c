@@ -0,0 +1,421 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <ell/ell.h>
+
+#include "rt.h"
+
+/*
+ * Real-time mode: the main loop, which sends every request and reads
+ * every response, runs with SCHED_FIFO, on the CPU given to rt_pin().
+ * Memory is locked and enough heap and stack are faulted in up front
+ * so that polling doesn't hit page faults; freed memory is kept by
+ * malloc instead of being returned to the kernel.
+ *
+ * ell has a single main loop per process, so D-Bus and the other
+ * services share the real-time loop. What may block on the disk or
+ * the network (storage journal, uplink spool, compression and broker
+ * lookup, capture) is handed to rt_work() instead: a worker thread
+ * with the default policy, on the other CPUs, runs it in submission
+ * order and reports back to the main loop. Without real-time mode,
+ * work is done right away. Work items are reused, and RT_WORK_POOL of
+ * them are allocated up front, so submitting doesn't allocate.
+ */
+
+#define RT_STACK_PREFAULT	(256 * 1024)
+#define RT_HEAP_PREFAULT	(8 * 1024 * 1024)
+#define RT_WORKER_STACK		(512 * 1024)	/* Locked as well */
+#define RT_WORK_POOL		128	/* Work items kept for reuse */
+
+struct work {
+	struct work *next;	/* Pending, finished or free list */
+	rt_work_func_t func;
+	rt_work_func_t done;
+	void *user_data;
+	rt_work_func_t destroy;
+};
+
+static bool enabled;
+static cpu_set_t other_cpus;	/* Allowed CPUs, but the pinned one */
+
+static pthread_t worker;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+/* Lists linked through struct work: submitting allocates nothing */
+struct work_list {
+	struct work *head;
+	struct work *tail;
+};
+
+static struct work_list work_pending;	/* Not run yet */
+static struct work_list work_finished;	/* Run: done() not called yet */
+static bool work_stopping;
+static int done_fd = -1;
+static struct l_io *done_io;
+
+/* Only used from the main loop: rt_work() and done() callbacks */
+static struct work *work_pool;
+static unsigned int work_pool_len;
+
+static void stack_prefault(void)
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(stack); i += page)
+		stack[i] = 0;
+}
+
+static void heap_prefault(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uint8_t *heap;
+	unsigned int i;
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	heap = l_malloc(RT_HEAP_PREFAULT);
+	for (i = 0; i < RT_HEAP_PREFAULT; i += page)
+		heap[i] = 0;
+
+	l_free(heap);
+}
+
+static void work_append(struct work_list *list, struct work *work)
+{
+	work->next = NULL;
+
+	if (list->tail)
+		list->tail->next = work;
+	else
+		list->head = work;
+
+	list->tail = work;
+}
+
+static struct work *work_pop(struct work_list *list)
+{
+	struct work *work = list->head;
+
+	if (!work)
+		return NULL;
+
+	list->head = work->next;
+	if (!list->head)
+		list->tail = NULL;
+
+	return work;
+}
+
+static struct work *work_new(void)
+{
+	struct work *work = work_pool;
+
+	if (!work)
+		return l_new(struct work, 1);
+
+	work_pool = work->next;
+	work_pool_len--;
+
+	return work;
+}
+
+static void work_release(struct work *work)
+{
+	if (work_pool_len >= RT_WORK_POOL) {
+		l_free(work);
+		return;
+	}
+
+	work->next = work_pool;
+	work_pool = work;
+	work_pool_len++;
+}
+
+static void work_reserve(void)
+{
+	while (work_pool_len < RT_WORK_POOL)
+		work_release(l_new(struct work, 1));
+}
+
+static void work_pool_free(void)
+{
+	struct work *work;
+
+	while ((work = work_pool)) {
+		work_pool = work->next;
+		l_free(work);
+	}
+
+	work_pool_len = 0;
+}
+
+static void work_finish(struct work *work)
+{
+	if (work->done)
+		work->done(work->user_data);
+
+	if (work->destroy)
+		work->destroy(work->user_data);
+
+	work_release(work);
+}
+
+static void *worker_run(void *user_data)
+{
+	struct work *work;
+	uint64_t one = 1;
+
+	if (CPU_COUNT(&other_cpus))
+		pthread_setaffinity_np(pthread_self(), sizeof(other_cpus),
+				       &other_cpus);
+
+	pthread_mutex_lock(&work_lock);
+
+	while (true) {
+		work = work_pop(&work_pending);
+		if (!work) {
+			if (work_stopping)
+				break;
+
+			pthread_cond_wait(&work_cond, &work_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&work_lock);
+		work->func(work->user_data);
+		pthread_mutex_lock(&work_lock);
+
+		work_append(&work_finished, work);
+		if (write(done_fd, &one, sizeof(one)) < 0)
+			l_error("realtime: worker: %s", strerror(errno));
+	}
+
+	pthread_mutex_unlock(&work_lock);
+
+	return NULL;
+}
+
+static void done_process(void)
+{
+	struct work_list finished;
+	struct work *work;
+
+	pthread_mutex_lock(&work_lock);
+	finished = work_finished;
+	memset(&work_finished, 0, sizeof(work_finished));
+	pthread_mutex_unlock(&work_lock);
+
+	while ((work = work_pop(&finished)))
+		work_finish(work);
+}
+
+static bool done_read_cb(struct l_io *io, void *user_data)
+{
+	uint64_t count;
+
+	if (read(done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return false;
+
+	done_process();
+
+	return true;
+}
+
+static int worker_start(void)
+{
+	struct sched_param param;
+	pthread_attr_t attr;
+	int err;
+
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (done_fd < 0)
+		return -errno;
+
+	work_stopping = false;
+
+	/* Not inherited from the caller, about to become SCHED_FIFO */
+	memset(&param, 0, sizeof(param));
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+	pthread_attr_setstacksize(&attr, RT_WORKER_STACK);
+
+	err = pthread_create(&worker, &attr, worker_run, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		close(done_fd);
+		done_fd = -1;
+		return -err;
+	}
+
+	done_io = l_io_new(done_fd);
+	l_io_set_read_handler(done_io, done_read_cb, NULL, NULL);
+
+	return 0;
+}
+
+/* Runs what was submitted so far, then what it reported */
+static void worker_stop(void)
+{
+	pthread_mutex_lock(&work_lock);
+	work_stopping = true;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+
+	pthread_join(worker, NULL);
+
+	l_io_destroy(done_io);
+	done_io = NULL;
+
+	done_process();
+
+	close(done_fd);
+	done_fd = -1;
+}
+
+/*
+ * Runs func(user_data) off the real-time loop, then done(user_data)
+ * back on it, then destroy(user_data). func must only touch what
+ * user_data gives it, and whatever no other rt_work() uses concurrently:
+ * since work is run in order, state owned by a single module is safe.
+ */
+void rt_work(rt_work_func_t func, rt_work_func_t done, void *user_data,
+	     rt_work_func_t destroy)
+{
+	struct work *work;
+
+	work = work_new();
+	work->func = func;
+	work->done = done;
+	work->user_data = user_data;
+	work->destroy = destroy;
+
+	if (!enabled) {
+		func(user_data);
+		work_finish(work);
+		return;
+	}
+
+	pthread_mutex_lock(&work_lock);
+	work_append(&work_pending, work);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+/* Pins the calling thread to 'cpu', with or without real-time mode */
+int rt_pin(int cpu)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(other_cpus), &other_cpus) < 0)
+		return -errno;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		return -errno;
+
+	CPU_CLR(cpu, &other_cpus);
+
+	l_info("cpu: pinned to %d", cpu);
+
+	return 0;
+}
+
+/* priority: SCHED_FIFO priority */
+int rt_start(int priority)
+{
+	struct sched_param param;
+	int err;
+
+	if (priority < sched_get_priority_min(SCHED_FIFO) ||
+	    priority > sched_get_priority_max(SCHED_FIFO))
+		return -EINVAL;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return -errno;
+
+	err = worker_start();
+	if (err < 0) {
+		munlockall();
+		return err;
+	}
+
+	work_reserve();
+	heap_prefault();
+	stack_prefault();
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+		err = -errno;
+		worker_stop();
+		munlockall();
+		return err;
+	}
+
+	enabled = true;
+
+	l_info("realtime: SCHED_FIFO priority %d", priority);
+
+	return 0;
+}
+
+void rt_stop(void)
+{
+	struct sched_param param;
+
+	if (!enabled)
+		return;
+
+	/* Work submitted from done() callbacks is now run right away */
+	enabled = false;
+	worker_stop();
+	work_pool_free();
+
+	memset(&param, 0, sizeof(param));
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	munlockall();
+}
@@ -0,0 +1,490 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include <ell/ell.h>
+
+#include "watchdog.h"
+#include "sched.h"
+
+/*
+ * Polling scheduler: every entry has an absolute deadline aligned to a
+ * common epoch. Entries are kept in one binary min-heap per group
+ * (slave), and groups in a min-heap of their earliest deadline, driven
+ * by a single timeout. Pausing a group takes it out of the group heap:
+ * its entries are kept as they are but cause no wakeups until resumed.
+ *
+ * Each interval is split in SCHED_PHASE_SLOTS phase slots. Entries
+ * sharing a group (slave) and interval are bound to the same slot and
+ * expire in the same dispatch, so they can be read together. Distinct
+ * groups are placed on the least loaded slot of their interval, which
+ * spreads the load evenly instead of firing every source at once.
+ */
+
+#define HEAP_NONE		UINT_MAX	/* Not in a heap */
+
+struct heap_node {
+	uint64_t deadline;	/* us, monotonic */
+	unsigned int index;	/* Position in the heap */
+};
+
+struct heap {
+	struct heap_node **nodes;
+	unsigned int len;
+	unsigned int size;
+};
+
+struct phase {
+	const void *group;
+	uint32_t interval;	/* ms */
+	unsigned int slot;
+	unsigned int refs;
+};
+
+struct profile {
+	uint32_t interval;	/* ms */
+	unsigned int slots[SCHED_PHASE_SLOTS];
+};
+
+/* Heap nodes come first: a node is cast back to its group or entry */
+struct sched_group {
+	struct heap_node node;	/* Earliest entry, in the group heap */
+	const void *key;
+	struct heap entries;
+	bool paused;
+	uint64_t resumed_at;	/* Deadlines before it were missed */
+};
+
+struct sched_entry {
+	struct heap_node node;	/* In the heap of its group */
+	uint64_t period;	/* us */
+	struct sched_group *group;
+	struct phase *phase;
+	struct profile *profile;
+	sched_expired_func_t func;
+	void *user_data;
+};
+
+static struct heap groups;	/* Not paused, with entries */
+static struct l_hashmap *group_map;	/* By key */
+static struct l_timeout *timer;
+static uint64_t armed_deadline;
+static uint64_t epoch;
+static struct l_queue *phase_list;
+static struct l_queue *profile_list;
+
+static void heap_swap(struct heap *heap, unsigned int a, unsigned int b)
+{
+	struct heap_node *tmp = heap->nodes[a];
+
+	heap->nodes[a] = heap->nodes[b];
+	heap->nodes[b] = tmp;
+	heap->nodes[a]->index = a;
+	heap->nodes[b]->index = b;
+}
+
+static void heap_up(struct heap *heap, unsigned int i)
+{
+	struct heap_node **nodes = heap->nodes;
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (nodes[parent]->deadline <= nodes[i]->deadline)
+			break;
+
+		heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(struct heap *heap, unsigned int i)
+{
+	struct heap_node **nodes = heap->nodes;
+	unsigned int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap->len)
+			break;
+
+		if (child + 1 < heap->len &&
+		    nodes[child + 1]->deadline < nodes[child]->deadline)
+			child++;
+
+		if (nodes[i]->deadline <= nodes[child]->deadline)
+			break;
+
+		heap_swap(heap, i, child);
+		i = child;
+	}
+}
+
+static void heap_push(struct heap *heap, struct heap_node *node)
+{
+	if (heap->len == heap->size) {
+		heap->size = heap->size ? heap->size * 2 : 64;
+		heap->nodes = l_realloc(heap->nodes,
+					heap->size * sizeof(*heap->nodes));
+	}
+
+	node->index = heap->len;
+	heap->nodes[heap->len++] = node;
+	heap_up(heap, node->index);
+}
+
+static void heap_delete(struct heap *heap, struct heap_node *node)
+{
+	unsigned int i = node->index;
+
+	node->index = HEAP_NONE;
+	heap->len--;
+	if (i == heap->len)
+		return;
+
+	heap->nodes[i] = heap->nodes[heap->len];
+	heap->nodes[i]->index = i;
+	heap_up(heap, i);
+	heap_down(heap, heap->nodes[i]->index);
+}
+
+/* Moved in the group heap after a change of its earliest entry */
+static void group_update(struct sched_group *group)
+{
+	bool active = (!group->paused && group->entries.len > 0);
+
+	if (!active) {
+		if (group->node.index != HEAP_NONE)
+			heap_delete(&groups, &group->node);
+		return;
+	}
+
+	group->node.deadline = group->entries.nodes[0]->deadline;
+
+	if (group->node.index == HEAP_NONE) {
+		heap_push(&groups, &group->node);
+		return;
+	}
+
+	heap_up(&groups, group->node.index);
+	heap_down(&groups, group->node.index);
+}
+
+static struct sched_group *group_get(const void *key)
+{
+	struct sched_group *group;
+
+	group = l_hashmap_lookup(group_map, key);
+	if (group)
+		return group;
+
+	group = l_new(struct sched_group, 1);
+	group->key = key;
+	group->node.index = HEAP_NONE;
+	l_hashmap_insert(group_map, key, group);
+
+	return group;
+}
+
+static void group_free(void *data)
+{
+	struct sched_group *group = data;
+
+	l_free(group->entries.nodes);
+	l_free(group);
+}
+
+static void group_put(struct sched_group *group)
+{
+	if (group->entries.len > 0)
+		return;
+
+	group_update(group);
+	l_hashmap_remove(group_map, group->key);
+	group_free(group);
+}
+
+static void timer_expired(struct l_timeout *timeout, void *user_data);
+
+static void timer_arm(void)
+{
+	uint64_t now;
+	uint64_t ms;
+
+	if (groups.len == 0)
+		return;
+
+	if (armed_deadline && armed_deadline <= groups.nodes[0]->deadline)
+		return;
+
+	now = l_time_now();
+	armed_deadline = groups.nodes[0]->deadline;
+
+	/* Round up: waking early only means a second, empty dispatch */
+	ms = (armed_deadline > now ?
+	      (armed_deadline - now + 999) / 1000 : 1);
+	if (ms == 0)
+		ms = 1;
+
+	if (!timer)
+		timer = l_timeout_create_ms(ms, timer_expired, NULL, NULL);
+	else
+		l_timeout_modify_ms(timer, ms);
+}
+
+/* Next deadline on the entry's phase strictly after @now */
+static uint64_t next_deadline(uint64_t deadline, uint64_t period,
+			      uint64_t now)
+{
+	if (deadline > now)
+		return deadline;
+
+	return deadline + ((now - deadline) / period + 1) * period;
+}
+
+static void timer_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct sched_group *group;
+	struct sched_entry *entry;
+	uint64_t now = l_time_now();
+	uint64_t deadline;
+	WATCHDOG_SCOPE("sched");
+
+	if (groups.len)
+		watchdog_dispatch(groups.nodes[0]->deadline, now);
+
+	armed_deadline = 0;
+
+	while (groups.len && groups.nodes[0]->deadline <= now) {
+		group = (struct sched_group *) groups.nodes[0];
+		entry = (struct sched_entry *) group->entries.nodes[0];
+		deadline = entry->node.deadline;
+
+		/* Late entries skip missed periods but keep their phase */
+		entry->node.deadline = next_deadline(deadline + entry->period,
+						     entry->period, now);
+		heap_down(&group->entries, 0);
+		group_update(group);
+
+		/* Expired while paused: wait for the next period */
+		if (deadline < group->resumed_at)
+			continue;
+
+		entry->func(deadline, entry->user_data);
+	}
+
+	timer_arm();
+}
+
+static bool phase_match(const void *a, const void *b)
+{
+	const struct phase *phase = a;
+	const struct phase *key = b;
+
+	return (phase->group == key->group &&
+		phase->interval == key->interval);
+}
+
+static bool profile_match(const void *a, const void *b)
+{
+	const struct profile *profile = a;
+
+	return (profile->interval == L_PTR_TO_UINT(b));
+}
+
+static struct profile *profile_get(uint32_t interval)
+{
+	struct profile *profile;
+
+	profile = l_queue_find(profile_list, profile_match,
+			       L_UINT_TO_PTR(interval));
+	if (profile)
+		return profile;
+
+	profile = l_new(struct profile, 1);
+	memset(profile, 0, sizeof(*profile));
+	profile->interval = interval;
+	l_queue_push_tail(profile_list, profile);
+
+	return profile;
+}
+
+static struct phase *phase_get(const void *group, struct profile *profile)
+{
+	struct phase key = { .group = group, .interval = profile->interval };
+	struct phase *phase;
+	unsigned int i;
+
+	phase = l_queue_find(phase_list, phase_match, &key);
+	if (phase) {
+		phase->refs++;
+		return phase;
+	}
+
+	phase = l_new(struct phase, 1);
+	phase->group = group;
+	phase->interval = profile->interval;
+	phase->refs = 1;
+	phase->slot = 0;
+
+	for (i = 1; i < SCHED_PHASE_SLOTS; i++) {
+		if (profile->slots[i] < profile->slots[phase->slot])
+			phase->slot = i;
+	}
+
+	l_queue_push_tail(phase_list, phase);
+
+	return phase;
+}
+
+struct sched_entry *sched_add(const void *group, uint32_t interval,
+			      sched_expired_func_t func, void *user_data)
+{
+	struct sched_entry *entry;
+	uint64_t offset;
+
+	if (unlikely(interval == 0))
+		return NULL;
+
+	entry = l_new(struct sched_entry, 1);
+	entry->period = (uint64_t) interval * 1000;
+	entry->func = func;
+	entry->user_data = user_data;
+	entry->group = group_get(group);
+	entry->profile = profile_get(interval);
+	entry->phase = phase_get(group, entry->profile);
+	entry->profile->slots[entry->phase->slot]++;
+
+	offset = entry->period * entry->phase->slot / SCHED_PHASE_SLOTS;
+	entry->node.deadline = next_deadline(epoch + offset, entry->period,
+					     l_time_now());
+
+	heap_push(&entry->group->entries, &entry->node);
+	group_update(entry->group);
+	timer_arm();
+
+	return entry;
+}
+
+void sched_remove(struct sched_entry *entry)
+{
+	if (unlikely(!entry))
+		return;
+
+	heap_delete(&entry->group->entries, &entry->node);
+	group_update(entry->group);
+	group_put(entry->group);
+
+	entry->profile->slots[entry->phase->slot]--;
+
+	if (--entry->phase->refs == 0) {
+		l_queue_remove(phase_list, entry->phase);
+		l_free(entry->phase);
+	}
+
+	l_free(entry);
+}
+
+/*
+ * Stops the entries of @group from expiring, without touching them:
+ * the group just leaves the group heap. No-op for unknown groups.
+ */
+void sched_pause(const void *group)
+{
+	struct sched_group *sgroup = l_hashmap_lookup(group_map, group);
+
+	if (!sgroup || sgroup->paused)
+		return;
+
+	sgroup->paused = true;
+	group_update(sgroup);
+}
+
+/* Periods missed while paused are skipped, phases are kept */
+void sched_resume(const void *group)
+{
+	struct sched_group *sgroup = l_hashmap_lookup(group_map, group);
+
+	if (!sgroup || !sgroup->paused)
+		return;
+
+	sgroup->paused = false;
+	sgroup->resumed_at = l_time_now();
+	group_update(sgroup);
+	timer_arm();
+}
+
+struct profile_data {
+	sched_profile_func_t func;
+	void *user_data;
+};
+
+static void foreach_profile(void *data, void *user_data)
+{
+	struct profile *profile = data;
+	struct profile_data *pdata = user_data;
+
+	pdata->func(profile->interval, profile->slots, pdata->user_data);
+}
+
+void sched_foreach_profile(sched_profile_func_t func, void *user_data)
+{
+	struct profile_data pdata = { .func = func, .user_data = user_data };
+
+	l_queue_foreach(profile_list, foreach_profile, &pdata);
+}
+
+int sched_start(void)
+{
+	l_info("Starting scheduler ...");
+
+	epoch = l_time_now();
+	group_map = l_hashmap_new();
+	phase_list = l_queue_new();
+	profile_list = l_queue_new();
+
+	return 0;
+}
+
+void sched_stop(void)
+{
+	l_timeout_remove(timer);
+	timer = NULL;
+	armed_deadline = 0;
+
+	l_free(groups.nodes);
+	memset(&groups, 0, sizeof(groups));
+
+	l_hashmap_destroy(group_map, group_free);
+	group_map = NULL;
+
+	l_queue_destroy(phase_list, l_free);
+	l_queue_destroy(profile_list, l_free);
+	phase_list = NULL;
+	profile_list = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define SCHED_PHASE_SLOTS	16
+
+typedef void (*sched_expired_func_t) (uint64_t deadline, void *user_data);
+typedef void (*sched_profile_func_t) (uint32_t interval,
+				      const unsigned int *slots,
+				      void *user_data);
+
+int sched_start(void);
+void sched_stop(void);
+
+struct sched_entry;
+struct sched_entry *sched_add(const void *group, uint32_t interval,
+			      sched_expired_func_t func, void *user_data);
+void sched_remove(struct sched_entry *entry);
+void sched_pause(const void *group);
+void sched_resume(const void *group);
+
+void sched_foreach_profile(sched_profile_func_t func, void *user_data);
@@ -0,0 +1,454 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ell/ell.h>
+
+#include <modbus.h>
+
+#include "watchdog.h"
+#include "source.h"
+#include "slave.h"
+#include "server.h"
+
+/*
+ * Modbus TCP server: answers reads from the values cached by polling,
+ * so any number of clients costs a single poll of each PLC. The unit
+ * id selects the slave; a read must fall inside one of its sources.
+ * Writes are forwarded to the slave through its request queue, and the
+ * reply relayed once it arrives.
+ *
+ * Cached values older than 'max_age' (ms), or by default older than
+ * SERVER_STALE_INTERVALS polling intervals, are refused with a
+ * "gateway target failed to respond" exception.
+ */
+
+#define SERVER_STALE_INTERVALS	3
+#define SERVER_MAX_CLIENTS	64
+#define MBAP_HEADER_LENGTH	7
+#define MBAP_MAX_LENGTH		260
+
+#define EXCEPTION_ILLEGAL_FUNCTION	0x01
+#define EXCEPTION_ILLEGAL_ADDRESS	0x02
+#define EXCEPTION_ILLEGAL_VALUE		0x03
+#define EXCEPTION_DEVICE_BUSY		0x06
+#define EXCEPTION_GATEWAY_PATH		0x0A
+#define EXCEPTION_GATEWAY_TARGET	0x0B
+
+struct client {
+	int refs;
+	struct l_io *io;	/* NULL once disconnected */
+	uint8_t buf[MBAP_MAX_LENGTH];
+	unsigned int len;
+};
+
+/* Forwarded write waiting for the slave */
+struct forward {
+	struct client *client;
+	uint16_t tid;
+	uint8_t unit;
+	uint8_t function;
+};
+
+static struct l_io *server_io;
+static struct l_queue *client_list;
+static server_lookup_func_t slave_lookup;
+static uint64_t server_max_age;	/* us, 0: per source default */
+
+static struct client *client_ref(struct client *client)
+{
+	client->refs++;
+
+	return client;
+}
+
+static void client_unref(struct client *client)
+{
+	if (--client->refs)
+		return;
+
+	l_free(client);
+}
+
+static void io_destroy_idle(void *user_data)
+{
+	l_io_destroy(user_data);
+}
+
+static void client_close(struct client *client)
+{
+	if (!client->io)
+		return;
+
+	/* May run from the io's own handler */
+	l_io_set_read_handler(client->io, NULL, NULL, NULL);
+	l_io_set_disconnect_handler(client->io, NULL, NULL, NULL);
+	l_idle_oneshot(io_destroy_idle, client->io, NULL);
+	client->io = NULL;
+
+	l_queue_remove(client_list, client);
+	client_unref(client);
+}
+
+static void client_send(struct client *client, uint16_t tid, uint8_t unit,
+			const uint8_t *pdu, unsigned int len)
+{
+	uint8_t adu[MBAP_MAX_LENGTH];
+	ssize_t ret;
+
+	if (!client->io || len + MBAP_HEADER_LENGTH > sizeof(adu))
+		return;
+
+	adu[0] = tid >> 8;
+	adu[1] = tid & 0xff;
+	adu[2] = 0;		/* Protocol id */
+	adu[3] = 0;
+	adu[4] = (len + 1) >> 8;
+	adu[5] = (len + 1) & 0xff;
+	adu[6] = unit;
+	memcpy(adu + MBAP_HEADER_LENGTH, pdu, len);
+
+	/* Replies are tiny: a client unable to take one is dropped */
+	ret = send(l_io_get_fd(client->io), adu, len + MBAP_HEADER_LENGTH,
+		   MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret != (ssize_t) (len + MBAP_HEADER_LENGTH))
+		client_close(client);
+}
+
+static void client_exception(struct client *client, uint16_t tid,
+			     uint8_t unit, uint8_t function, uint8_t code)
+{
+	uint8_t pdu[2] = { function | 0x80, code };
+
+	client_send(client, tid, unit, pdu, sizeof(pdu));
+}
+
+static void forward_cb(int err, const uint8_t *pdu, int len, void *user_data)
+{
+	struct forward *fwd = user_data;
+
+	if (err < 0)
+		client_exception(fwd->client, fwd->tid, fwd->unit,
+				 fwd->function, EXCEPTION_GATEWAY_TARGET);
+	else
+		client_send(fwd->client, fwd->tid, fwd->unit, pdu, len);
+
+	client_unref(fwd->client);
+	l_free(fwd);
+}
+
+static void client_read(struct client *client, uint16_t tid, uint8_t unit,
+			struct slave *slave, const uint8_t *pdu,
+			unsigned int len)
+{
+	uint8_t rsp[2 + 250];
+	struct source *source;
+	uint16_t address;
+	uint16_t quantity;
+	uint16_t max;
+	uint64_t max_age;
+	int ret;
+
+	if (len != 5) {
+		client_exception(client, tid, unit, pdu[0],
+				 EXCEPTION_ILLEGAL_VALUE);
+		return;
+	}
+
+	address = pdu[1] << 8 | pdu[2];
+	quantity = pdu[3] << 8 | pdu[4];
+	max = (pdu[0] <= MODBUS_FC_READ_DISCRETE_INPUTS ?
+	       MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS);
+
+	if (quantity < 1 || quantity > max) {
+		client_exception(client, tid, unit, pdu[0],
+				 EXCEPTION_ILLEGAL_VALUE);
+		return;
+	}
+
+	source = slave_find_source(slave, pdu[0], address, quantity);
+	if (!source) {
+		client_exception(client, tid, unit, pdu[0],
+				 EXCEPTION_ILLEGAL_ADDRESS);
+		return;
+	}
+
+	max_age = (server_max_age ? server_max_age :
+		   (uint64_t) source_get_interval(source) * 1000 *
+		   SERVER_STALE_INTERVALS);
+
+	ret = source_read(source, address, quantity, max_age, rsp + 2);
+	if (ret < 0) {
+		client_exception(client, tid, unit, pdu[0],
+				 EXCEPTION_GATEWAY_TARGET);
+		return;
+	}
+
+	rsp[0] = pdu[0];
+	rsp[1] = ret;
+	client_send(client, tid, unit, rsp, 2 + ret);
+}
+
+static void client_write(struct client *client, uint16_t tid, uint8_t unit,
+			 struct slave *slave, const uint8_t *pdu,
+			 unsigned int len)
+{
+	struct forward *fwd;
+	int err;
+
+	fwd = l_new(struct forward, 1);
+	fwd->client = client_ref(client);
+	fwd->tid = tid;
+	fwd->unit = unit;
+	fwd->function = pdu[0];
+
+	err = slave_forward(slave, pdu, len, forward_cb, fwd);
+	if (err < 0) {
+		/* Slave request queue full: the client may retry later */
+		client_exception(client, tid, unit, pdu[0],
+				 err == -EBUSY ? EXCEPTION_DEVICE_BUSY :
+				 EXCEPTION_GATEWAY_TARGET);
+		client_unref(client);
+		l_free(fwd);
+	}
+}
+
+static void client_process(struct client *client, const uint8_t *adu,
+			   unsigned int len)
+{
+	const uint8_t *pdu = adu + MBAP_HEADER_LENGTH;
+	uint16_t tid = adu[0] << 8 | adu[1];
+	uint8_t unit = adu[6];
+	struct slave *slave;
+
+	len -= MBAP_HEADER_LENGTH;
+
+	slave = slave_lookup(unit);
+	if (!slave) {
+		client_exception(client, tid, unit, pdu[0],
+				 EXCEPTION_GATEWAY_PATH);
+		return;
+	}
+
+	switch (pdu[0]) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		client_read(client, tid, unit, slave, pdu, len);
+		break;
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		client_write(client, tid, unit, slave, pdu, len);
+		break;
+	default:
+		client_exception(client, tid, unit, pdu[0],
+				 EXCEPTION_ILLEGAL_FUNCTION);
+		break;
+	}
+}
+
+static bool client_read_cb(struct l_io *io, void *user_data)
+{
+	struct client *client = user_data;
+	unsigned int adu_len;
+	ssize_t len;
+	WATCHDOG_SCOPE("server");
+
+	len = read(l_io_get_fd(io), client->buf + client->len,
+		   sizeof(client->buf) - client->len);
+	if (len <= 0) {
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+
+		client_close(client);
+		return true;
+	}
+
+	client->len += len;
+
+	client_ref(client);
+
+	/* Pipelined requests: process every complete ADU */
+	while (client->io && client->len >= MBAP_HEADER_LENGTH) {
+		adu_len = 6 + (client->buf[4] << 8 | client->buf[5]);
+
+		if (client->buf[2] || client->buf[3] ||
+		    adu_len < MBAP_HEADER_LENGTH + 1 ||
+		    adu_len > MBAP_MAX_LENGTH) {
+			client_close(client);
+			break;
+		}
+
+		if (client->len < adu_len)
+			break;
+
+		client_process(client, client->buf, adu_len);
+
+		client->len -= adu_len;
+		memmove(client->buf, client->buf + adu_len, client->len);
+	}
+
+	client_unref(client);
+
+	return true;
+}
+
+static void client_disconnect_cb(struct l_io *io, void *user_data)
+{
+	client_close(user_data);
+}
+
+static bool accept_cb(struct l_io *io, void *user_data)
+{
+	struct client *client;
+	int enable = 1;
+	int fd;
+
+	fd = accept4(l_io_get_fd(io), NULL, NULL,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return true;
+
+	if (l_queue_length(client_list) >= SERVER_MAX_CLIENTS) {
+		close(fd);
+		return true;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+	client = l_new(struct client, 1);
+	memset(client, 0, sizeof(*client));
+	client->refs = 1;
+	client->io = l_io_new(fd);
+	l_io_set_close_on_destroy(client->io, true);
+	l_io_set_read_handler(client->io, client_read_cb, client, NULL);
+	l_io_set_disconnect_handler(client->io, client_disconnect_cb,
+				    client, NULL);
+
+	l_queue_push_tail(client_list, client);
+
+	return true;
+}
+
+/* "[host:]port" */
+static int server_listen(const char *address)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char host[128] = "";
+	char port[8] = "";
+	int enable = 1;
+	int fd;
+	int err;
+
+	if (sscanf(address, "%127[^:]:%7s", host, port) != 2) {
+		host[0] = '\0';
+		if (sscanf(address, "%7s", port) != 1)
+			return -EINVAL;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_NUMERICHOST;
+
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0)
+		return -EINVAL;
+
+	fd = socket(res->ai_family,
+		    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err = -errno;
+		freeaddrinfo(res);
+		return err;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+	    listen(fd, SERVER_MAX_CLIENTS) < 0) {
+		err = -errno;
+		freeaddrinfo(res);
+		close(fd);
+		return err;
+	}
+
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+int server_start(const char *address, uint32_t max_age,
+		 server_lookup_func_t lookup)
+{
+	int fd;
+
+	l_info("Starting Modbus server on %s ...", address);
+
+	fd = server_listen(address);
+	if (fd < 0)
+		return fd;
+
+	slave_lookup = lookup;
+	server_max_age = (uint64_t) max_age * 1000;
+	client_list = l_queue_new();
+
+	server_io = l_io_new(fd);
+	l_io_set_close_on_destroy(server_io, true);
+	l_io_set_read_handler(server_io, accept_cb, NULL, NULL);
+
+	return 0;
+}
+
+void server_stop(void)
+{
+	struct client *client;
+
+	if (!server_io)
+		return;
+
+	l_io_destroy(server_io);
+	server_io = NULL;
+
+	/* Closing removes the client from the list */
+	while ((client = l_queue_peek_head(client_list)))
+		client_close(client);
+
+	l_queue_destroy(client_list, NULL);
+	client_list = NULL;
+}
@@ -25,29 +25,184 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ell/ell.h>
 
 #include <modbus.h>
 #include <string.h>
 
 #include "dbus.h"
+#include "watchdog.h"
+#include "storage.h"
+#include "sched.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "stream.h"
+#include "uplink.h"
+#include "compute.h"
 #include "source.h"
+#include "profile.h"
+#include "store.h"
+#include "transport.h"
 #include "slave.h"
 
+/*
+ * Connections are established asynchronously: at most
+ * CONNECT_MAX_INFLIGHT at a time, and consecutive attempts are spaced
+ * by CONNECT_SPACING_MS so that enabling hundreds of slaves at once
+ * (startup) doesn't flood the network with SYNs. Polling of each slave
+ * starts as soon as its own connection completes.
+ */
+#define CONNECT_MAX_INFLIGHT	16
+#define CONNECT_SPACING_MS	5
+#define CONNECT_TIMEOUT		5	/* seconds */
+#define RECONNECT_MIN		1	/* seconds */
+#define RECONNECT_MAX		60	/* seconds */
+
+#define REQUEST_TIMEOUT_MS	1000
+#define LIST_MAX_COUNT		1000	/* ListSources page size */
+
+/*
+ * Backpressure: at most SLAVE_QUEUE_MAX requests wait for a slave.
+ * Every LOAD_PERIOD_MS the polling demand (reads/s at the nominal
+ * intervals) is compared to the capacity measured from the average
+ * service time. When the demand exceeds LOAD_TARGET of the capacity,
+ * sources are polled only every 'stretch' periods, starting from the
+ * lowest priorities, so that latency stays bounded instead of
+ * requests piling up.
+ */
+#define SLAVE_QUEUE_MAX		64
+#define LOAD_PERIOD_MS		1000
+#define LOAD_TARGET		0.8
+#define LOAD_FLOOR		0.1	/* Left to the lowest priorities */
+#define STRETCH_MAX		16
+
+/*
+ * Read planner: periodic polls of the same function waiting together
+ * are read by a single request, when the gaps between them are short
+ * (BLOCK_MAX_GAP_BITS) and don't cross a known hole of the slave map.
+ * A block answered with ILLEGAL DATA ADDRESS is split: its sources are
+ * read one by one and the gaps probed, and the ranges found invalid
+ * are remembered (and stored) so that later blocks stop at them. If
+ * nothing invalid turns up, the slave rejects long reads: the block
+ * length allowed for the function is halved.
+ */
+#define BLOCK_MAX_POLLS		32
+#define BLOCK_MAX_GAP_BITS	256	/* 16 registers, 256 coils */
+
+/* Released forwarded/sample requests kept for reuse */
+#define FORWARD_POOL_MAX	256
+
+enum connect_state {
+	CONNECT_STATE_IDLE,
+	CONNECT_STATE_QUEUED,
+	CONNECT_STATE_INPROGRESS,
+};
+
+/*
+ * Polled source: also its own entry in the slave request queue.
+ * Forwarded requests (e.g. writes from the Modbus server) are one-shot
+ * entries carrying a raw PDU instead of a source.
+ */
+struct poll {
+	struct slave *slave;
+	struct source *source;
+	struct sched_entry *entry;
+	struct poll *next;
+	bool queued;
+	bool reading;		/* Member of the block in flight */
+	bool solo;		/* Block split: read alone */
+	bool urgent;		/* Ahead of periodic polls: group samples */
+	unsigned int stretch;	/* Overloaded: polled every n periods */
+	unsigned int backoff;	/* Unchanged values: polled every n periods */
+	unsigned int skipped;
+	uint64_t deadline;	/* Scheduled poll time (us) */
+	uint8_t *pdu;
+	uint8_t pdu_len;
+	slave_forward_func_t func;
+	void *user_data;
+};
+
 struct slave {
 	int refs;
 	uint8_t id;
-	bool enable;
+	bool enable;		/* Connection requested (slaves.conf or D-Bus) */
+	bool paused;		/* Connected, polling suspended */
 	char *name;
 	char *path;
-	char *hostname;
-	int port;
-	modbus_t *tcp;
+	char *address;
+	struct endpoint endpoint;
+	modbus_t *ctx;		/* Connected: see transport_new() */
+	struct transport_rx rx;
 	struct l_queue *source_list;
+	struct profile *profile;	/* Shared register map */
+	struct l_queue *profile_sources;	/* Instantiated from it */
 	struct l_hashmap *to_list;
+	enum connect_state state;
+	struct l_io *io;	/* Connecting, then receiving responses */
+	struct l_timeout *connect_to;
+	unsigned int backoff;
+	struct l_dbus_message *pending;	/* Enable = true */
+	l_dbus_property_complete_cb_t complete;
+	struct poll *req_head;	/* Waiting to be sent */
+	struct poll *req_tail;
+	struct poll *inflight;	/* Sent, waiting for response */
+	unsigned int queue_len;
+	struct poll *block[BLOCK_MAX_POLLS];	/* Read in flight */
+	unsigned int block_len;
+	uint8_t block_function;
+	uint16_t block_address;
+	uint16_t block_size;
+	uint16_t block_limit[MODBUS_FC_READ_INPUT_REGISTERS + 1];
+	struct l_queue *holes;	/* Invalid ranges: struct hole */
+	unsigned int probes;	/* Block split: reads pending */
+	bool probe_explained;	/* Hole found, or a probe inconclusive */
+	uint8_t probe_function;
+	uint16_t probe_size;
+	uint64_t service_time;	/* us, moving average */
+	uint64_t load_at;	/* Last load evaluation */
+	double demand;		/* reads/s, nominal intervals */
+	double capacity;	/* reads/s, measured */
+	bool degraded;
+	uint64_t sent_at;
+	struct l_timeout *req_to;
+	struct l_timeout *replay_to;	/* Replay: response "in flight" */
+	const uint8_t *replay_pdu;
+	uint8_t replay_len;
+	bool disconnecting;
+	struct stats stats;
+};
+
+/* Registers (or bits) answered with ILLEGAL DATA ADDRESS */
+struct hole {
+	uint8_t function;
+	uint16_t address;
+	uint16_t count;
+};
+
+/* Read of a gap between the sources of a split block */
+struct hole_probe {
+	struct slave *slave;
+	struct hole hole;
 };
 
 static struct l_settings *settings;
+static struct l_queue *connect_queue;
+static struct l_timeout *connect_pacing;
+static unsigned int connect_inflight;
+static struct poll *forward_pool;
+static unsigned int forward_pool_len;
+
+static void connect_schedule(void);
+static void connect_cancel(struct slave *slave, int err);
+static void connect_enqueue(struct slave *slave);
+static void slave_close(struct slave *slave);
 
 static bool path_cmp(const void *a, const void *b)
 {
@@ -57,24 +212,27 @@ static bool path_cmp(const void *a, const void *b)
 	return (strcmp(source_get_path(source), b1) == 0 ? true : false);
 }
 
-static void timeout_destroy(void *data)
+static void poll_destroy(void *data)
 {
-	struct l_timeout *timeout = data;
+	struct poll *poll = data;
 
-	l_timeout_remove(timeout);
+	sched_remove(poll->entry);
+	l_free(poll);
 }
 
 static void slave_free(struct slave *slave)
 {
+	slave_close(slave);
+	l_hashmap_destroy(slave->to_list, poll_destroy);
+	l_queue_destroy(slave->profile_sources, NULL);
+	l_queue_destroy(slave->holes, l_free);
 	l_queue_destroy(slave->source_list,
 			(l_queue_destroy_func_t) source_destroy);
-	l_hashmap_destroy(slave->to_list, timeout_destroy);
-	modbus_close(slave->tcp);
-	modbus_free(slave->tcp);
-	l_free(slave->hostname);
+	profile_unref(slave->profile);
+	l_free(slave->address);
 	l_free(slave->name);
 	l_free(slave->path);
-	l_info("slave_free(%p)", slave);
+	trace(SLAVE_FREE, (uintptr_t) slave, 0, 0);
 	l_free(slave);
 }
 
@@ -84,7 +242,7 @@ static struct slave *slave_ref(struct slave *slave)
 		return NULL;
 
 	__sync_fetch_and_add(&slave->refs, 1);
-	l_info("slave_ref(%p): %d", slave, slave->refs);
+	trace(SLAVE_REF, (uintptr_t) slave, slave->refs, 0);
 
 	return slave;
 }
@@ -94,41 +252,1545 @@ static void slave_unref(struct slave *slave)
 	if (unlikely(!slave))
 		return;
 
-	l_info("slave_unref(%p): %d", slave, slave->refs - 1);
+	trace(SLAVE_UNREF, (uintptr_t) slave, slave->refs - 1, 0);
 	if (__sync_sub_and_fetch(&slave->refs, 1))
 		return;
 
 	slave_free(slave);
 }
 
-static void polling_to_expired(struct l_timeout *timeout, void *user_data)
+static void request_send(struct slave *slave);
+
+static uint16_t poll_address(const struct poll *poll)
 {
-	struct source *source = user_data;
+	if (poll->pdu)
+		return poll->pdu_len >= 3 ? poll->pdu[1] << 8 | poll->pdu[2] : 0;
 
-	l_info("modbus reading source %p", source);
+	return source_get_address(poll->source);
+}
 
-	l_timeout_modify_ms(timeout, source_get_interval(source));
+/* Registers or coils a request PDU reads or writes, 0 if unknown */
+static uint16_t pdu_quantity(const uint8_t *pdu, int len)
+{
+	switch (pdu[0]) {
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		return 1;
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+		return len >= 5 ? pdu[3] << 8 | pdu[4] : 0;
+	default:
+		return 0;
+	}
 }
 
-static void polling_start(void *data, void *user_data)
+/*
+ * Forwarded and sample requests come from a free list: once enough
+ * of them are reserved (see slave_reserve()), the request path doesn't
+ * allocate memory. The PDU buffer fits any request: 'len' is 8-bit.
+ */
+static struct poll *forward_new(void)
 {
-	struct slave *slave = user_data;
-	struct source *source = data;
-	struct l_timeout *timeout;
+	struct poll *poll = forward_pool;
+	uint8_t *pdu;
 
-	timeout = l_timeout_create_ms(source_get_interval(source),
-				      polling_to_expired, source, NULL);
+	if (poll) {
+		forward_pool = poll->next;
+		forward_pool_len--;
+		pdu = poll->pdu;
+	} else {
+		poll = l_new(struct poll, 1);
+		pdu = l_malloc(UINT8_MAX);
+	}
 
-	l_hashmap_insert(slave->to_list, source_get_path(source), timeout);
+	memset(poll, 0, sizeof(*poll));
+	poll->pdu = pdu;
 
-	l_info("source(%p): %s interval: %d", source,
-	       source_get_path(source),
-	       source_get_interval(source));
+	return poll;
 }
 
-static void settings_debug(const char *str, void *userdata)
+static void forward_release(struct poll *poll)
 {
-        l_info("%s\n", str);
+	if (forward_pool_len >= FORWARD_POOL_MAX) {
+		l_free(poll->pdu);
+		l_free(poll);
+		return;
+	}
+
+	poll->next = forward_pool;
+	forward_pool = poll;
+	forward_pool_len++;
+}
+
+static void forward_complete(struct poll *poll, int err,
+			     const uint8_t *pdu, int len)
+{
+	poll->func(err, pdu, len, poll->user_data);
+	forward_release(poll);
+}
+
+static void request_enqueue(struct slave *slave, struct poll *poll)
+{
+	poll->queued = true;
+
+	if (slave->req_tail)
+		slave->req_tail->next = poll;
+	else
+		slave->req_head = poll;
+
+	slave->req_tail = poll;
+	slave->queue_len++;
+}
+
+/* Ahead of the periodic polls waiting, behind the urgent requests */
+static void request_push(struct slave *slave, struct poll *poll)
+{
+	struct poll **p = &slave->req_head;
+
+	while (*p && (*p)->urgent)
+		p = &(*p)->next;
+
+	poll->queued = true;
+	poll->next = *p;
+	*p = poll;
+	if (!poll->next)
+		slave->req_tail = poll;
+
+	slave->queue_len++;
+}
+
+/* Moving average (1/8) of the time the slave takes per request */
+static void service_sample(struct slave *slave, uint64_t us)
+{
+	if (!slave->service_time)
+		slave->service_time = us;
+	else
+		slave->service_time = (slave->service_time * 7 + us) / 8;
+}
+
+struct load_data {
+	double demand[UINT8_MAX + 1];	/* reads/s per priority */
+	unsigned int stretch[UINT8_MAX + 1];
+	bool degraded;
+};
+
+static void load_demand(const void *key, void *value, void *user_data)
+{
+	struct poll *poll = value;
+	struct load_data *data = user_data;
+	uint32_t interval = replay_scale(source_get_interval(poll->source));
+
+	/* Backed off sources only weigh their current rate */
+	if (interval)
+		data->demand[source_get_priority(poll->source)] +=
+				1000.0 / interval / (poll->backoff ? : 1);
+}
+
+static void load_apply(const void *key, void *value, void *user_data)
+{
+	struct poll *poll = value;
+	struct load_data *data = user_data;
+
+	poll->stretch = data->stretch[source_get_priority(poll->source)];
+	if (poll->stretch > 1)
+		data->degraded = true;
+}
+
+/*
+ * Higher priorities are served first at their nominal rate. The first
+ * one that doesn't fit in the budget left, and all the lower ones, are
+ * stretched by the same factor to share what remains.
+ */
+static void load_update(struct slave *slave)
+{
+	static struct load_data data;
+	double demand = 0;
+	double budget;
+	double rest;
+	unsigned int stretch;
+	int prio;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	l_hashmap_foreach(slave->to_list, load_demand, &data);
+
+	for (prio = 0; prio <= UINT8_MAX; prio++) {
+		demand += data.demand[prio];
+		data.stretch[prio] = 1;
+	}
+
+	slave->demand = demand;
+	slave->capacity = (slave->service_time ?
+			   1000000.0 / slave->service_time : 0);
+	budget = slave->capacity * LOAD_TARGET;
+
+	for (prio = UINT8_MAX; slave->capacity && prio >= 0; prio--) {
+		if (data.demand[prio] <= budget) {
+			budget -= data.demand[prio];
+			continue;
+		}
+
+		for (i = 0, rest = 0; i <= prio; i++)
+			rest += data.demand[i];
+
+		if (budget < slave->capacity * LOAD_FLOOR)
+			budget = slave->capacity * LOAD_FLOOR;
+
+		stretch = ceil(rest / budget);
+		if (stretch > STRETCH_MAX)
+			stretch = STRETCH_MAX;
+
+		for (i = 0; i <= prio; i++)
+			data.stretch[i] = stretch;
+
+		break;
+	}
+
+	l_hashmap_foreach(slave->to_list, load_apply, &data);
+
+	if (data.degraded == slave->degraded)
+		return;
+
+	slave->degraded = data.degraded;
+
+	if (slave->degraded)
+		l_warn("slave %s: overloaded, demand %.1f/s capacity %.1f/s",
+		       slave->path, slave->demand, slave->capacity);
+	else
+		l_info("slave %s: load back to nominal", slave->path);
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Degraded");
+}
+
+/*
+ * Adaptive polling: each response with an unchanged value doubles the
+ * number of periods skipped, up to the source MaxBackoff. A change or
+ * a write snaps the source back to its PollingInterval.
+ */
+static void poll_backoff_increase(struct poll *poll)
+{
+	unsigned int max = source_get_max_backoff(poll->source);
+
+	if (max < 2 || poll->backoff >= max)
+		return;
+
+	poll->backoff = (poll->backoff ? poll->backoff * 2 : 2);
+	if (poll->backoff > max)
+		poll->backoff = max;
+}
+
+static void poll_backoff_reset(struct poll *poll)
+{
+	poll->backoff = 1;
+	poll->skipped = 0;
+}
+
+static void write_backoff_reset(struct slave *slave, const uint8_t *pdu,
+				uint8_t len)
+{
+	const struct l_queue_entry *entry;
+	struct source *source;
+	struct poll *poll;
+	uint8_t function;
+	uint16_t address;
+	uint16_t quantity;
+
+	if (len < 5)
+		return;
+
+	switch (pdu[0]) {
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		function = MODBUS_FC_READ_COILS;
+		break;
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		function = MODBUS_FC_READ_HOLDING_REGISTERS;
+		break;
+	default:
+		return;
+	}
+
+	address = pdu[1] << 8 | pdu[2];
+	if (pdu[0] == MODBUS_FC_WRITE_SINGLE_COIL ||
+	    pdu[0] == MODBUS_FC_WRITE_SINGLE_REGISTER)
+		quantity = 1;
+	else
+		quantity = pdu[3] << 8 | pdu[4];
+
+	for (entry = l_queue_get_entries(slave->source_list); entry;
+	     entry = entry->next) {
+		source = entry->data;
+
+		/* Overlapping the written range */
+		if (source_get_function(source) != function ||
+		    (uint32_t) address + quantity <= source_get_address(source) ||
+		    address >= (uint32_t) source_get_address(source) +
+		    source_get_size(source))
+			continue;
+
+		poll = l_hashmap_lookup(slave->to_list,
+					source_get_path(source));
+		if (poll)
+			poll_backoff_reset(poll);
+	}
+}
+
+static bool function_is_bits(uint8_t function)
+{
+	return (function == MODBUS_FC_READ_COILS ||
+		function == MODBUS_FC_READ_DISCRETE_INPUTS);
+}
+
+static uint16_t block_data_len(uint8_t function, uint16_t size)
+{
+	return function_is_bits(function) ? (size + 7) / 8 : size * 2;
+}
+
+static uint16_t block_max(const struct slave *slave, uint8_t function)
+{
+	uint16_t limit = slave->block_limit[function];
+	uint16_t max = (function_is_bits(function) ? MODBUS_MAX_READ_BITS :
+			MODBUS_MAX_READ_REGISTERS);
+
+	return (limit && limit < max ? limit : max);
+}
+
+static bool hole_overlaps(const struct slave *slave, uint8_t function,
+			  uint32_t start, uint32_t end)
+{
+	const struct l_queue_entry *entry;
+	const struct hole *hole;
+
+	for (entry = l_queue_get_entries(slave->holes); entry;
+	     entry = entry->next) {
+		hole = entry->data;
+
+		if (hole->function == function && hole->address < end &&
+		    (uint32_t) hole->address + hole->count > start)
+			return true;
+	}
+
+	return false;
+}
+
+static void hole_insert(struct slave *slave, uint8_t function,
+			uint16_t address, uint16_t count)
+{
+	struct hole *hole;
+
+	hole = l_new(struct hole, 1);
+	hole->function = function;
+	hole->address = address;
+	hole->count = count;
+	l_queue_push_tail(slave->holes, hole);
+}
+
+static void hole_add(struct slave *slave, uint8_t function, uint16_t address,
+		     uint16_t count)
+{
+	const struct l_queue_entry *entry;
+	const struct hole *hole;
+
+	slave->probe_explained = true;
+
+	/* Already known, e.g. same source failing every period */
+	for (entry = l_queue_get_entries(slave->holes); entry;
+	     entry = entry->next) {
+		hole = entry->data;
+
+		if (hole->function == function && hole->address <= address &&
+		    (uint32_t) hole->address + hole->count >=
+		    (uint32_t) address + count)
+			return;
+	}
+
+	hole_insert(slave, function, address, count);
+	storage_hole_add(slave->id, function, address, count);
+
+	l_info("slave %s: function %u, %u-%u invalid: not read in blocks",
+	       slave->path, function, address, address + count - 1);
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Holes");
+}
+
+/* All the reads of a split block done: was a hole behind the failure? */
+static void probe_done(struct slave *slave)
+{
+	uint16_t limit;
+
+	if (!slave->probes || --slave->probes)
+		return;
+
+	if (slave->probe_explained)
+		return;
+
+	limit = slave->probe_size / 2 ? : 1;
+	slave->block_limit[slave->probe_function] = limit;
+
+	l_warn("slave %s: function %u, reads limited to %u",
+	       slave->path, slave->probe_function, limit);
+}
+
+static void hole_probe_cb(int err, const uint8_t *pdu, int len,
+			  void *user_data)
+{
+	struct hole_probe *probe = user_data;
+	struct slave *slave = probe->slave;
+
+	if (err < 0 || len < 2)
+		slave->probe_explained = true;
+	else if (pdu[0] & 0x80 &&
+		 pdu[1] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS)
+		hole_add(slave, probe->hole.function, probe->hole.address,
+			 probe->hole.count);
+
+	probe_done(slave);
+	l_free(probe);
+}
+
+static void hole_probe(struct slave *slave, uint8_t function,
+		       uint16_t address, uint16_t count)
+{
+	struct hole_probe *probe;
+	struct poll *poll;
+
+	probe = l_new(struct hole_probe, 1);
+	probe->slave = slave;
+	probe->hole.function = function;
+	probe->hole.address = address;
+	probe->hole.count = count;
+
+	poll = forward_new();
+	poll->slave = slave;
+	poll->pdu_len = 5;
+	poll->pdu[0] = function;
+	poll->pdu[1] = address >> 8;
+	poll->pdu[2] = address & 0xff;
+	poll->pdu[3] = count >> 8;
+	poll->pdu[4] = count & 0xff;
+	poll->func = hole_probe_cb;
+	poll->user_data = probe;
+	poll->deadline = l_time_now();
+
+	slave->probes++;
+	request_enqueue(slave, poll);
+}
+
+/* Does @poll extend the block without crossing a hole or a long gap? */
+static bool block_fits(const struct slave *slave, const struct poll *poll)
+{
+	uint32_t address;
+	uint32_t end;
+	uint32_t start;
+	uint32_t block_end = (uint32_t) slave->block_address +
+			     slave->block_size;
+	uint32_t gap = 0;
+
+	if (poll->solo ||
+	    source_get_function(poll->source) != slave->block_function)
+		return false;
+
+	address = source_get_address(poll->source);
+	end = address + source_get_size(poll->source);
+
+	if (address > block_end)
+		gap = address - block_end;
+	else if (end < slave->block_address)
+		gap = slave->block_address - end;
+
+	if (gap * (function_is_bits(slave->block_function) ? 1 : 16) >
+	    BLOCK_MAX_GAP_BITS)
+		return false;
+
+	start = (address < slave->block_address ? address :
+		 slave->block_address);
+	if (end < block_end)
+		end = block_end;
+
+	if (end - start > block_max(slave, slave->block_function))
+		return false;
+
+	return !hole_overlaps(slave, slave->block_function, start, end);
+}
+
+static void block_append(struct slave *slave, struct poll *poll)
+{
+	uint16_t address = source_get_address(poll->source);
+	uint32_t end = (uint32_t) address + source_get_size(poll->source);
+	uint32_t block_end = (uint32_t) slave->block_address +
+			     slave->block_size;
+
+	if (slave->block_len) {
+		if (end < block_end)
+			end = block_end;
+
+		if (address > slave->block_address)
+			address = slave->block_address;
+	}
+
+	slave->block_address = address;
+	slave->block_size = end - address;
+	slave->block[slave->block_len++] = poll;
+	poll->reading = true;
+}
+
+/*
+ * Takes the polls waiting that can be read along with @lead (already
+ * dequeued) by the same request. Split blocks are read one source at a
+ * time until their probes complete.
+ */
+static void block_build(struct slave *slave, struct poll *lead)
+{
+	struct poll **p;
+	struct poll *poll;
+	bool added = true;
+
+	slave->block_len = 0;
+	slave->block_function = source_get_function(lead->source);
+	block_append(slave, lead);
+
+	if (lead->solo || slave->probes)
+		return;
+
+	while (added && slave->block_len < BLOCK_MAX_POLLS) {
+		added = false;
+
+		/* Not past a forwarded request: a write must come first */
+		for (p = &slave->req_head; *p && !(*p)->pdu &&
+		     slave->block_len < BLOCK_MAX_POLLS;) {
+			poll = *p;
+			if (!block_fits(slave, poll)) {
+				p = &poll->next;
+				continue;
+			}
+
+			*p = poll->next;
+			poll->next = NULL;
+			poll->queued = false;
+			slave->queue_len--;
+			block_append(slave, poll);
+			added = true;
+		}
+	}
+
+	/* Recompute the tail */
+	slave->req_tail = slave->req_head;
+	while (slave->req_tail && slave->req_tail->next)
+		slave->req_tail = slave->req_tail->next;
+}
+
+static void block_release(struct slave *slave)
+{
+	unsigned int i;
+
+	for (i = 0; i < slave->block_len; i++) {
+		if (slave->block[i])
+			slave->block[i]->reading = false;
+	}
+
+	slave->block_len = 0;
+}
+
+/* Source of the inflight block removed */
+static void block_remove(struct slave *slave, struct poll *poll)
+{
+	unsigned int i;
+
+	poll->reading = false;
+	if (slave->inflight == poll)
+		slave->inflight = NULL;
+
+	for (i = 0; i < slave->block_len; i++) {
+		if (slave->block[i] == poll)
+			slave->block[i] = NULL;
+		else if (slave->block[i] && !slave->inflight)
+			slave->inflight = slave->block[i];
+	}
+
+	if (!slave->inflight)
+		slave->block_len = 0;
+}
+
+static void block_member_done(struct slave *slave, struct poll *poll)
+{
+	if (!poll->solo)
+		return;
+
+	poll->solo = false;
+	probe_done(slave);
+}
+
+static void block_extract(const struct slave *slave, const uint8_t *data,
+			  const struct source *source, uint8_t *buf)
+{
+	unsigned int offset = source_get_address(source) -
+			      slave->block_address;
+	uint16_t size = source_get_size(source);
+	unsigned int bit;
+	unsigned int i;
+
+	if (!function_is_bits(slave->block_function)) {
+		memcpy(buf, data + offset * 2, size * 2);
+		return;
+	}
+
+	memset(buf, 0, (size + 7) / 8);
+
+	for (i = 0; i < size; i++) {
+		bit = offset + i;
+		if (data[bit / 8] & (1 << (bit % 8)))
+			buf[i / 8] |= 1 << (i % 8);
+	}
+}
+
+static void block_update(struct slave *slave, const uint8_t *data)
+{
+	uint8_t buf[UINT8_MAX];		/* Byte count is 8-bit */
+	struct poll *poll;
+	uint16_t len;
+	unsigned int i;
+
+	for (i = 0; i < slave->block_len; i++) {
+		poll = slave->block[i];
+		if (!poll)
+			continue;
+
+		len = source_get_data_len(poll->source);
+		block_extract(slave, data, poll->source, buf);
+
+		if (source_update(poll->source, buf, len)) {
+			stream_publish(poll->source, buf, len);
+			uplink_publish(poll->source, buf, len);
+			compute_source_changed(poll->source);
+			poll_backoff_reset(poll);
+		} else {
+			poll_backoff_increase(poll);
+		}
+
+		block_member_done(slave, poll);
+	}
+}
+
+static void block_fail(struct slave *slave, uint8_t quality)
+{
+	struct poll *poll;
+	unsigned int i;
+
+	for (i = 0; i < slave->block_len; i++) {
+		poll = slave->block[i];
+		if (!poll)
+			continue;
+
+		/* Inconclusive: no hole can be told from it */
+		if (quality == STORE_QUALITY_COMM_FAIL)
+			slave->probe_explained = true;
+
+		source_set_quality(poll->source, quality);
+		block_member_done(slave, poll);
+	}
+}
+
+/*
+ * The sources are read again one by one, ahead of the polls waiting,
+ * and each gap between them is probed: the ones answered with an
+ * exception become holes.
+ */
+static void block_split(struct slave *slave)
+{
+	struct poll *member[BLOCK_MAX_POLLS];
+	struct poll *poll;
+	unsigned int len = 0;
+	unsigned int i;
+	unsigned int j;
+	uint32_t cover;
+	uint32_t address;
+
+	/* By address: insertion sort, at most BLOCK_MAX_POLLS */
+	for (i = 0; i < slave->block_len; i++) {
+		poll = slave->block[i];
+		if (!poll)
+			continue;
+
+		address = source_get_address(poll->source);
+		for (j = len; j > 0 &&
+		     source_get_address(member[j - 1]->source) > address; j--)
+			member[j] = member[j - 1];
+
+		member[j] = poll;
+		len++;
+	}
+
+	l_info("slave %s: block %u+%u rejected, probing %u sources",
+	       slave->path, slave->block_address, slave->block_size, len);
+
+	slave->probe_function = slave->block_function;
+	slave->probe_size = slave->block_size;
+	slave->probe_explained = false;
+
+	for (i = len; i > 0; i--) {
+		poll = member[i - 1];
+		poll->reading = false;
+		poll->solo = true;
+		slave->probes++;
+		request_push(slave, poll);
+	}
+
+	cover = slave->block_address;
+	for (i = 0; i < len; i++) {
+		address = source_get_address(member[i]->source);
+		if (address > cover)
+			hole_probe(slave, slave->block_function, cover,
+				   address - cover);
+
+		address += source_get_size(member[i]->source);
+		if (address > cover)
+			cover = address;
+	}
+}
+
+static void block_exception(struct slave *slave, uint8_t code)
+{
+	struct poll *poll;
+	unsigned int i;
+
+	if (code != MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS) {
+		block_fail(slave, STORE_QUALITY_EXCEPTION | code);
+		return;
+	}
+
+	for (i = 0, poll = NULL; i < slave->block_len; i++) {
+		if (!slave->block[i])
+			continue;
+
+		if (poll) {
+			block_split(slave);
+			return;
+		}
+
+		poll = slave->block[i];
+	}
+
+	/* Read alone: the source itself covers invalid registers */
+	if (poll)
+		hole_add(slave, slave->block_function,
+			 source_get_address(poll->source),
+			 source_get_size(poll->source));
+
+	block_fail(slave, STORE_QUALITY_EXCEPTION | code);
+}
+
+/* A stale request timeout finds nothing in flight and is ignored */
+static void request_done(struct slave *slave)
+{
+	uint64_t now = l_time_now();
+
+	slave->inflight = NULL;
+	block_release(slave);
+
+	if (now - slave->load_at >= LOAD_PERIOD_MS * 1000) {
+		slave->load_at = now;
+		load_update(slave);
+	}
+
+	request_send(slave);
+}
+
+static void request_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct slave *slave = user_data;
+	struct poll *poll;
+	WATCHDOG_SCOPE("request timeout");
+
+	poll = slave->inflight;
+	if (!poll)
+		return;
+
+	stats_timeout(&slave->stats);
+	trace(TIMEOUT, slave->id, poll->pdu ? poll_address(poll) :
+	      slave->block_address, 0);
+	service_sample(slave, REQUEST_TIMEOUT_MS * 1000);
+
+	l_timeout_remove(slave->replay_to);
+	slave->replay_to = NULL;
+
+	/* Drop whatever is left of a late response */
+	if (slave->io)
+		transport_flush(slave->ctx, &slave->endpoint, &slave->rx);
+
+	if (poll->pdu) {
+		capture_record(slave->id, poll->pdu[0], poll_address(poll),
+			       pdu_quantity(poll->pdu, poll->pdu_len),
+			       CAPTURE_STATUS_TIMEOUT, slave->sent_at,
+			       l_time_now() - slave->sent_at, NULL, 0);
+		slave->inflight = NULL;
+		forward_complete(poll, -ETIMEDOUT, NULL, 0);
+	} else {
+		block_fail(slave, STORE_QUALITY_COMM_FAIL);
+		capture_record(slave->id, slave->block_function,
+			       slave->block_address, slave->block_size,
+			       CAPTURE_STATUS_TIMEOUT, slave->sent_at,
+			       l_time_now() - slave->sent_at, NULL, 0);
+	}
+
+	request_done(slave);
+}
+
+static void disconnect_idle(void *user_data)
+{
+	struct slave *slave = user_data;
+	WATCHDOG_SCOPE("disconnect");
+
+	slave->disconnecting = false;
+
+	l_info("slave %s: connection lost", slave->path);
+
+	slave_close(slave);
+	if (slave->enable)
+		connect_enqueue(slave);
+}
+
+/* Connection errors are detected inside io handlers: close it later */
+static void disconnect_schedule(struct slave *slave)
+{
+	if (slave->disconnecting)
+		return;
+
+	slave->disconnecting = l_idle_oneshot(disconnect_idle, slave_ref(slave),
+				(l_idle_destroy_cb_t) slave_unref);
+}
+
+static void response_process(struct slave *slave, const uint8_t *pdu,
+			     int len, int bytes)
+{
+	struct poll *poll = slave->inflight;
+	uint16_t data_len;
+	uint8_t function;
+	uint64_t rtt;
+
+	/* Late response to a timed out request */
+	if (!poll) {
+		stats_error(&slave->stats);
+		return;
+	}
+
+	if (len < 2) {
+		stats_error(&slave->stats);
+		return;
+	}
+
+	rtt = l_time_now() - slave->sent_at;
+
+	/* Forwarded: any reply (or exception) to the same function */
+	if (poll->pdu) {
+		if ((pdu[0] & 0x7f) != poll->pdu[0]) {
+			stats_error(&slave->stats);
+			return;
+		}
+
+		trace(RESPONSE, slave->id, poll_address(poll), rtt);
+		capture_record(slave->id, poll->pdu[0], poll_address(poll),
+			       pdu_quantity(poll->pdu, poll->pdu_len),
+			       CAPTURE_STATUS_RESPONSE, slave->sent_at, rtt,
+			       pdu, len);
+		stats_response(&slave->stats, bytes, rtt);
+		service_sample(slave, rtt);
+		if (pdu[0] & 0x80)
+			stats_exception(&slave->stats);
+
+		/* Written registers may have changed: poll them again */
+		if (!(pdu[0] & 0x80))
+			write_backoff_reset(slave, poll->pdu, poll->pdu_len);
+
+		slave->inflight = NULL;
+		forward_complete(poll, 0, pdu, len);
+		request_done(slave);
+		return;
+	}
+
+	function = slave->block_function;
+	data_len = block_data_len(function, slave->block_size);
+
+	if (pdu[0] == (function | 0x80)) {
+		trace(EXCEPTION, slave->id, slave->block_address, pdu[1]);
+		capture_record(slave->id, function, slave->block_address,
+			       slave->block_size, CAPTURE_STATUS_RESPONSE,
+			       slave->sent_at, rtt, pdu, 2);
+		stats_response(&slave->stats, bytes, rtt);
+		service_sample(slave, rtt);
+		stats_exception(&slave->stats);
+		block_exception(slave, pdu[1]);
+		request_done(slave);
+		return;
+	}
+
+	/* Not the expected reply: keep waiting until timeout */
+	if (pdu[0] != function || pdu[1] != data_len ||
+	    len < 2 + data_len) {
+		stats_error(&slave->stats);
+		return;
+	}
+
+	trace(RESPONSE, slave->id, slave->block_address, rtt);
+	capture_record(slave->id, function, slave->block_address,
+		       slave->block_size, CAPTURE_STATUS_RESPONSE,
+		       slave->sent_at, rtt, pdu, 2 + data_len);
+	stats_response(&slave->stats, bytes, rtt);
+
+	/* Capacity and demand are both counted in source reads */
+	service_sample(slave, rtt / slave->block_len);
+	block_update(slave, pdu + 2);
+	request_done(slave);
+}
+
+static void replay_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct slave *slave = user_data;
+	WATCHDOG_SCOPE("replay");
+
+	l_timeout_remove(slave->replay_to);
+	slave->replay_to = NULL;
+
+	response_process(slave, slave->replay_pdu, slave->replay_len,
+			 slave->replay_len);
+}
+
+/*
+ * Replay transport: answer from the capture after the recorded RTT.
+ * Requests timed out or never seen in the capture get no answer.
+ */
+static int replay_send(struct slave *slave, const uint8_t *req, int len)
+{
+	uint64_t rtt;
+
+	if (len < 4)
+		return len;
+
+	if (replay_lookup(req[0], req[1], req[2] << 8 | req[3],
+			  pdu_quantity(req + 1, len - 1), &rtt,
+			  &slave->replay_pdu, &slave->replay_len) < 0)
+		return len;
+
+	slave->replay_to = l_timeout_create_ms(rtt / 1000 ? rtt / 1000 : 1,
+					       replay_to_expired, slave, NULL);
+
+	return len;
+}
+
+static void request_send(struct slave *slave)
+{
+	struct poll *poll;
+	uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+	uint16_t address;
+	int req_len;
+	uint64_t now;
+	int len;
+
+	if (slave->inflight || !slave->ctx || slave->disconnecting)
+		return;
+
+	poll = slave->req_head;
+	if (!poll)
+		return;
+
+	slave->req_head = poll->next;
+	if (!slave->req_head)
+		slave->req_tail = NULL;
+
+	poll->next = NULL;
+	poll->queued = false;
+	slave->queue_len--;
+
+	/* Raw PDU prefixed by the unit id: framed by transport_send() */
+	req[0] = slave->id;
+
+	if (poll->pdu) {
+		memcpy(req + 1, poll->pdu, poll->pdu_len);
+		req_len = 1 + poll->pdu_len;
+		address = poll_address(poll);
+	} else {
+		block_build(slave, poll);
+		req[1] = slave->block_function;
+		req[2] = slave->block_address >> 8;
+		req[3] = slave->block_address & 0xff;
+		req[4] = slave->block_size >> 8;
+		req[5] = slave->block_size & 0xff;
+		req_len = 6;
+		address = slave->block_address;
+	}
+
+	if (replay_enabled())
+		len = replay_send(slave, req, req_len);
+	else
+		len = transport_send(slave->ctx, &slave->endpoint,
+				     &slave->rx, req, req_len);
+
+	if (len < 0) {
+		stats_error(&slave->stats);
+		if (poll->pdu)
+			forward_complete(poll, -EIO, NULL, 0);
+		else
+			block_release(slave);
+
+		disconnect_schedule(slave);
+		return;
+	}
+
+	now = l_time_now();
+	trace(REQUEST, slave->id, address, len);
+	stats_request(&slave->stats, len,
+		      now > poll->deadline ? now - poll->deadline : 0);
+
+	slave->inflight = poll;
+	slave->sent_at = now;
+
+	if (!slave->req_to)
+		slave->req_to = l_timeout_create_ms(REQUEST_TIMEOUT_MS,
+						    request_to_expired,
+						    slave, NULL);
+	else
+		l_timeout_modify_ms(slave->req_to, REQUEST_TIMEOUT_MS);
+}
+
+static bool response_read_cb(struct l_io *io, void *user_data)
+{
+	struct slave *slave = user_data;
+	unsigned int offset;
+	unsigned int pdu_len;
+	int len;
+	WATCHDOG_SCOPE("response");
+
+	/* Several responses may have arrived at once */
+	while (slave->ctx && !slave->disconnecting) {
+		len = transport_receive(slave->ctx, &slave->endpoint,
+					&slave->rx, &offset, &pdu_len);
+		if (len == -EAGAIN)
+			break;
+
+		/* Dropped: the request times out unless a valid one follows */
+		if (len == -EBADMSG) {
+			stats_error(&slave->stats);
+			continue;
+		}
+
+		if (len < 0) {
+			stats_error(&slave->stats);
+			disconnect_schedule(slave);
+			break;
+		}
+
+		response_process(slave, slave->rx.buf + offset, pdu_len, len);
+	}
+
+	return true;
+}
+
+static void response_disconnect_cb(struct l_io *io, void *user_data)
+{
+	struct slave *slave = user_data;
+
+	disconnect_schedule(slave);
+}
+
+static void polling_expired(uint64_t deadline, void *user_data)
+{
+	struct poll *poll = user_data;
+	struct slave *slave = poll->slave;
+	unsigned int periods;
+
+	trace(POLL, slave->id, poll_address(poll), deadline);
+
+	if (!slave->ctx)
+		return;
+
+	/* Degraded or backed off: only one period out of n is polled */
+	periods = (poll->stretch ? : 1) * (poll->backoff ? : 1);
+	if (periods > 1 && ++poll->skipped < periods)
+		return;
+
+	poll->skipped = 0;
+
+	/* Previous request of this source didn't complete yet */
+	if (poll->queued || poll->reading ||
+	    slave->queue_len >= SLAVE_QUEUE_MAX) {
+		stats_overrun(&slave->stats);
+		return;
+	}
+
+	poll->deadline = deadline;
+
+	request_enqueue(slave, poll);
+	request_send(slave);
+}
+
+static void polling_start(void *data, void *user_data)
+{
+	struct slave *slave = user_data;
+	struct source *source = data;
+	struct poll *poll;
+
+	/* Already scheduled */
+	if (l_hashmap_lookup(slave->to_list, source_get_path(source)))
+		return;
+
+	poll = l_new(struct poll, 1);
+	poll->slave = slave;
+	poll->source = source;
+
+	/* Sources of a slave sharing an interval share the same phase */
+	poll->entry = sched_add(slave,
+				replay_scale(source_get_interval(source)),
+				polling_expired, poll);
+	if (!poll->entry) {
+		l_free(poll);
+		return;
+	}
+
+	l_hashmap_insert(slave->to_list, source_get_path(source), poll);
+
+	/* First entry of a paused slave: its group was just created */
+	if (slave->paused)
+		sched_pause(slave);
+
+	trace(POLL_START, slave->id, (uintptr_t) source,
+	      source_get_interval(source));
+}
+
+static void request_queue_remove(struct slave *slave, struct poll *poll)
+{
+	struct poll **p;
+
+	if (poll->reading)
+		block_remove(slave, poll);
+	else if (slave->inflight == poll)
+		slave->inflight = NULL;
+
+	/* Its probe read won't come */
+	if (poll->solo) {
+		poll->solo = false;
+		probe_done(slave);
+	}
+
+	if (!poll->queued)
+		return;
+
+	for (p = &slave->req_head; *p; p = &(*p)->next) {
+		if (*p != poll)
+			continue;
+
+		*p = poll->next;
+		break;
+	}
+
+	/* Recompute the tail */
+	slave->req_tail = slave->req_head;
+	while (slave->req_tail && slave->req_tail->next)
+		slave->req_tail = slave->req_tail->next;
+
+	poll->queued = false;
+	slave->queue_len--;
+}
+
+static void request_queue_clear(struct slave *slave)
+{
+	struct poll *inflight = slave->inflight;
+	struct poll *head = slave->req_head;
+	struct poll *poll;
+
+	/* Detached first: forward callbacks may queue new requests */
+	slave->req_head = NULL;
+	slave->req_tail = NULL;
+	slave->inflight = NULL;
+	slave->queue_len = 0;
+	slave->probes = 0;
+	block_release(slave);
+
+	if (inflight && inflight->pdu)
+		forward_complete(inflight, -ECONNRESET, NULL, 0);
+
+	while ((poll = head)) {
+		head = poll->next;
+		poll->next = NULL;
+		poll->queued = false;
+		poll->solo = false;
+
+		if (poll->pdu)
+			forward_complete(poll, -ECONNRESET, NULL, 0);
+	}
+}
+
+static void polling_stop(struct slave *slave, struct source *source)
+{
+	struct poll *poll;
+
+	poll = l_hashmap_remove(slave->to_list, source_get_path(source));
+	if (!poll)
+		return;
+
+	request_queue_remove(slave, poll);
+	poll_destroy(poll);
+}
+
+static void connect_reply(struct slave *slave, int err)
+{
+	struct l_dbus_message *reply = NULL;
+
+	if (!slave->pending)
+		return;
+
+	if (err)
+		reply = dbus_error_errno(slave->pending, "Connect", err);
+
+	slave->complete(dbus_get_bus(), slave->pending, reply);
+	l_dbus_message_unref(slave->pending);
+	slave->pending = NULL;
+	slave->complete = NULL;
+}
+
+static void reconnect_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct slave *slave = user_data;
+	WATCHDOG_SCOPE("reconnect");
+
+	l_timeout_remove(slave->connect_to);
+	slave->connect_to = NULL;
+
+	slave->state = CONNECT_STATE_QUEUED;
+	l_queue_push_tail(connect_queue, slave);
+	connect_schedule();
+}
+
+static void io_destroy_idle(void *user_data)
+{
+	l_io_destroy(user_data);
+}
+
+/* Safe from within the io's own handler */
+static void io_destroy_later(struct l_io *io)
+{
+	if (!io)
+		return;
+
+	l_io_set_write_handler(io, NULL, NULL, NULL);
+	l_idle_oneshot(io_destroy_idle, io, NULL);
+}
+
+/*
+ * Wraps the connected socket, if any, in a context framing requests
+ * for the slave transport. Serial lines have no connection step: they
+ * are opened here.
+ */
+static int transport_open(struct slave *slave)
+{
+	modbus_t *ctx;
+	int fd = -1;
+	int err;
+
+	if (slave->io)
+		fd = l_io_get_fd(slave->io);
+
+	ctx = transport_new(&slave->endpoint, fd);
+	if (!ctx)
+		return -EINVAL;
+
+	if (!slave->io && !transport_socktype(&slave->endpoint) &&
+	    !replay_enabled()) {
+		if (modbus_connect(ctx) < 0) {
+			err = -errno;
+			modbus_free(ctx);
+			return err;
+		}
+
+		slave->io = l_io_new(modbus_get_socket(ctx));
+	}
+
+	modbus_set_slave(ctx, slave->id);
+	memset(&slave->rx, 0, sizeof(slave->rx));
+
+	/* libmodbus takes over the socket */
+	if (slave->io) {
+		l_io_set_close_on_destroy(slave->io, false);
+		l_io_set_read_handler(slave->io, response_read_cb,
+				      slave, NULL);
+		l_io_set_disconnect_handler(slave->io,
+					    response_disconnect_cb,
+					    slave, NULL);
+	}
+
+	slave->ctx = ctx;
+
+	return 0;
+}
+
+static void connect_done(struct slave *slave, int err)
+{
+	if (slave->state == CONNECT_STATE_INPROGRESS)
+		connect_inflight--;
+
+	l_timeout_remove(slave->connect_to);
+	slave->connect_to = NULL;
+	slave->state = CONNECT_STATE_IDLE;
+
+	if (err == 0)
+		err = transport_open(slave);
+
+	trace(CONNECT, slave->id, (int64_t) err, 0);
+	if (err < 0)
+		l_info("connect() %s (%d)", slave->address, -err);
+
+	if (err == 0) {
+		slave->backoff = 0;
+
+		/* Entries kept across reconnections: only new ones are added */
+		l_queue_foreach(slave->source_list, polling_start, slave);
+		if (!slave->paused)
+			sched_resume(slave);
+
+		connect_reply(slave, 0);
+		return;
+	}
+
+	io_destroy_later(slave->io);
+	slave->io = NULL;
+
+	/* Requested from D-Bus: report the error instead of retrying */
+	if (slave->pending) {
+		slave->enable = false;
+		connect_reply(slave, -err);
+		return;
+	}
+
+	if (slave->enable) {
+		slave->backoff = (slave->backoff ? slave->backoff * 2 :
+				  RECONNECT_MIN);
+		if (slave->backoff > RECONNECT_MAX)
+			slave->backoff = RECONNECT_MAX;
+
+		slave->connect_to = l_timeout_create(slave->backoff,
+						     reconnect_to_expired,
+						     slave, NULL);
+	}
+}
+
+static bool connect_cb(struct l_io *io, void *user_data)
+{
+	struct slave *slave = user_data;
+	socklen_t len;
+	int err = 0;
+	WATCHDOG_SCOPE("connect");
+
+	len = sizeof(err);
+	if (getsockopt(l_io_get_fd(io), SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	connect_done(slave, -err);
+	connect_schedule();
+
+	return false;
+}
+
+static void connect_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct slave *slave = user_data;
+	WATCHDOG_SCOPE("connect timeout");
+
+	connect_done(slave, -ETIMEDOUT);
+	connect_schedule();
+}
+
+static int connect_start(struct slave *slave)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char port[8];
+	int socktype = transport_socktype(&slave->endpoint);
+	int enable = 1;
+	int fd;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%d", slave->endpoint.port);
+
+	if (getaddrinfo(slave->endpoint.host, port, &hints, &res) != 0)
+		return -EHOSTUNREACH;
+
+	fd = socket(res->ai_family,
+		    socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err = -errno;
+		freeaddrinfo(res);
+		return err;
+	}
+
+	if (socktype == SOCK_STREAM)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+			   &enable, sizeof(enable));
+
+	/* Datagrams: connect() only sets the peer, done right away */
+	err = connect(fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (err < 0 && errno != EINPROGRESS) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	slave->io = l_io_new(fd);
+	l_io_set_close_on_destroy(slave->io, true);
+	l_io_set_write_handler(slave->io, connect_cb, slave, NULL);
+	slave->connect_to = l_timeout_create(CONNECT_TIMEOUT,
+					     connect_to_expired, slave, NULL);
+	slave->state = CONNECT_STATE_INPROGRESS;
+	connect_inflight++;
+
+	return 0;
+}
+
+static void connect_next(void)
+{
+	struct slave *slave;
+	int err;
+
+	while (connect_inflight < CONNECT_MAX_INFLIGHT) {
+		slave = l_queue_pop_head(connect_queue);
+		if (!slave)
+			return;
+
+		slave->state = CONNECT_STATE_IDLE;
+
+		/*
+		 * Replay: no connection, responses come from the capture.
+		 * Serial lines are opened by transport_open().
+		 */
+		if (replay_enabled() || !transport_socktype(&slave->endpoint)) {
+			connect_done(slave, 0);
+			continue;
+		}
+
+		err = connect_start(slave);
+		if (err == 0)
+			return;
+
+		connect_done(slave, err);
+	}
+}
+
+static void connect_pacing_expired(struct l_timeout *timeout, void *user_data)
+{
+	WATCHDOG_SCOPE("connect pacing");
+
+	l_timeout_remove(connect_pacing);
+	connect_pacing = NULL;
+
+	connect_schedule();
+}
+
+static void connect_schedule(void)
+{
+	/* Next launch already paced */
+	if (connect_pacing)
+		return;
+
+	if (connect_inflight >= CONNECT_MAX_INFLIGHT ||
+	    l_queue_isempty(connect_queue))
+		return;
+
+	connect_next();
+
+	if (!l_queue_isempty(connect_queue))
+		connect_pacing = l_timeout_create_ms(CONNECT_SPACING_MS,
+						     connect_pacing_expired,
+						     NULL, NULL);
+}
+
+static void connect_cancel(struct slave *slave, int err)
+{
+	switch (slave->state) {
+	case CONNECT_STATE_QUEUED:
+		l_queue_remove(connect_queue, slave);
+		break;
+	case CONNECT_STATE_INPROGRESS:
+		l_io_destroy(slave->io);
+		slave->io = NULL;
+		connect_inflight--;
+		break;
+	case CONNECT_STATE_IDLE:
+		break;
+	}
+
+	l_timeout_remove(slave->connect_to);
+	slave->connect_to = NULL;
+	slave->state = CONNECT_STATE_IDLE;
+	slave->backoff = 0;
+
+	connect_reply(slave, err);
+	connect_schedule();
+}
+
+static void connect_enqueue(struct slave *slave)
+{
+	if (slave->ctx || slave->state != CONNECT_STATE_IDLE)
+		return;
+
+	/* Waiting to retry: connect right away */
+	l_timeout_remove(slave->connect_to);
+	slave->connect_to = NULL;
+
+	slave->state = CONNECT_STATE_QUEUED;
+	l_queue_push_tail(connect_queue, slave);
+	connect_schedule();
+}
+
+static void slave_close(struct slave *slave)
+{
+	connect_cancel(slave, ECANCELED);
+
+	/* Already closed? */
+	if (slave->ctx == NULL)
+		return;
+
+	store_set_owner_quality(slave->id, STORE_QUALITY_COMM_FAIL);
+
+	/* Polling entries stay, without firing, until connected again */
+	sched_pause(slave);
+
+	request_queue_clear(slave);
+	l_timeout_remove(slave->req_to);
+	slave->req_to = NULL;
+	l_timeout_remove(slave->replay_to);
+	slave->replay_to = NULL;
+
+	/* The socket belongs to libmodbus */
+	l_io_destroy(slave->io);
+	slave->io = NULL;
+
+	/* Releasing connection */
+	modbus_close(slave->ctx);
+	modbus_free(slave->ctx);
+	slave->ctx = NULL;
+}
+
+static void settings_debug(const char *str, void *userdata)
+{
+        l_info("%s\n", str);
+}
+
+static bool address_cmp(const void *a, const void *b)
+{
+	const struct source *source = a;
+	uint16_t address = L_PTR_TO_UINT(b);
+
+	return (source_get_address(source) == address ? true : false);
 }
 
 static struct l_dbus_message *method_source_add(struct l_dbus *dbus,
@@ -147,7 +1809,10 @@ static struct l_dbus_message *method_source_add(struct l_dbus *dbus,
 	uint16_t address = 0;
 	uint16_t size = 0;
 	uint16_t interval = 1000; /* ms */
+	uint8_t priority = 0;
+	uint8_t max_backoff = 0;
 	bool ret;
+	WATCHDOG_SCOPE("AddSource");
 
 	if (!l_dbus_message_get_arguments(msg, "a{sv}", &dict))
 		return dbus_error_invalid_args(msg);
@@ -168,6 +1833,12 @@ static struct l_dbus_message *method_source_add(struct l_dbus *dbus,
 		else if (strcmp(key, "PollingInterval") == 0)
 			ret = l_dbus_message_iter_get_variant(&value,
 							      "q", &interval);
+		else if (strcmp(key, "Priority") == 0)
+			ret = l_dbus_message_iter_get_variant(&value,
+							      "y", &priority);
+		else if (strcmp(key, "MaxBackoff") == 0)
+			ret = l_dbus_message_iter_get_variant(&value,
+							      "y", &max_backoff);
 		else
 			return dbus_error_invalid_args(msg);
 
@@ -175,16 +1846,22 @@ static struct l_dbus_message *method_source_add(struct l_dbus *dbus,
 			return dbus_error_invalid_args(msg);
 	}
 
-	/* FIXME: validate type */
-	if (!name || !type || address == 0 || size == 0)
+	if (!name || address == 0 || !source_is_valid(type, address, size))
 		return dbus_error_invalid_args(msg);
 
-	/* TODO: Add to storage and create source object */
-	source = source_create(slave->path, name, type,
-			       address, size, interval);
+	source = slave_add_source(slave, name, type, address, size, interval,
+				  priority, max_backoff);
 	if (!source)
 		return dbus_error_invalid_args(msg);
 
+	/* Referenced by the caller: export it even in lazy mode */
+	source_register(source);
+
+	if (storage_source_add(slave->id, name, type,
+			       address, size, interval, priority,
+			       max_backoff) < 0)
+		l_error("storage: unable to store source 0x%04x", address);
+
 	/* Add object path to reply message */
 	reply = l_dbus_message_new_method_return(msg);
 	builder = l_dbus_message_builder_new(reply);
@@ -193,8 +1870,6 @@ static struct l_dbus_message *method_source_add(struct l_dbus *dbus,
 	l_dbus_message_builder_finalize(builder);
 	l_dbus_message_builder_destroy(builder);
 
-	l_queue_push_head(slave->source_list, source);
-
 	return reply;
 }
 
@@ -209,17 +1884,85 @@ static struct l_dbus_message *method_source_remove(struct l_dbus *dbus,
 	if (!l_dbus_message_get_arguments(msg, "o", &opath))
 		return dbus_error_invalid_args(msg);
 
-	/* TODO: remove from storage and destroy source object */
-
 	source = l_queue_remove_if(slave->source_list, path_cmp, opath);
 	if (unlikely(!source))
 		return dbus_error_invalid_args(msg);
 
+	l_queue_remove(slave->profile_sources, source);
+	storage_source_remove(slave->id, source_get_address(source));
+	polling_stop(slave, source);
 	source_destroy(source);
 
 	return l_dbus_message_new_method_return(msg);
 }
 
+static struct l_dbus_message *method_source_list(struct l_dbus *dbus,
+						struct l_dbus_message *msg,
+						void *user_data)
+{
+	struct slave *slave = user_data;
+	const struct l_queue_entry *entry;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	struct source *source;
+	uint32_t offset;
+	uint32_t count;
+	WATCHDOG_SCOPE("ListSources");
+
+	if (!l_dbus_message_get_arguments(msg, "uu", &offset, &count))
+		return dbus_error_invalid_args(msg);
+
+	if (count > LIST_MAX_COUNT)
+		count = LIST_MAX_COUNT;
+
+	entry = l_queue_get_entries(slave->source_list);
+	for (; entry && offset; entry = entry->next, offset--)
+		;
+
+	reply = l_dbus_message_new_method_return(msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "(oa{sv})");
+
+	for (; entry && count; entry = entry->next, count--) {
+		source = entry->data;
+
+		/* Lazy mode: paths handed out must be reachable */
+		source_register(source);
+
+		l_dbus_message_builder_enter_struct(builder, "oa{sv}");
+		l_dbus_message_builder_append_basic(builder, 'o',
+						    source_get_path(source));
+		source_append_properties(source, builder);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static struct l_dbus_message *method_holes_clear(struct l_dbus *dbus,
+						struct l_dbus_message *msg,
+						void *user_data)
+{
+	struct slave *slave = user_data;
+	struct hole *hole;
+
+	while ((hole = l_queue_pop_head(slave->holes))) {
+		storage_hole_remove(slave->id, hole->function, hole->address);
+		l_free(hole);
+	}
+
+	memset(slave->block_limit, 0, sizeof(slave->block_limit));
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Holes");
+
+	return l_dbus_message_new_method_return(msg);
+}
+
 static bool property_get_id(struct l_dbus *dbus,
 				  struct l_dbus_message *msg,
 				  struct l_dbus_message_builder *builder,
@@ -275,7 +2018,7 @@ static bool property_get_enable(struct l_dbus *dbus,
 	struct slave *slave = user_data;
 	bool enable;
 
-	enable = (slave->tcp ? true : false);
+	enable = (slave->ctx ? true : false);
 
 	l_dbus_message_builder_append_basic(builder, 'b', &enable);
 
@@ -290,7 +2033,6 @@ static struct l_dbus_message *property_set_enable(struct l_dbus *dbus,
 {
 	struct slave *slave = user_data;
 	bool enable;
-	int err;
 
 	if (!l_dbus_message_iter_get_variant(new_value, "b", &enable))
 		return dbus_error_invalid_args(msg);
@@ -298,46 +2040,123 @@ static struct l_dbus_message *property_set_enable(struct l_dbus *dbus,
 
 	/* Shutdown modbus tcp */
 	if (enable == false) {
-
-		/* Already closed? */
-		if (slave->tcp == NULL)
-			goto done;
-
-		/* Releasing connection */
-		modbus_close(slave->tcp);
-		modbus_free(slave->tcp);
-		slave->tcp = NULL;
+		slave_disable(slave);
 	} else {
 		/* Enabling modbus tcp */
 
 		/* Already connected ? */
-		if (slave->tcp)
+		if (slave->ctx)
 			goto done;
 
-		slave->tcp = modbus_new_tcp(slave->hostname, slave->port);
-
-		err = modbus_connect(slave->tcp);
-		l_info("connect() %s:%d (%d)",
-		       slave->hostname, slave->port, err);
-		if (err != -1) {
-			l_queue_foreach(slave->source_list,
-					polling_start, slave);
-			goto done;
-		}
+		if (slave->pending)
+			return dbus_error_errno(msg, "Connect", EALREADY);
 
-		/* Releasing connection */
-		err = errno;
-		modbus_close(slave->tcp);
-		modbus_free(slave->tcp);
-		slave->tcp = NULL;
+		/* Replied once the connection completes or fails */
+		slave->enable = true;
+		slave->pending = l_dbus_message_ref(msg);
+		slave->complete = complete;
+		connect_enqueue(slave);
 
-		return dbus_error_errno(msg, "Connect", err);
+		return NULL;
 	}
 done:
 	complete(dbus, msg, NULL);
 	return NULL;
 }
 
+static bool property_get_profile(struct l_dbus *dbus,
+				 struct l_dbus_message *msg,
+				 struct l_dbus_message_builder *builder,
+				 void *user_data)
+{
+	struct slave *slave = user_data;
+
+	/* Empty: sources added one by one */
+	l_dbus_message_builder_append_basic(builder, 's',
+				slave->profile ?
+				profile_get_name(slave->profile) : "");
+
+	return true;
+}
+
+static bool property_get_paused(struct l_dbus *dbus,
+				struct l_dbus_message *msg,
+				struct l_dbus_message_builder *builder,
+				void *user_data)
+{
+	struct slave *slave = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'b', &slave->paused);
+
+	return true;
+}
+
+static bool property_get_demand(struct l_dbus *dbus,
+				struct l_dbus_message *msg,
+				struct l_dbus_message_builder *builder,
+				void *user_data)
+{
+	struct slave *slave = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'd', &slave->demand);
+
+	return true;
+}
+
+static bool property_get_capacity(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct slave *slave = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'd', &slave->capacity);
+
+	return true;
+}
+
+static bool property_get_degraded(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct slave *slave = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'b', &slave->degraded);
+
+	return true;
+}
+
+static bool property_get_holes(struct l_dbus *dbus,
+			       struct l_dbus_message *msg,
+			       struct l_dbus_message_builder *builder,
+			       void *user_data)
+{
+	struct slave *slave = user_data;
+	const struct l_queue_entry *entry;
+	const struct hole *hole;
+
+	l_dbus_message_builder_enter_array(builder, "(yqq)");
+
+	for (entry = l_queue_get_entries(slave->holes); entry;
+	     entry = entry->next) {
+		hole = entry->data;
+
+		l_dbus_message_builder_enter_struct(builder, "yqq");
+		l_dbus_message_builder_append_basic(builder, 'y',
+						    &hole->function);
+		l_dbus_message_builder_append_basic(builder, 'q',
+						    &hole->address);
+		l_dbus_message_builder_append_basic(builder, 'q',
+						    &hole->count);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
 static void setup_interface(struct l_dbus_interface *interface)
 {
 
@@ -349,6 +2168,15 @@ static void setup_interface(struct l_dbus_interface *interface)
 	l_dbus_interface_method(interface, "RemoveSource", 0,
 				method_source_remove, "", "o", "path");
 
+	/* Paged alternative to GetManagedObjects */
+	l_dbus_interface_method(interface, "ListSources", 0,
+				method_source_list, "a(oa{sv})", "uu",
+				"sources", "offset", "count");
+
+	/* Forget the holes learned: e.g. PLC program changed */
+	l_dbus_interface_method(interface, "ClearHoles", 0,
+				method_holes_clear, "", "");
+
 	if (!l_dbus_interface_property(interface, "Id", 0, "y",
 				       property_get_id,
 				       NULL))
@@ -366,22 +2194,51 @@ static void setup_interface(struct l_dbus_interface *interface)
 				       property_set_enable))
 		l_error("Can't add 'Enable' property");
 
+	/* Device profile: see profile_get() */
+	if (!l_dbus_interface_property(interface, "Profile", 0, "s",
+				       property_get_profile,
+				       NULL))
+		l_error("Can't add 'Profile' property");
+
+	/* Polling suspended: see Manager1.PauseSlaves */
+	if (!l_dbus_interface_property(interface, "Paused", 0, "b",
+				       property_get_paused,
+				       NULL))
+		l_error("Can't add 'Paused' property");
+
+	/* Backpressure: polling demand vs measured capacity, reads/s */
+	if (!l_dbus_interface_property(interface, "Demand", 0, "d",
+				       property_get_demand,
+				       NULL))
+		l_error("Can't add 'Demand' property");
+
+	if (!l_dbus_interface_property(interface, "Capacity", 0, "d",
+				       property_get_capacity,
+				       NULL))
+		l_error("Can't add 'Capacity' property");
+
+	/* Low priority sources polled below their nominal rate */
+	if (!l_dbus_interface_property(interface, "Degraded", 0, "b",
+				       property_get_degraded,
+				       NULL))
+		l_error("Can't add 'Degraded' property");
+
+	/* Ranges answered with ILLEGAL DATA ADDRESS: function, address, count */
+	if (!l_dbus_interface_property(interface, "Holes", 0, "a(yqq)",
+				       property_get_holes,
+				       NULL))
+		l_error("Can't add 'Holes' property");
+
 }
 
 struct slave *slave_create(uint8_t id, const char *name, const char *address)
 {
 	struct slave *slave;
 	char *dpath;
-	char hostname[128];
-	int port = -1;
+	struct endpoint endpoint;
 
-	/* "host:port or /dev/ttyACM0, /dev/ttyUSB0, ..."*/
-
-	memset(hostname, 0, sizeof(hostname));
-	if (sscanf(address, "%[^:]:%d", hostname, &port) != 2) {
-		l_error("Address (%s) not supported: Invalid format", address);
+	if (transport_parse(address, &endpoint) < 0)
 		return NULL;
-	}
 
 	/* FIXME: id is not unique across PLCs */
 
@@ -392,17 +2249,22 @@ struct slave *slave_create(uint8_t id, const char *name, const char *address)
 	slave->id = id;
 	slave->enable = false;
 	slave->name = l_strdup(name);
-	slave->hostname = l_strdup(hostname);
-	slave->port = port;
-	slave->tcp = NULL;
+	slave->address = l_strdup(address);
+	slave->endpoint = endpoint;
+	slave->ctx = NULL;
+	slave->state = CONNECT_STATE_IDLE;
+	memset(&slave->stats, 0, sizeof(slave->stats));
 	slave->source_list = l_queue_new();
+	slave->profile_sources = l_queue_new();
 	slave->to_list = l_hashmap_string_new();
+	slave->holes = l_queue_new();
 
 	if (!l_dbus_register_object(dbus_get_bus(),
 				    dpath,
 				    slave_ref(slave),
 				    (l_dbus_destroy_func_t) slave_unref,
 				    SLAVE_IFACE, slave,
+				    STATISTICS_IFACE, &slave->stats,
 				    L_DBUS_INTERFACE_PROPERTIES,
 				    slave,
 				    NULL)) {
@@ -413,8 +2275,7 @@ struct slave *slave_create(uint8_t id, const char *name, const char *address)
 
 	slave->path = dpath;
 
-	l_info("Slave(%p): (%s) hostname: (%s) port: (%d)",
-					slave, dpath, hostname, port);
+	l_info("Slave(%p): (%s) address: (%s)", slave, dpath, address);
 
 	/* FIXME: Identifier is a PTR_TO_INT. Missing hashmap */
 
@@ -423,11 +2284,11 @@ struct slave *slave_create(uint8_t id, const char *name, const char *address)
 
 void slave_destroy(struct slave *slave)
 {
-	l_info("slave_destroy(%p)", slave);
-
 	if (unlikely(!slave))
 		return;
 
+	trace(SLAVE_DESTROY, (uintptr_t) slave, 0, 0);
+
 	l_dbus_unregister_object(dbus_get_bus(), slave->path);
 	slave_unref(slave);
 }
@@ -440,7 +2301,313 @@ const char *slave_get_path(const struct slave *slave)
 	return slave->path;
 }
 
-int slave_start(const char *config_file)
+uint8_t slave_get_id(const struct slave *slave)
+{
+	return slave->id;
+}
+
+void slave_append_properties(const struct slave *slave,
+			     struct l_dbus_message_builder *builder)
+{
+	bool enable = (slave->ctx ? true : false);
+
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+
+	dbus_append_dict_entry_basic(builder, "Id", 'y', &slave->id);
+	dbus_append_dict_entry_basic(builder, "Name", 's', slave->name);
+	dbus_append_dict_entry_basic(builder, "Address", 's', slave->address);
+	dbus_append_dict_entry_basic(builder, "Enable", 'b', &enable);
+	dbus_append_dict_entry_basic(builder, "Profile", 's',
+				     slave->profile ?
+				     profile_get_name(slave->profile) : "");
+
+	l_dbus_message_builder_leave_array(builder);
+}
+
+void slave_enable(struct slave *slave)
+{
+	slave->enable = true;
+	connect_enqueue(slave);
+}
+
+void slave_disable(struct slave *slave)
+{
+	slave->enable = false;
+	slave_close(slave);
+
+	/* Not polled on purpose: last values are kept, but marked */
+	store_set_owner_quality(slave->id, STORE_QUALITY_STALE);
+}
+
+/*
+ * Suspends polling, keeping the connection: forwarded requests still
+ * go through. Both are a single flip of the slave scheduler group.
+ */
+void slave_pause(struct slave *slave)
+{
+	if (slave->paused)
+		return;
+
+	slave->paused = true;
+	sched_pause(slave);
+	store_set_owner_quality(slave->id, STORE_QUALITY_STALE);
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Paused");
+}
+
+void slave_resume(struct slave *slave)
+{
+	if (!slave->paused)
+		return;
+
+	slave->paused = false;
+	if (slave->ctx)
+		sched_resume(slave);
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Paused");
+}
+
+void slave_set_name(struct slave *slave, const char *name)
+{
+	if (strcmp(slave->name, name) == 0)
+		return;
+
+	l_free(slave->name);
+	slave->name = l_strdup(name);
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Name");
+}
+
+int slave_set_address(struct slave *slave, const char *address)
+{
+	struct endpoint endpoint;
+
+	if (transport_parse(address, &endpoint) < 0)
+		return -EINVAL;
+
+	if (strcmp(address, slave->address) == 0)
+		return 0;
+
+	l_free(slave->address);
+	slave->address = l_strdup(address);
+	slave->endpoint = endpoint;
+
+	/* Sources and their polling entries are kept across reconnection */
+	slave_close(slave);
+	if (slave->enable)
+		connect_enqueue(slave);
+
+	return 0;
+}
+
+struct source *slave_add_source(struct slave *slave, const char *name,
+				const char *type, uint16_t address,
+				uint16_t size, uint16_t interval,
+				uint8_t priority, uint8_t max_backoff)
+{
+	struct source *source;
+
+	/* Object path is derived from the address */
+	if (l_queue_find(slave->source_list, address_cmp,
+			 L_UINT_TO_PTR(address)))
+		return NULL;
+
+	source = source_create(slave->path, name, type,
+			       address, size, interval);
+	if (!source)
+		return NULL;
+
+	source_set_priority(source, priority);
+	source_set_max_backoff(source, max_backoff);
+	source_set_owner(source, slave->id);
+	l_queue_push_head(slave->source_list, source);
+
+	if (slave->ctx)
+		polling_start(source, slave);
+
+	return source;
+}
+
+/* Restored from storage: see hole_add() */
+void slave_add_hole(struct slave *slave, uint8_t function, uint16_t address,
+		    uint16_t count)
+{
+	if (function < MODBUS_FC_READ_COILS ||
+	    function > MODBUS_FC_READ_INPUT_REGISTERS || !count)
+		return;
+
+	if (hole_overlaps(slave, function, address,
+			  (uint32_t) address + count))
+		return;
+
+	hole_insert(slave, function, address, count);
+}
+
+static void profile_source_remove(void *data, void *user_data)
+{
+	struct slave *slave = user_data;
+	struct source *source = data;
+
+	l_queue_remove(slave->source_list, source);
+	polling_stop(slave, source);
+	source_destroy(source);
+}
+
+/*
+ * Replaces the sources instantiated from the previous profile, if any,
+ * by the ones of @name (NULL or empty: none). Sources added at runtime
+ * are kept: an address already in use is skipped.
+ */
+int slave_set_profile(struct slave *slave, const char *name)
+{
+	const struct profile_entry *entry;
+	struct profile *profile = NULL;
+	struct source *source;
+	unsigned int count;
+	unsigned int i;
+
+	if (name && *name) {
+		profile = profile_get(name);
+		if (!profile)
+			return -ENOENT;
+	}
+
+	if (profile == slave->profile) {
+		profile_unref(profile);
+		return 0;
+	}
+
+	l_queue_foreach(slave->profile_sources, profile_source_remove, slave);
+	l_queue_clear(slave->profile_sources, NULL);
+	profile_unref(slave->profile);
+	slave->profile = profile;
+
+	if (profile) {
+		entry = profile_get_entries(profile, &count);
+		for (i = 0; i < count; i++, entry++) {
+			source = slave_add_source(slave, entry->name,
+						  entry->type, entry->address,
+						  entry->size,
+						  entry->interval,
+						  entry->priority,
+						  entry->max_backoff);
+			if (source)
+				l_queue_push_tail(slave->profile_sources,
+						  source);
+		}
+
+		l_info("slave %s: profile %s, %u sources", slave->path, name,
+		       l_queue_length(slave->profile_sources));
+	}
+
+	l_dbus_property_changed(dbus_get_bus(), slave->path,
+				SLAVE_IFACE, "Profile");
+
+	return 0;
+}
+
+/*
+ * Sends a raw request PDU through the slave request queue, behind the
+ * polls already waiting. 'func' is called once with the response PDU
+ * (possibly an exception) or an error.
+ */
+int slave_forward(struct slave *slave, const uint8_t *pdu, uint8_t len,
+		  slave_forward_func_t func, void *user_data)
+{
+	struct poll *poll;
+
+	if (unlikely(!slave || !pdu || !len || !func))
+		return -EINVAL;
+
+	if (!slave->ctx || slave->disconnecting)
+		return -ENOTCONN;
+
+	if (slave->queue_len >= SLAVE_QUEUE_MAX)
+		return -EBUSY;
+
+	poll = forward_new();
+	poll->slave = slave;
+	memcpy(poll->pdu, pdu, len);
+	poll->pdu_len = len;
+	poll->func = func;
+	poll->user_data = user_data;
+	poll->deadline = l_time_now();
+
+	request_enqueue(slave, poll);
+	request_send(slave);
+
+	return 0;
+}
+
+/*
+ * Reads a source on behalf of a sample group: the request goes ahead
+ * of the periodic polls already waiting (behind earlier samples only),
+ * so that members on different slaves are read as close as possible
+ * to the group deadline. 'func' gets the response PDU as in
+ * slave_forward().
+ */
+int slave_sample(struct slave *slave, const struct source *source,
+		 slave_forward_func_t func, void *user_data)
+{
+	struct poll *poll;
+	uint16_t address;
+	uint16_t size;
+
+	if (unlikely(!slave || !source || !func))
+		return -EINVAL;
+
+	if (!slave->ctx || slave->disconnecting)
+		return -ENOTCONN;
+
+	if (slave->queue_len >= SLAVE_QUEUE_MAX)
+		return -EBUSY;
+
+	address = source_get_address(source);
+	size = source_get_size(source);
+
+	poll = forward_new();
+	poll->slave = slave;
+	poll->pdu_len = 5;
+	poll->pdu[0] = source_get_function(source);
+	poll->pdu[1] = address >> 8;
+	poll->pdu[2] = address & 0xff;
+	poll->pdu[3] = size >> 8;
+	poll->pdu[4] = size & 0xff;
+	poll->func = func;
+	poll->user_data = user_data;
+	poll->deadline = l_time_now();
+	poll->urgent = true;
+
+	request_push(slave, poll);
+	request_send(slave);
+
+	return 0;
+}
+
+struct source *slave_find_source_by_path(const struct slave *slave,
+					 const char *path)
+{
+	return l_queue_find(slave->source_list, path_cmp, path);
+}
+
+struct source *slave_find_source(const struct slave *slave, uint8_t function,
+				 uint16_t address, uint16_t quantity)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(slave->source_list); entry;
+	     entry = entry->next) {
+		if (source_covers(entry->data, function, address, quantity))
+			return entry->data;
+	}
+
+	return NULL;
+}
+
+int slave_start(const char *config_file, bool lazy_sources)
 {
 
 	l_info("Starting slave ...");
@@ -461,13 +2628,43 @@ int slave_start(const char *config_file)
 				       NULL, false))
 		l_error("dbus: unable to register %s", SLAVE_IFACE);
 
-	source_start();
+	connect_queue = l_queue_new();
+
+	source_start(lazy_sources);
 
 	return 0;
 }
 
+/* Preallocates forwarded/sample requests, up to FORWARD_POOL_MAX */
+void slave_reserve(unsigned int count)
+{
+	struct poll *poll;
+
+	while (forward_pool_len < count &&
+	       forward_pool_len < FORWARD_POOL_MAX) {
+		poll = l_new(struct poll, 1);
+		poll->pdu = l_malloc(UINT8_MAX);
+		forward_release(poll);
+	}
+}
+
 void slave_stop(void)
 {
+	struct poll *poll;
+
+	l_timeout_remove(connect_pacing);
+	connect_pacing = NULL;
+	l_queue_destroy(connect_queue, NULL);
+	connect_queue = NULL;
+
+	while ((poll = forward_pool)) {
+		forward_pool = poll->next;
+		l_free(poll->pdu);
+		l_free(poll);
+	}
+
+	forward_pool_len = 0;
+
 	source_stop();
 	l_dbus_unregister_interface(dbus_get_bus(),
 				    SLAVE_IFACE);
@@ -19,11 +19,40 @@
  *
  */
 
-int slave_start(const char *config_file);
+typedef void (*slave_forward_func_t) (int err, const uint8_t *pdu, int len,
+				      void *user_data);
+
+int slave_start(const char *config_file, bool lazy_sources);
 void slave_stop(void);
+void slave_reserve(unsigned int count);
 
 struct slave;
+struct source;
 struct slave *slave_create(uint8_t id, const char *name,
 			const char *address);
 void slave_destroy(struct slave *slave);
 const char *slave_get_path(const struct slave *slave);
+uint8_t slave_get_id(const struct slave *slave);
+void slave_enable(struct slave *slave);
+void slave_disable(struct slave *slave);
+void slave_pause(struct slave *slave);
+void slave_resume(struct slave *slave);
+void slave_set_name(struct slave *slave, const char *name);
+int slave_set_address(struct slave *slave, const char *address);
+int slave_set_profile(struct slave *slave, const char *name);
+struct source *slave_add_source(struct slave *slave, const char *name,
+				const char *type, uint16_t address,
+				uint16_t size, uint16_t interval,
+				uint8_t priority, uint8_t max_backoff);
+void slave_add_hole(struct slave *slave, uint8_t function, uint16_t address,
+		    uint16_t count);
+void slave_append_properties(const struct slave *slave,
+			     struct l_dbus_message_builder *builder);
+struct source *slave_find_source(const struct slave *slave, uint8_t function,
+				 uint16_t address, uint16_t quantity);
+struct source *slave_find_source_by_path(const struct slave *slave,
+					 const char *path);
+int slave_forward(struct slave *slave, const uint8_t *pdu, uint8_t len,
+		  slave_forward_func_t func, void *user_data);
+int slave_sample(struct slave *slave, const struct source *source,
+		 slave_forward_func_t func, void *user_data);
@@ -25,24 +25,45 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <ell/ell.h>
 
+#include <modbus.h>
+
 #include "dbus.h"
+#include "trace.h"
+#include "stream.h"
+#include "compute.h"
+#include "store.h"
 #include "source.h"
 
+/* Good values older than this many (backed off) intervals are stale */
+#define SOURCE_STALE_INTERVALS	3
+
+/* Export sources on D-Bus only when first referenced by a client */
+static bool lazy_register;
+
 struct source {
 	int refs;
+	bool registered;	/* Exported on D-Bus */
 	char *path;
 	char *name;
 	char *type;
 	uint16_t address;
 	uint16_t size;
 	uint16_t interval;
+	uint8_t priority;	/* Higher: stretched last when overloaded */
+	uint8_t max_backoff;	/* Unchanged values: up to n intervals */
+	uint8_t function;	/* Modbus read function code */
+	unsigned int id;	/* Value, timestamp and quality: see store.c */
+	struct l_queue *watchers;	/* Bus names subscribed to Value */
 };
 
 static void source_free(struct source *source)
 {
+	l_queue_destroy(source->watchers, l_free);
+	store_free(source->id);
 	l_free(source->name);
 	l_free(source->type);
 	l_free(source->path);
@@ -56,7 +77,7 @@ static struct source *source_ref(struct source *source)
 		return NULL;
 
 	__sync_fetch_and_add(&source->refs, 1);
-	l_info("source_ref(%p): %d", source, source->refs);
+	trace(SOURCE_REF, (uintptr_t) source, source->refs, 0);
 
 	return source;
 }
@@ -66,7 +87,7 @@ static void source_unref(struct source *source)
 	if (unlikely(!source))
 		return;
 
-	l_info("source_unref(%p): %d", source, source->refs - 1);
+	trace(SOURCE_UNREF, (uintptr_t) source, source->refs - 1, 0);
 	if (__sync_sub_and_fetch(&source->refs, 1))
 		return;
 
@@ -155,6 +176,92 @@ static bool property_get_interval(struct l_dbus *dbus,
 	return true;
 }
 
+static bool property_get_priority(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct source *source = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'y', &source->priority);
+
+	return true;
+}
+
+static bool property_get_max_backoff(struct l_dbus *dbus,
+				     struct l_dbus_message *msg,
+				     struct l_dbus_message_builder *builder,
+				     void *user_data)
+{
+	struct source *source = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'y',
+					    &source->max_backoff);
+
+	return true;
+}
+
+static bool property_get_value(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct source *source = user_data;
+	const uint8_t *value;
+	uint16_t len;
+	uint16_t i;
+
+	value = store_get_value(source->id, &len);
+
+	l_dbus_message_builder_enter_array(builder, "y");
+	for (i = 0; i < len; i++)
+		l_dbus_message_builder_append_basic(builder, 'y', &value[i]);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static bool property_get_quality(struct l_dbus *dbus,
+				 struct l_dbus_message *msg,
+				 struct l_dbus_message_builder *builder,
+				 void *user_data)
+{
+	struct source *source = user_data;
+	uint8_t quality = store_get_quality(source->id);
+
+	l_dbus_message_builder_append_basic(builder, 'y', &quality);
+
+	return true;
+}
+
+/* Wall clock of a monotonic store timestamp, us since the epoch */
+static uint64_t source_realtime(const struct source *source)
+{
+	uint64_t updated = store_get_timestamp(source->id);
+	struct timespec ts;
+
+	if (!updated)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 -
+		(l_time_now() - updated);
+}
+
+static bool property_get_timestamp(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct source *source = user_data;
+	uint64_t timestamp = source_realtime(source);
+
+	l_dbus_message_builder_append_basic(builder, 't', &timestamp);
+
+	return true;
+}
+
 static void setup_interface(struct l_dbus_interface *interface)
 {
 	/* Variable alias */
@@ -187,12 +294,89 @@ static void setup_interface(struct l_dbus_interface *interface)
 				       NULL))
 		l_error("Can't add 'PollingInterval' property");
 
+	/* Overloaded slave: lower priorities are polled less often first */
+	if (!l_dbus_interface_property(interface, "Priority", 0, "y",
+				       property_get_priority,
+				       NULL))
+		l_error("Can't add 'Priority' property");
+
+	/* Adaptive polling: 0 or 1 always polls at PollingInterval */
+	if (!l_dbus_interface_property(interface, "MaxBackoff", 0, "y",
+				       property_get_max_backoff,
+				       NULL))
+		l_error("Can't add 'MaxBackoff' property");
+
+	/*
+	 * Raw data of the last response. Changes are signalled only while
+	 * some client is subscribed (Manager1.Subscribe).
+	 */
+	if (!l_dbus_interface_property(interface, "Value", 0, "ay",
+				       property_get_value,
+				       NULL))
+		l_error("Can't add 'Value' property");
+
+	/*
+	 * See enum store_quality: 0x80 | code for Modbus exceptions.
+	 * Polled with Value, no change signal.
+	 */
+	if (!l_dbus_interface_property(interface, "Quality", 0, "y",
+				       property_get_quality,
+				       NULL))
+		l_error("Can't add 'Quality' property");
+
+	/* Last response, us since the epoch */
+	if (!l_dbus_interface_property(interface, "Timestamp", 0, "t",
+				       property_get_timestamp,
+				       NULL))
+		l_error("Can't add 'Timestamp' property");
+
 }
 
-int source_start(void)
+/* Type: "coil", "discrete", "input" or "holding" (a.k.a "register") */
+static uint8_t type_to_function(const char *type)
+{
+	if (!type)
+		return 0;
+
+	if (strcmp(type, "coil") == 0)
+		return MODBUS_FC_READ_COILS;
+
+	if (strcmp(type, "discrete") == 0)
+		return MODBUS_FC_READ_DISCRETE_INPUTS;
+
+	if (strcmp(type, "input") == 0)
+		return MODBUS_FC_READ_INPUT_REGISTERS;
+
+	if (strcmp(type, "holding") == 0 || strcmp(type, "register") == 0)
+		return MODBUS_FC_READ_HOLDING_REGISTERS;
+
+	return 0;
+}
+
+/* Known type, read by a single request: 1-2000 bits, 1-125 registers */
+bool source_is_valid(const char *type, uint16_t address, uint16_t size)
+{
+	uint8_t function = type_to_function(type);
+	uint16_t max;
+
+	if (!function || size == 0)
+		return false;
+
+	if (function == MODBUS_FC_READ_COILS ||
+	    function == MODBUS_FC_READ_DISCRETE_INPUTS)
+		max = MODBUS_MAX_READ_BITS;
+	else
+		max = MODBUS_MAX_READ_REGISTERS;
+
+	return (size <= max && (uint32_t) address + size <= UINT16_MAX + 1);
+}
+
+int source_start(bool lazy)
 {
 	l_info("Starting source ...");
 
+	lazy_register = lazy;
+
 	if (!l_dbus_register_interface(dbus_get_bus(),
 				       SOURCE_IFACE,
 				       setup_interface,
@@ -229,37 +413,70 @@ struct source *source_create(const char *prefix, const char *name,
 	source->size = size;
 	source->path = NULL;
 	source->interval = interval;
+	/* Computed sources: registers holding the result */
+	source->function = type_to_function(type) ? :
+			   MODBUS_FC_READ_HOLDING_REGISTERS;
+	source->id = store_alloc(source_get_data_len(source));
+	store_set_max_age(source->id, interval * SOURCE_STALE_INTERVALS);
+	source->watchers = l_queue_new();
+
+	source->registered = false;
 
 	/* TODO: Connect to peer */
 
+	source->path = dpath;
+
+	if (!lazy_register && !source_register(source)) {
+		store_free(source->id);
+		l_free(source->name);
+		l_free(source->type);
+		l_free(dpath);
+		l_free(source);
+		return NULL;
+	}
+
+	return source_ref(source);
+}
+
+bool source_register(struct source *source)
+{
+	if (source->registered)
+		return true;
+
 	if (!l_dbus_register_object(dbus_get_bus(),
-				    dpath,
+				    source->path,
 				    source_ref(source),
 				    (l_dbus_destroy_func_t) source_unref,
 				    SOURCE_IFACE, source,
 				    L_DBUS_INTERFACE_PROPERTIES,
 				    source,
 				    NULL)) {
-		l_error("Can not register: %s", dpath);
-		l_free(dpath);
-		return NULL;
+		l_error("Can not register: %s", source->path);
+		__sync_sub_and_fetch(&source->refs, 1);
+		return false;
 	}
 
-	l_info("New source: %s", dpath);
+	l_info("New source: %s", source->path);
 
-	source->path = dpath;
+	source->registered = true;
 
-	return source_ref(source);
+	return true;
 }
 
 void source_destroy(struct source *source)
 {
-	l_info("source_destroy(%p)", source);
-
 	if (unlikely(!source))
 		return;
 
-	l_dbus_unregister_object(dbus_get_bus(), source->path);
+	trace(SOURCE_DESTROY, (uintptr_t) source, 0, 0);
+
+	stream_source_removed(source);
+	compute_source_removed(source);
+
+	if (source->registered)
+		l_dbus_unregister_object(dbus_get_bus(), source->path);
+
+	source->registered = false;
 	source_unref(source);
 }
 
@@ -275,3 +492,181 @@ uint16_t source_get_interval(const struct source *source)
 {
 	return source->interval;
 }
+
+uint16_t source_get_address(const struct source *source)
+{
+	return source->address;
+}
+
+uint8_t source_get_priority(const struct source *source)
+{
+	return source->priority;
+}
+
+void source_set_priority(struct source *source, uint8_t priority)
+{
+	source->priority = priority;
+}
+
+uint8_t source_get_max_backoff(const struct source *source)
+{
+	return source->max_backoff;
+}
+
+void source_set_max_backoff(struct source *source, uint8_t max_backoff)
+{
+	source->max_backoff = max_backoff;
+
+	store_set_max_age(source->id, (uint32_t) source->interval *
+			  SOURCE_STALE_INTERVALS *
+			  (max_backoff > 1 ? max_backoff : 1));
+}
+
+/* Slave id: see store_set_owner_quality() */
+void source_set_owner(struct source *source, uint16_t owner)
+{
+	store_set_owner(source->id, owner);
+}
+
+void source_set_quality(struct source *source, uint8_t quality)
+{
+	store_set_quality(source->id, quality);
+}
+
+void source_append_properties(const struct source *source,
+			      struct l_dbus_message_builder *builder)
+{
+	uint8_t quality = store_get_quality(source->id);
+	uint64_t timestamp = source_realtime(source);
+
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+
+	dbus_append_dict_entry_basic(builder, "Name", 's', source->name);
+	dbus_append_dict_entry_basic(builder, "Type", 's', source->type);
+	dbus_append_dict_entry_basic(builder, "Address", 'q',
+				     &source->address);
+	dbus_append_dict_entry_basic(builder, "Size", 'q', &source->size);
+	dbus_append_dict_entry_basic(builder, "PollingInterval", 'q',
+				     &source->interval);
+	dbus_append_dict_entry_basic(builder, "Priority", 'y',
+				     &source->priority);
+	dbus_append_dict_entry_basic(builder, "MaxBackoff", 'y',
+				     &source->max_backoff);
+	dbus_append_dict_entry_basic(builder, "Quality", 'y', &quality);
+	dbus_append_dict_entry_basic(builder, "Timestamp", 't', &timestamp);
+
+	l_dbus_message_builder_leave_array(builder);
+}
+
+uint8_t source_get_function(const struct source *source)
+{
+	return source->function;
+}
+
+/* Expected response data length, in bytes */
+uint16_t source_get_data_len(const struct source *source)
+{
+	switch (source->function) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		return (source->size + 7) / 8;
+	default:
+		return source->size * 2;
+	}
+}
+
+/* Returns true if the value changed since the last update */
+bool source_update(struct source *source, const uint8_t *data, uint16_t len)
+{
+	if (!store_update(source->id, data, len))
+		return false;
+
+	/* Nobody listening: skip the marshalling entirely */
+	if (source->registered && !l_queue_isempty(source->watchers))
+		l_dbus_property_changed(dbus_get_bus(), source->path,
+					SOURCE_IFACE, "Value");
+
+	return true;
+}
+
+static bool name_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b) == 0;
+}
+
+/* Returns false if 'name' was already watching */
+bool source_watch(struct source *source, const char *name)
+{
+	if (l_queue_find(source->watchers, name_cmp, name))
+		return false;
+
+	l_queue_push_tail(source->watchers, l_strdup(name));
+
+	return true;
+}
+
+void source_unwatch(struct source *source, const char *name)
+{
+	l_free(l_queue_remove_if(source->watchers, name_cmp, name));
+}
+
+uint16_t source_get_size(const struct source *source)
+{
+	return source->size;
+}
+
+static bool source_is_bits(const struct source *source)
+{
+	return (source->function == MODBUS_FC_READ_COILS ||
+		source->function == MODBUS_FC_READ_DISCRETE_INPUTS);
+}
+
+/* Whether a read of 'quantity' items at 'address' falls in the source */
+bool source_covers(const struct source *source, uint8_t function,
+		   uint16_t address, uint16_t quantity)
+{
+	return (source->function == function &&
+		address >= source->address &&
+		(uint32_t) address + quantity <=
+		(uint32_t) source->address + source->size);
+}
+
+/*
+ * Copies part of the cached value, in response data layout: packed
+ * bits (LSB first) or big endian registers. Returns the data length,
+ * -ENODATA if never polled or -ESTALE if older than 'max_age' (us).
+ */
+int source_read(const struct source *source, uint16_t address,
+		uint16_t quantity, uint64_t max_age, uint8_t *buf)
+{
+	unsigned int offset = address - source->address;
+	const uint8_t *value;
+	uint16_t value_len;
+	unsigned int bit;
+	unsigned int i;
+	unsigned int len;
+
+	value = store_get_value(source->id, &value_len);
+	if (!value)
+		return -ENODATA;
+
+	if (max_age && l_time_now() - store_get_timestamp(source->id) > max_age)
+		return -ESTALE;
+
+	if (!source_is_bits(source)) {
+		len = quantity * 2;
+		memcpy(buf, value + offset * 2, len);
+		return len;
+	}
+
+	len = (quantity + 7) / 8;
+	memset(buf, 0, len);
+
+	for (i = 0; i < quantity; i++) {
+		bit = offset + i;
+		if (value[bit / 8] & (1 << (bit % 8)))
+			buf[i / 8] |= 1 << (i % 8);
+	}
+
+	return len;
+}
@@ -21,7 +21,7 @@
 
 struct source;
 
-int source_start(void);
+int source_start(bool lazy);
 void source_stop(void);
 
 struct source;
@@ -31,3 +31,24 @@ struct source *source_create(const char *prefix, const char *name,
 void source_destroy(struct source *source);
 const char *source_get_path(const struct source *source);
 uint16_t source_get_interval(const struct source *source);
+uint16_t source_get_address(const struct source *source);
+uint8_t source_get_priority(const struct source *source);
+void source_set_priority(struct source *source, uint8_t priority);
+uint8_t source_get_max_backoff(const struct source *source);
+void source_set_max_backoff(struct source *source, uint8_t max_backoff);
+void source_set_owner(struct source *source, uint16_t owner);
+void source_set_quality(struct source *source, uint8_t quality);
+uint16_t source_get_size(const struct source *source);
+bool source_is_valid(const char *type, uint16_t address, uint16_t size);
+bool source_register(struct source *source);
+void source_append_properties(const struct source *source,
+			      struct l_dbus_message_builder *builder);
+uint8_t source_get_function(const struct source *source);
+uint16_t source_get_data_len(const struct source *source);
+bool source_update(struct source *source, const uint8_t *data, uint16_t len);
+bool source_watch(struct source *source, const char *name);
+void source_unwatch(struct source *source, const char *name);
+bool source_covers(const struct source *source, uint8_t function,
+		   uint16_t address, uint16_t quantity);
+int source_read(const struct source *source, uint16_t address,
+		uint16_t quantity, uint64_t max_age, uint8_t *buf);
@@ -0,0 +1,258 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <ell/ell.h>
+
+#include "dbus.h"
+#include "stats.h"
+
+/* Daemon-wide totals, exported on the manager object */
+static struct stats total;
+
+static unsigned int bucket(uint64_t usec)
+{
+	unsigned int n;
+
+	usec /= STATS_BUCKET_BASE;
+	if (usec == 0)
+		return 0;
+
+	n = 63 - __builtin_clzll(usec);
+
+	return (n < STATS_BUCKETS ? n : STATS_BUCKETS - 1);
+}
+
+void stats_request(struct stats *stats, unsigned int bytes,
+		   uint64_t lateness)
+{
+	unsigned int n = bucket(lateness);
+
+	stats->requests++;
+	stats->bytes_out += bytes;
+	stats->lateness[n]++;
+
+	total.requests++;
+	total.bytes_out += bytes;
+	total.lateness[n]++;
+}
+
+void stats_response(struct stats *stats, unsigned int bytes, uint64_t rtt)
+{
+	unsigned int n = bucket(rtt);
+
+	stats->responses++;
+	stats->bytes_in += bytes;
+	stats->rtt[n]++;
+
+	total.responses++;
+	total.bytes_in += bytes;
+	total.rtt[n]++;
+}
+
+void stats_exception(struct stats *stats)
+{
+	stats->exceptions++;
+	total.exceptions++;
+}
+
+void stats_timeout(struct stats *stats)
+{
+	stats->timeouts++;
+	total.timeouts++;
+}
+
+void stats_error(struct stats *stats)
+{
+	stats->errors++;
+	total.errors++;
+}
+
+void stats_overrun(struct stats *stats)
+{
+	stats->overruns++;
+	total.overruns++;
+}
+
+struct stats *stats_global(void)
+{
+	return &total;
+}
+
+#define STATS_PROPERTY_U64(_field)				\
+static bool property_get_##_field(struct l_dbus *dbus,			\
+				  struct l_dbus_message *msg,		\
+				  struct l_dbus_message_builder *builder,\
+				  void *user_data)			\
+{									\
+	struct stats *stats = user_data;				\
+									\
+	l_dbus_message_builder_append_basic(builder, 't',		\
+					    &stats->_field);		\
+	return true;							\
+}
+
+STATS_PROPERTY_U64(requests)
+STATS_PROPERTY_U64(responses)
+STATS_PROPERTY_U64(timeouts)
+STATS_PROPERTY_U64(exceptions)
+STATS_PROPERTY_U64(errors)
+STATS_PROPERTY_U64(overruns)
+STATS_PROPERTY_U64(bytes_out)
+STATS_PROPERTY_U64(bytes_in)
+
+static void append_histogram(struct l_dbus_message_builder *builder,
+			     const uint32_t *buckets)
+{
+	int i;
+
+	l_dbus_message_builder_enter_array(builder, "u");
+	for (i = 0; i < STATS_BUCKETS; i++)
+		l_dbus_message_builder_append_basic(builder, 'u', &buckets[i]);
+	l_dbus_message_builder_leave_array(builder);
+}
+
+static bool property_get_rtt(struct l_dbus *dbus,
+			     struct l_dbus_message *msg,
+			     struct l_dbus_message_builder *builder,
+			     void *user_data)
+{
+	struct stats *stats = user_data;
+
+	append_histogram(builder, stats->rtt);
+
+	return true;
+}
+
+static bool property_get_lateness(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct stats *stats = user_data;
+
+	append_histogram(builder, stats->lateness);
+
+	return true;
+}
+
+static bool property_get_base(struct l_dbus *dbus,
+			      struct l_dbus_message *msg,
+			      struct l_dbus_message_builder *builder,
+			      void *user_data)
+{
+	uint32_t base = STATS_BUCKET_BASE;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &base);
+
+	return true;
+}
+
+static struct l_dbus_message *method_reset(struct l_dbus *dbus,
+					   struct l_dbus_message *msg,
+					   void *user_data)
+{
+	struct stats *stats = user_data;
+
+	memset(stats, 0, sizeof(*stats));
+
+	return l_dbus_message_new_method_return(msg);
+}
+
+static void setup_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "Reset", 0,
+				method_reset, "", "");
+
+	if (!l_dbus_interface_property(interface, "Requests", 0, "t",
+				       property_get_requests, NULL))
+		l_error("Can't add 'Requests' property");
+
+	if (!l_dbus_interface_property(interface, "Responses", 0, "t",
+				       property_get_responses, NULL))
+		l_error("Can't add 'Responses' property");
+
+	if (!l_dbus_interface_property(interface, "Timeouts", 0, "t",
+				       property_get_timeouts, NULL))
+		l_error("Can't add 'Timeouts' property");
+
+	/* Modbus exception responses */
+	if (!l_dbus_interface_property(interface, "Exceptions", 0, "t",
+				       property_get_exceptions, NULL))
+		l_error("Can't add 'Exceptions' property");
+
+	/* Send failures and malformed or unexpected responses */
+	if (!l_dbus_interface_property(interface, "Errors", 0, "t",
+				       property_get_errors, NULL))
+		l_error("Can't add 'Errors' property");
+
+	/* Polls skipped because the previous one was still pending */
+	if (!l_dbus_interface_property(interface, "Overruns", 0, "t",
+				       property_get_overruns, NULL))
+		l_error("Can't add 'Overruns' property");
+
+	if (!l_dbus_interface_property(interface, "BytesOut", 0, "t",
+				       property_get_bytes_out, NULL))
+		l_error("Can't add 'BytesOut' property");
+
+	if (!l_dbus_interface_property(interface, "BytesIn", 0, "t",
+				       property_get_bytes_in, NULL))
+		l_error("Can't add 'BytesIn' property");
+
+	/* Request round-trip time */
+	if (!l_dbus_interface_property(interface, "RttHistogram", 0, "au",
+				       property_get_rtt, NULL))
+		l_error("Can't add 'RttHistogram' property");
+
+	/* Request sent time minus scheduled poll time */
+	if (!l_dbus_interface_property(interface, "LatenessHistogram", 0,
+				       "au", property_get_lateness, NULL))
+		l_error("Can't add 'LatenessHistogram' property");
+
+	/* Upper bound (us) of the first histogram bucket is twice this */
+	if (!l_dbus_interface_property(interface, "HistogramBase", 0, "u",
+				       property_get_base, NULL))
+		l_error("Can't add 'HistogramBase' property");
+}
+
+int stats_start(void)
+{
+	if (!l_dbus_register_interface(dbus_get_bus(),
+				       STATISTICS_IFACE,
+				       setup_interface,
+				       NULL, false)) {
+		l_error("dbus: unable to register %s", STATISTICS_IFACE);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void stats_stop(void)
+{
+	l_dbus_unregister_interface(dbus_get_bus(), STATISTICS_IFACE);
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Histogram bucket 'n' counts samples in [base << n, base << (n + 1))
+ * microseconds. Bucket 0 also counts anything faster, and the last
+ * bucket anything slower (~4 s and above).
+ */
+#define STATS_BUCKETS		16
+#define STATS_BUCKET_BASE	128	/* us */
+
+/* Embedded in each slave: updated on every request, never allocated */
+struct stats {
+	uint64_t requests;
+	uint64_t responses;
+	uint64_t timeouts;
+	uint64_t exceptions;
+	uint64_t errors;
+	uint64_t overruns;	/* Poll skipped: previous still pending */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint32_t rtt[STATS_BUCKETS];
+	uint32_t lateness[STATS_BUCKETS];
+};
+
+int stats_start(void);
+void stats_stop(void);
+
+struct stats *stats_global(void);
+
+void stats_request(struct stats *stats, unsigned int bytes,
+		   uint64_t lateness);
+void stats_response(struct stats *stats, unsigned int bytes, uint64_t rtt);
+void stats_exception(struct stats *stats);
+void stats_timeout(struct stats *stats);
+void stats_error(struct stats *stats);
+void stats_overrun(struct stats *stats);
@@ -0,0 +1,761 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ell/ell.h>
+
+#include "watchdog.h"
+#include "rt.h"
+#include "storage.h"
+
+/*
+ * Slaves, their profile, sources and learned holes are kept in two
+ * files: a binary snapshot holding every live record, and an
+ * append-only journal holding the changes made since the snapshot was
+ * written. Both share the same fixed-size record layout, so loading is
+ * a single linear pass over a mmap'ed file. The journal is folded into
+ * a new snapshot when it grows past STORAGE_JOURNAL_MAX records, at
+ * startup and on shutdown. Changes are applied in memory right away;
+ * the journal is written and synced once per main loop iteration,
+ * through rt_work(). It is only emptied once a snapshot is on disk.
+ */
+
+#define STORAGE_MAGIC		0x53424d4b	/* "KMBS" */
+#define STORAGE_VERSION		1
+#define STORAGE_SNAPSHOT	"modbus.snapshot"
+#define STORAGE_JOURNAL		"modbus.journal"
+#define STORAGE_CORRUPT		"corrupt"	/* Suffix of files set aside */
+#define STORAGE_JOURNAL_MAX	4096
+#define STORAGE_BATCH_MIN	16	/* Records, grown as needed */
+
+#define SLAVE_KEY(id)		(0x01000000 | (id) << 16)
+#define SOURCE_KEY(id, addr)	(0x02000000 | (id) << 16 | (addr))
+#define PROFILE_KEY(id)		(0x03000000 | (id) << 16)
+#define HOLE_KEY(id, fn, addr)	(0x10000000 | (fn) << 24 | (id) << 16 | (addr))
+
+enum storage_op {
+	STORAGE_OP_ADD = 1,
+	STORAGE_OP_REMOVE,
+};
+
+enum storage_kind {
+	STORAGE_KIND_SLAVE = 1,
+	STORAGE_KIND_SOURCE,
+	STORAGE_KIND_PROFILE,
+	STORAGE_KIND_HOLE,
+};
+
+struct storage_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t count;		/* Snapshot only: number of records */
+} __attribute__ ((packed));
+
+struct storage_record {
+	uint8_t op;
+	uint8_t kind;
+	uint8_t slave_id;
+	uint8_t function;	/* Hole: read function code */
+	uint16_t address;	/* Source, hole: register address */
+	uint16_t size;		/* Source: size, hole: count */
+	uint16_t interval;	/* Source: polling interval (ms) */
+	uint8_t priority;	/* Source: see slave_add_source() */
+	uint8_t max_backoff;	/* Source: see slave_add_source() */
+	char name[STORAGE_PROFILE_MAX + 1];	/* Slave, source or profile */
+	char text[64];		/* Slave: host:port, Source: type */
+} __attribute__ ((packed));
+
+/* Records written by batch_write(): journal changes or a snapshot */
+struct storage_batch {
+	unsigned int count;
+	bool snapshot;
+	unsigned int folded;	/* Snapshot: journal records it replaces */
+	int err;
+	struct storage_record records[];
+};
+
+struct foreach_data {
+	void *func;
+	void *user_data;
+};
+
+static char *dir_path;
+static char *snapshot_path;
+static char *journal_path;
+static int journal_fd = -1;
+static unsigned int journal_count;
+static bool flush_pending;
+static bool compacting;
+static unsigned int compact_at = STORAGE_JOURNAL_MAX;
+static struct storage_batch *pending;	/* Journal records not written */
+static unsigned int pending_size;
+static struct l_hashmap *record_map;
+
+static uint32_t record_key(const struct storage_record *rec)
+{
+	if (rec->kind == STORAGE_KIND_SLAVE)
+		return SLAVE_KEY(rec->slave_id);
+
+	if (rec->kind == STORAGE_KIND_PROFILE)
+		return PROFILE_KEY(rec->slave_id);
+
+	if (rec->kind == STORAGE_KIND_HOLE)
+		return HOLE_KEY(rec->slave_id, rec->function, rec->address);
+
+	return SOURCE_KEY(rec->slave_id, rec->address);
+}
+
+static bool slave_sources_match(const void *key, void *value, void *user_data)
+{
+	struct storage_record *rec = value;
+	uint8_t slave_id = L_PTR_TO_UINT(user_data);
+
+	if (rec->kind == STORAGE_KIND_SLAVE || rec->slave_id != slave_id)
+		return false;
+
+	l_free(rec);
+
+	return true;
+}
+
+static void record_apply(const struct storage_record *rec)
+{
+	struct storage_record *copy;
+	uint32_t key = record_key(rec);
+
+	l_free(l_hashmap_remove(record_map, L_UINT_TO_PTR(key)));
+
+	if (rec->op == STORAGE_OP_REMOVE) {
+		/* Sources, profile and holes don't outlive their slave */
+		if (rec->kind == STORAGE_KIND_SLAVE)
+			l_hashmap_foreach_remove(record_map,
+						 slave_sources_match,
+						 L_UINT_TO_PTR(rec->slave_id));
+		return;
+	}
+
+	copy = l_memdup(rec, sizeof(*rec));
+	copy->op = STORAGE_OP_ADD;
+	copy->name[sizeof(copy->name) - 1] = '\0';
+	copy->text[sizeof(copy->text) - 1] = '\0';
+
+	l_hashmap_insert(record_map, L_UINT_TO_PTR(key), copy);
+}
+
+static bool header_is_valid(const struct storage_header *hdr)
+{
+	return (hdr->magic == STORAGE_MAGIC &&
+		hdr->version == STORAGE_VERSION &&
+		hdr->record_size == sizeof(struct storage_record));
+}
+
+/*
+ * Applies every complete record found in @path and returns how many
+ * were read. A record cut short by a crash is ignored: the journal is
+ * rewritten right after loading.
+ */
+static int file_replay(const char *path, bool snapshot)
+{
+	const struct storage_header *hdr;
+	const struct storage_record *rec;
+	struct stat st;
+	void *map;
+	size_t count;
+	size_t i;
+	int fd;
+	int err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (errno == ENOENT ? 0 : -errno);
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if ((size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	count = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+
+	if (!header_is_valid(hdr) || (snapshot && hdr->count != count)) {
+		l_error("storage: %s is corrupted or incompatible", path);
+		munmap(map, st.st_size);
+		return -EBADMSG;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	rec = (const struct storage_record *) (hdr + 1);
+	for (i = 0; i < count; i++, rec++)
+		record_apply(rec);
+
+	munmap(map, st.st_size);
+
+	return count;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	ssize_t written;
+
+	while (len) {
+		written = write(fd, ptr, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0)
+			return -errno;
+
+		ptr += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static void batch_add_record(const void *key, void *value, void *user_data)
+{
+	struct storage_batch *batch = user_data;
+
+	memcpy(&batch->records[batch->count++], value,
+	       sizeof(struct storage_record));
+}
+
+/* Copy of every live record: written without touching record_map */
+static struct storage_batch *snapshot_build(void)
+{
+	struct storage_batch *batch;
+	unsigned int size = l_hashmap_size(record_map);
+
+	batch = l_malloc(sizeof(*batch) +
+			 size * sizeof(struct storage_record));
+	batch->count = 0;
+	batch->snapshot = true;
+	batch->folded = journal_count;
+	batch->err = 0;
+
+	l_hashmap_foreach(record_map, batch_add_record, batch);
+
+	return batch;
+}
+
+/* A rename() survives a crash only once the directory is synced */
+static int dir_sync(void)
+{
+	int fd;
+	int err = 0;
+
+	fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fsync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	return err;
+}
+
+static int snapshot_write(const struct storage_batch *batch)
+{
+	struct storage_header hdr;
+	char *tmp_path;
+	int fd;
+	int err;
+
+	tmp_path = l_strdup_printf("%s.tmp", snapshot_path);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = STORAGE_MAGIC;
+	hdr.version = STORAGE_VERSION;
+	hdr.record_size = sizeof(struct storage_record);
+	hdr.count = batch->count;
+
+	err = write_all(fd, &hdr, sizeof(hdr));
+	if (err == 0)
+		err = write_all(fd, batch->records,
+				batch->count * sizeof(struct storage_record));
+
+	if (err == 0 && fdatasync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	if (err == 0 && rename(tmp_path, snapshot_path) < 0)
+		err = -errno;
+
+	if (err == 0)
+		err = dir_sync();
+
+	if (err < 0)
+		unlink(tmp_path);
+done:
+	l_free(tmp_path);
+
+	return err;
+}
+
+/*
+ * Runs through rt_work(): may be off the main loop, so it only uses
+ * the batch and the files, which nothing else writes meanwhile.
+ */
+static void batch_write(void *user_data)
+{
+	struct storage_batch *batch = user_data;
+	size_t len = batch->count * sizeof(struct storage_record);
+	int err;
+
+	if (!batch->snapshot) {
+		err = write_all(journal_fd, batch->records, len);
+		if (err == 0 && fdatasync(journal_fd) < 0)
+			err = -errno;
+
+		if (err < 0)
+			l_error("storage: journal write failed: %s",
+				strerror(-err));
+		return;
+	}
+
+	/* Journal left as is on failure: it still holds every change */
+	batch->err = snapshot_write(batch);
+	if (batch->err < 0)
+		return;
+
+	/* Only the header is left: the snapshot holds the rest */
+	if (ftruncate(journal_fd, sizeof(struct storage_header)) < 0)
+		l_error("storage: journal reset failed: %s", strerror(errno));
+}
+
+static int journal_reset(void)
+{
+	struct storage_header hdr;
+
+	if (journal_fd >= 0)
+		close(journal_fd);
+
+	journal_count = 0;
+	journal_fd = open(journal_path,
+			  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+			  0600);
+	if (journal_fd < 0)
+		return -errno;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = STORAGE_MAGIC;
+	hdr.version = STORAGE_VERSION;
+	hdr.record_size = sizeof(struct storage_record);
+
+	if (write(journal_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -EIO;
+
+	return 0;
+}
+
+static void compact_done(void *user_data)
+{
+	struct storage_batch *batch = user_data;
+
+	compacting = false;
+
+	/* Tried again once as many changes were journaled */
+	if (batch->err < 0) {
+		l_error("storage: snapshot write failed: %s",
+			strerror(-batch->err));
+		compact_at = journal_count + STORAGE_JOURNAL_MAX;
+		return;
+	}
+
+	/* Changes journaled since the snapshot was taken remain */
+	journal_count -= batch->folded;
+	compact_at = STORAGE_JOURNAL_MAX;
+}
+
+/* Pending changes go to the journal first: kept if the snapshot fails */
+static void journal_flush(void)
+{
+	struct storage_batch *batch = pending;
+
+	pending = NULL;
+
+	if (batch)
+		rt_work(batch_write, NULL, batch, l_free);
+}
+
+static void compact(void)
+{
+	journal_flush();
+
+	l_info("storage: compacting %u journal records", journal_count);
+
+	compacting = true;
+	rt_work(batch_write, compact_done, snapshot_build(), l_free);
+}
+
+static void flush_idle(void *user_data)
+{
+	WATCHDOG_SCOPE("storage flush");
+
+	flush_pending = false;
+
+	if (journal_fd < 0)
+		return;
+
+	if (journal_count >= compact_at && !compacting) {
+		compact();
+		return;
+	}
+
+	/* One write and sync for all changes queued during the iteration */
+	journal_flush();
+}
+
+static int journal_append(struct storage_record *rec)
+{
+	if (unlikely(journal_fd < 0))
+		return -EBADF;
+
+	if (!pending) {
+		pending_size = STORAGE_BATCH_MIN;
+		pending = l_malloc(sizeof(*pending) + pending_size *
+				   sizeof(struct storage_record));
+		pending->count = 0;
+		pending->snapshot = false;
+	} else if (pending->count == pending_size) {
+		pending_size *= 2;
+		pending = l_realloc(pending, sizeof(*pending) + pending_size *
+				    sizeof(struct storage_record));
+	}
+
+	memcpy(&pending->records[pending->count++], rec, sizeof(*rec));
+
+	record_apply(rec);
+	journal_count++;
+
+	if (!flush_pending)
+		flush_pending = l_idle_oneshot(flush_idle, NULL, NULL);
+
+	return 0;
+}
+
+int storage_slave_add(uint8_t id, const char *name, const char *address)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = STORAGE_OP_ADD;
+	rec.kind = STORAGE_KIND_SLAVE;
+	rec.slave_id = id;
+	l_strlcpy(rec.name, name, sizeof(rec.name));
+	l_strlcpy(rec.text, address, sizeof(rec.text));
+
+	return journal_append(&rec);
+}
+
+int storage_slave_remove(uint8_t id)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = STORAGE_OP_REMOVE;
+	rec.kind = STORAGE_KIND_SLAVE;
+	rec.slave_id = id;
+
+	return journal_append(&rec);
+}
+
+int storage_source_add(uint8_t slave_id, const char *name,
+		       const char *type, uint16_t address,
+		       uint16_t size, uint16_t interval, uint8_t priority,
+		       uint8_t max_backoff)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = STORAGE_OP_ADD;
+	rec.kind = STORAGE_KIND_SOURCE;
+	rec.slave_id = slave_id;
+	rec.address = address;
+	rec.size = size;
+	rec.interval = interval;
+	rec.priority = priority;
+	rec.max_backoff = max_backoff;
+	l_strlcpy(rec.name, name, sizeof(rec.name));
+	l_strlcpy(rec.text, type, sizeof(rec.text));
+
+	return journal_append(&rec);
+}
+
+int storage_source_remove(uint8_t slave_id, uint16_t address)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = STORAGE_OP_REMOVE;
+	rec.kind = STORAGE_KIND_SOURCE;
+	rec.slave_id = slave_id;
+	rec.address = address;
+
+	return journal_append(&rec);
+}
+
+int storage_profile_set(uint8_t slave_id, const char *profile)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = STORAGE_KIND_PROFILE;
+	rec.slave_id = slave_id;
+
+	if (profile) {
+		if (strlen(profile) > STORAGE_PROFILE_MAX)
+			return -ENAMETOOLONG;
+
+		rec.op = STORAGE_OP_ADD;
+		l_strlcpy(rec.name, profile, sizeof(rec.name));
+	} else {
+		rec.op = STORAGE_OP_REMOVE;
+	}
+
+	return journal_append(&rec);
+}
+
+int storage_hole_add(uint8_t slave_id, uint8_t function, uint16_t address,
+		     uint16_t count)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = STORAGE_OP_ADD;
+	rec.kind = STORAGE_KIND_HOLE;
+	rec.slave_id = slave_id;
+	rec.function = function;
+	rec.address = address;
+	rec.size = count;
+
+	return journal_append(&rec);
+}
+
+int storage_hole_remove(uint8_t slave_id, uint8_t function, uint16_t address)
+{
+	struct storage_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = STORAGE_OP_REMOVE;
+	rec.kind = STORAGE_KIND_HOLE;
+	rec.slave_id = slave_id;
+	rec.function = function;
+	rec.address = address;
+
+	return journal_append(&rec);
+}
+
+static void foreach_slave(const void *key, void *value, void *user_data)
+{
+	const struct storage_record *rec = value;
+	struct foreach_data *data = user_data;
+	storage_slave_func_t func = data->func;
+
+	if (rec->kind == STORAGE_KIND_SLAVE)
+		func(rec->slave_id, rec->name, rec->text, data->user_data);
+}
+
+static void foreach_source(const void *key, void *value, void *user_data)
+{
+	const struct storage_record *rec = value;
+	struct foreach_data *data = user_data;
+	storage_source_func_t func = data->func;
+
+	if (rec->kind == STORAGE_KIND_SOURCE)
+		func(rec->slave_id, rec->name, rec->text, rec->address,
+		     rec->size, rec->interval, rec->priority,
+		     rec->max_backoff, data->user_data);
+}
+
+static void foreach_profile(const void *key, void *value, void *user_data)
+{
+	const struct storage_record *rec = value;
+	struct foreach_data *data = user_data;
+	storage_profile_func_t func = data->func;
+
+	if (rec->kind == STORAGE_KIND_PROFILE)
+		func(rec->slave_id, rec->name, data->user_data);
+}
+
+static void foreach_hole(const void *key, void *value, void *user_data)
+{
+	const struct storage_record *rec = value;
+	struct foreach_data *data = user_data;
+	storage_hole_func_t func = data->func;
+
+	if (rec->kind == STORAGE_KIND_HOLE)
+		func(rec->slave_id, rec->function, rec->address, rec->size,
+		     data->user_data);
+}
+
+void storage_foreach_slave(storage_slave_func_t func, void *user_data)
+{
+	struct foreach_data data = { .func = func, .user_data = user_data };
+
+	l_hashmap_foreach(record_map, foreach_slave, &data);
+}
+
+void storage_foreach_source(storage_source_func_t func, void *user_data)
+{
+	struct foreach_data data = { .func = func, .user_data = user_data };
+
+	l_hashmap_foreach(record_map, foreach_source, &data);
+}
+
+void storage_foreach_profile(storage_profile_func_t func, void *user_data)
+{
+	struct foreach_data data = { .func = func, .user_data = user_data };
+
+	l_hashmap_foreach(record_map, foreach_profile, &data);
+}
+
+void storage_foreach_hole(storage_hole_func_t func, void *user_data)
+{
+	struct foreach_data data = { .func = func, .user_data = user_data };
+
+	l_hashmap_foreach(record_map, foreach_hole, &data);
+}
+
+/*
+ * Keeps a file that failed to load out of the way of the next
+ * compaction: the records it holds may still be recovered by hand.
+ */
+static void set_aside(const char *path)
+{
+	char *bad_path;
+
+	bad_path = l_strdup_printf("%s.%s", path, STORAGE_CORRUPT);
+
+	if (rename(path, bad_path) < 0)
+		l_error("storage: can't rename %s: %s", path, strerror(errno));
+	else
+		l_error("storage: %s moved to %s", path, bad_path);
+
+	l_free(bad_path);
+}
+
+int storage_open(const char *dir)
+{
+	struct storage_batch *snapshot;
+	int snapshot_count;
+	int journal_records;
+	int err;
+
+	l_info("Starting storage (%s) ...", dir);
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -errno;
+
+	dir_path = l_strdup(dir);
+	snapshot_path = l_strdup_printf("%s/%s", dir, STORAGE_SNAPSHOT);
+	journal_path = l_strdup_printf("%s/%s", dir, STORAGE_JOURNAL);
+	record_map = l_hashmap_new();
+
+	snapshot_count = file_replay(snapshot_path, true);
+	if (snapshot_count < 0)
+		set_aside(snapshot_path);
+
+	journal_records = file_replay(journal_path, false);
+	if (journal_records < 0)
+		set_aside(journal_path);
+
+	l_info("storage: %d snapshot records, %d journal records",
+	       snapshot_count, journal_records);
+
+	/* Start every session with an empty journal */
+	if (journal_records > 0) {
+		snapshot = snapshot_build();
+		err = snapshot_write(snapshot);
+		l_free(snapshot);
+
+		if (err < 0) {
+			l_error("storage: snapshot write failed: %s",
+				strerror(-err));
+			return err;
+		}
+
+		l_info("storage: compacted %d journal records",
+		       journal_records);
+	}
+
+	return journal_reset();
+}
+
+void storage_close(void)
+{
+	if (journal_fd >= 0 && journal_count)
+		compact();
+
+	if (journal_fd >= 0)
+		close(journal_fd);
+
+	journal_fd = -1;
+	journal_count = 0;
+	compacting = false;
+	compact_at = STORAGE_JOURNAL_MAX;
+
+	l_free(pending);
+	pending = NULL;
+
+	l_hashmap_destroy(record_map, l_free);
+	record_map = NULL;
+
+	l_free(dir_path);
+	l_free(snapshot_path);
+	l_free(journal_path);
+	dir_path = NULL;
+	snapshot_path = NULL;
+	journal_path = NULL;
+}
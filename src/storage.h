@@ -0,0 +1,55 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define STORAGE_PROFILE_MAX	63	/* Longest storable profile name */
+
+typedef void (*storage_slave_func_t) (uint8_t id, const char *name,
+				      const char *address, void *user_data);
+typedef void (*storage_source_func_t) (uint8_t slave_id, const char *name,
+				       const char *type, uint16_t address,
+				       uint16_t size, uint16_t interval,
+				       uint8_t priority, uint8_t max_backoff,
+				       void *user_data);
+typedef void (*storage_profile_func_t) (uint8_t slave_id, const char *profile,
+					void *user_data);
+typedef void (*storage_hole_func_t) (uint8_t slave_id, uint8_t function,
+				     uint16_t address, uint16_t count,
+				     void *user_data);
+
+int storage_open(const char *dir);
+void storage_close(void);
+
+void storage_foreach_slave(storage_slave_func_t func, void *user_data);
+void storage_foreach_source(storage_source_func_t func, void *user_data);
+void storage_foreach_profile(storage_profile_func_t func, void *user_data);
+void storage_foreach_hole(storage_hole_func_t func, void *user_data);
+
+int storage_slave_add(uint8_t id, const char *name, const char *address);
+int storage_slave_remove(uint8_t id);
+int storage_source_add(uint8_t slave_id, const char *name,
+		       const char *type, uint16_t address,
+		       uint16_t size, uint16_t interval, uint8_t priority,
+		       uint8_t max_backoff);
+int storage_source_remove(uint8_t slave_id, uint16_t address);
+int storage_profile_set(uint8_t slave_id, const char *profile);
+int storage_hole_add(uint8_t slave_id, uint8_t function, uint16_t address,
+		     uint16_t count);
+int storage_hole_remove(uint8_t slave_id, uint8_t function, uint16_t address);
@@ -0,0 +1,214 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <ell/ell.h>
+
+#include "watchdog.h"
+#include "store.h"
+
+/*
+ * Value store: last value, timestamp and quality of every source, as
+ * parallel arrays indexed by a dense source id (freed ids are reused).
+ * Passes over all the sources, such as marking those of a slave or
+ * sweeping stale values, only walk the small fixed size columns.
+ */
+
+#define STORE_SWEEP_MS		1000
+
+static uint64_t *timestamp;	/* us, monotonic: last response */
+static uint32_t *max_age;	/* ms, 0: never stale */
+static uint16_t *owner;		/* Slave id */
+static uint8_t *quality;
+static uint16_t *value_len;
+static uint8_t **value;		/* Raw response data */
+static unsigned int count;	/* Ids in use or freed */
+static unsigned int size;	/* Allocated */
+static unsigned int *free_ids;
+static unsigned int free_count;
+static struct l_timeout *sweep_to;
+
+static void store_grow(void)
+{
+	size = size ? size * 2 : 64;
+
+	timestamp = l_realloc(timestamp, size * sizeof(*timestamp));
+	max_age = l_realloc(max_age, size * sizeof(*max_age));
+	owner = l_realloc(owner, size * sizeof(*owner));
+	quality = l_realloc(quality, size * sizeof(*quality));
+	value_len = l_realloc(value_len, size * sizeof(*value_len));
+	value = l_realloc(value, size * sizeof(*value));
+	free_ids = l_realloc(free_ids, size * sizeof(*free_ids));
+}
+
+/* 'len': capacity of the value, fixed for the source */
+unsigned int store_alloc(uint16_t len)
+{
+	unsigned int id;
+
+	if (free_count) {
+		id = free_ids[--free_count];
+	} else {
+		if (count == size)
+			store_grow();
+
+		id = count++;
+	}
+
+	timestamp[id] = 0;
+	max_age[id] = 0;
+	owner[id] = STORE_OWNER_NONE;
+	quality[id] = STORE_QUALITY_NONE;
+	value_len[id] = 0;
+	value[id] = l_malloc(len);
+
+	return id;
+}
+
+void store_free(unsigned int id)
+{
+	l_free(value[id]);
+	value[id] = NULL;
+	owner[id] = STORE_OWNER_NONE;
+	quality[id] = STORE_QUALITY_NONE;
+	max_age[id] = 0;
+
+	free_ids[free_count++] = id;
+}
+
+void store_set_owner(unsigned int id, uint16_t id_owner)
+{
+	owner[id] = id_owner;
+}
+
+/* ms without a response before a good value turns stale, 0: never */
+void store_set_max_age(unsigned int id, uint32_t ms)
+{
+	max_age[id] = ms;
+}
+
+/* Returns true if the value changed since the last update */
+bool store_update(unsigned int id, const uint8_t *data, uint16_t len)
+{
+	timestamp[id] = l_time_now();
+	quality[id] = STORE_QUALITY_GOOD;
+
+	if (len == value_len[id] && memcmp(value[id], data, len) == 0)
+		return false;
+
+	memcpy(value[id], data, len);
+	value_len[id] = len;
+
+	return true;
+}
+
+void store_set_quality(unsigned int id, uint8_t q)
+{
+	quality[id] = q;
+}
+
+/* Sources never read keep STORE_QUALITY_NONE */
+void store_set_owner_quality(uint16_t id_owner, uint8_t q)
+{
+	unsigned int id;
+
+	for (id = 0; id < count; id++) {
+		if (owner[id] == id_owner && quality[id] != STORE_QUALITY_NONE)
+			quality[id] = q;
+	}
+}
+
+uint8_t store_get_quality(unsigned int id)
+{
+	return quality[id];
+}
+
+uint64_t store_get_timestamp(unsigned int id)
+{
+	return timestamp[id];
+}
+
+/* NULL if never read */
+const uint8_t *store_get_value(unsigned int id, uint16_t *len)
+{
+	*len = value_len[id];
+
+	return value_len[id] ? value[id] : NULL;
+}
+
+static void sweep_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	uint64_t now = l_time_now();
+	unsigned int id;
+	WATCHDOG_SCOPE("store sweep");
+
+	for (id = 0; id < count; id++) {
+		if (quality[id] == STORE_QUALITY_GOOD && max_age[id] &&
+		    now - timestamp[id] > (uint64_t) max_age[id] * 1000)
+			quality[id] = STORE_QUALITY_STALE;
+	}
+
+	l_timeout_modify_ms(timeout, STORE_SWEEP_MS);
+}
+
+int store_start(void)
+{
+	sweep_to = l_timeout_create_ms(STORE_SWEEP_MS, sweep_to_expired,
+				       NULL, NULL);
+
+	return 0;
+}
+
+void store_stop(void)
+{
+	unsigned int id;
+
+	l_timeout_remove(sweep_to);
+	sweep_to = NULL;
+
+	for (id = 0; id < count; id++)
+		l_free(value[id]);
+
+	l_free(timestamp);
+	l_free(max_age);
+	l_free(owner);
+	l_free(quality);
+	l_free(value_len);
+	l_free(value);
+	l_free(free_ids);
+	timestamp = NULL;
+	max_age = NULL;
+	owner = NULL;
+	quality = NULL;
+	value_len = NULL;
+	value = NULL;
+	free_ids = NULL;
+	count = 0;
+	size = 0;
+	free_count = 0;
+}
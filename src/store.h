@@ -0,0 +1,46 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define STORE_OWNER_NONE	UINT16_MAX
+
+/* Quality of the last value: exceptions carry the Modbus code */
+enum store_quality {
+	STORE_QUALITY_NONE = 0,		/* Never read */
+	STORE_QUALITY_GOOD,
+	STORE_QUALITY_STALE,		/* Not refreshed in time */
+	STORE_QUALITY_COMM_FAIL,	/* Timeout or connection lost */
+	STORE_QUALITY_EXCEPTION = 0x80,	/* | exception code */
+};
+
+int store_start(void);
+void store_stop(void);
+
+unsigned int store_alloc(uint16_t len);
+void store_free(unsigned int id);
+void store_set_owner(unsigned int id, uint16_t owner);
+void store_set_max_age(unsigned int id, uint32_t max_age);
+bool store_update(unsigned int id, const uint8_t *data, uint16_t len);
+void store_set_quality(unsigned int id, uint8_t quality);
+void store_set_owner_quality(uint16_t owner, uint8_t quality);
+uint8_t store_get_quality(unsigned int id);
+uint64_t store_get_timestamp(unsigned int id);
+const uint8_t *store_get_value(unsigned int id, uint16_t *len);
@@ -0,0 +1,638 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ell/ell.h>
+
+#include "watchdog.h"
+#include "stream.h"
+
+/*
+ * Streaming data plane: values of the subscribed sources are appended
+ * to a per-client batch as they change, and batches are sent once per
+ * main loop iteration, several per sendmmsg() call. Each client has a
+ * bounded queue of batches: when it doesn't keep up, the oldest batch
+ * is dropped and accounted, so a slow consumer never blocks polling.
+ * Sent and dropped batches go back to a free list, which
+ * stream_reserve() fills up front in real-time mode.
+ */
+
+#define STREAM_BATCH_SIZE	16384	/* bytes per SAMPLES packet */
+#define STREAM_QUEUE_MAX	64	/* batches per client */
+#define STREAM_SEND_MAX		16	/* batches per sendmmsg() */
+#define STREAM_MAX_CLIENTS	32
+#define STREAM_RECV_SIZE	8192
+#define STREAM_POOL_MAX		256	/* Free batches kept */
+
+struct batch {
+	struct batch *next;	/* Free list */
+	uint16_t count;
+	uint32_t len;		/* Including the header */
+	uint8_t data[STREAM_BATCH_SIZE];
+};
+
+struct client {
+	struct l_io *io;
+	struct l_queue *topics;
+	struct batch *current;	/* Being filled */
+	struct batch *queue[STREAM_QUEUE_MAX];
+	unsigned int head;
+	unsigned int len;
+	uint32_t dropped;	/* Samples, not reported yet */
+	bool writing;		/* Waiting for the socket to drain */
+	bool pending;		/* On the flush list */
+};
+
+/* Subscribed source */
+struct topic {
+	struct source *source;
+	uint32_t id;
+	struct l_queue *clients;
+};
+
+static char *stream_path;
+static struct l_io *stream_io;
+static stream_lookup_func_t source_lookup;
+static struct l_queue *client_list;
+static struct l_queue *flush_list;
+static bool flush_scheduled;
+static struct l_hashmap *topic_sources;	/* source -> topic */
+static struct l_hashmap *topic_ids;	/* id -> topic */
+static uint32_t topic_last_id;
+static struct batch *batch_pool;
+static unsigned int batch_pool_len;
+
+static struct batch *batch_new(void)
+{
+	struct batch *batch = batch_pool;
+
+	if (!batch)
+		return l_new(struct batch, 1);
+
+	batch_pool = batch->next;
+	batch_pool_len--;
+
+	batch->count = 0;
+
+	return batch;
+}
+
+static void batch_release(struct batch *batch)
+{
+	if (!batch)
+		return;
+
+	if (batch_pool_len >= STREAM_POOL_MAX) {
+		l_free(batch);
+		return;
+	}
+
+	batch->next = batch_pool;
+	batch_pool = batch;
+	batch_pool_len++;
+}
+
+static bool match_ptr(const void *a, const void *b)
+{
+	return a == b;
+}
+
+static struct topic *topic_get(struct source *source)
+{
+	struct topic *topic;
+
+	topic = l_hashmap_lookup(topic_sources, source);
+	if (topic)
+		return topic;
+
+	topic = l_new(struct topic, 1);
+	topic->source = source;
+	topic->clients = l_queue_new();
+
+	/* Zero means unknown path */
+	if (++topic_last_id == 0)
+		topic_last_id = 1;
+
+	topic->id = topic_last_id;
+
+	l_hashmap_insert(topic_sources, source, topic);
+	l_hashmap_insert(topic_ids, L_UINT_TO_PTR(topic->id), topic);
+
+	return topic;
+}
+
+static void topic_free(struct topic *topic)
+{
+	l_hashmap_remove(topic_sources, topic->source);
+	l_hashmap_remove(topic_ids, L_UINT_TO_PTR(topic->id));
+	l_queue_destroy(topic->clients, NULL);
+	l_free(topic);
+}
+
+static void topic_remove_client(struct topic *topic, struct client *client)
+{
+	l_queue_remove(topic->clients, client);
+
+	if (l_queue_isempty(topic->clients))
+		topic_free(topic);
+}
+
+static void io_destroy_idle(void *user_data)
+{
+	l_io_destroy(user_data);
+}
+
+static void client_free(struct client *client)
+{
+	struct topic *topic;
+
+	while ((topic = l_queue_pop_head(client->topics)))
+		topic_remove_client(topic, client);
+
+	l_queue_destroy(client->topics, NULL);
+
+	while (client->len) {
+		batch_release(client->queue[client->head]);
+		client->head = (client->head + 1) % STREAM_QUEUE_MAX;
+		client->len--;
+	}
+
+	batch_release(client->current);
+	l_free(client);
+}
+
+static void client_close(struct client *client)
+{
+	l_queue_remove(client_list, client);
+	l_queue_remove(flush_list, client);
+
+	/* May run from the io's own handler */
+	l_io_set_read_handler(client->io, NULL, NULL, NULL);
+	l_io_set_write_handler(client->io, NULL, NULL, NULL);
+	l_io_set_disconnect_handler(client->io, NULL, NULL, NULL);
+	l_idle_oneshot(io_destroy_idle, client->io, NULL);
+
+	client_free(client);
+}
+
+static void client_enqueue(struct client *client, struct batch *batch)
+{
+	struct batch *oldest;
+
+	/* Drop oldest: the freshest values are the most useful */
+	if (client->len == STREAM_QUEUE_MAX) {
+		oldest = client->queue[client->head];
+		client->dropped += oldest->count;
+		batch_release(oldest);
+		client->head = (client->head + 1) % STREAM_QUEUE_MAX;
+		client->len--;
+	}
+
+	client->queue[(client->head + client->len) % STREAM_QUEUE_MAX] = batch;
+	client->len++;
+}
+
+static bool client_write_cb(struct l_io *io, void *user_data);
+
+/* Returns false if the client was closed */
+static bool client_send(struct client *client)
+{
+	struct mmsghdr msgs[STREAM_SEND_MAX];
+	struct iovec iov[STREAM_SEND_MAX];
+	struct stream_hdr *hdr;
+	struct batch *batch;
+	unsigned int count;
+	unsigned int i;
+	int ret;
+
+	while (client->len) {
+		count = (client->len < STREAM_SEND_MAX ?
+			 client->len : STREAM_SEND_MAX);
+
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < count; i++) {
+			batch = client->queue[(client->head + i) %
+					      STREAM_QUEUE_MAX];
+			hdr = (struct stream_hdr *) batch->data;
+			hdr->type = STREAM_MSG_SAMPLES;
+			hdr->reserved = 0;
+			hdr->count = batch->count;
+			hdr->dropped = (i == 0 ? client->dropped : 0);
+
+			iov[i].iov_base = batch->data;
+			iov[i].iov_len = batch->len;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = sendmmsg(l_io_get_fd(client->io), msgs, count,
+			       MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+			client_close(client);
+			return false;
+		}
+
+		if (ret > 0)
+			client->dropped = 0;
+
+		for (i = 0; ret > 0 && i < (unsigned int) ret; i++) {
+			batch_release(client->queue[client->head]);
+			client->head = (client->head + 1) % STREAM_QUEUE_MAX;
+			client->len--;
+		}
+
+		/* Socket full: resume when it drains */
+		if (ret < (int) count)
+			break;
+	}
+
+	if (client->len && !client->writing) {
+		client->writing = true;
+		l_io_set_write_handler(client->io, client_write_cb,
+				       client, NULL);
+	}
+
+	return true;
+}
+
+static bool client_write_cb(struct l_io *io, void *user_data)
+{
+	struct client *client = user_data;
+
+	if (!client_send(client))
+		return false;
+
+	/* Keep the handler while batches are left */
+	client->writing = (client->len > 0);
+
+	return client->writing;
+}
+
+static void flush_idle(void *user_data)
+{
+	struct client *client;
+	WATCHDOG_SCOPE("stream flush");
+
+	flush_scheduled = false;
+
+	while ((client = l_queue_pop_head(flush_list))) {
+		client->pending = false;
+
+		if (client->current) {
+			client_enqueue(client, client->current);
+			client->current = NULL;
+		}
+
+		/* Already waiting for the socket */
+		if (client->writing)
+			continue;
+
+		client_send(client);
+	}
+}
+
+static void client_append(struct client *client, uint32_t id,
+			  uint64_t timestamp, const uint8_t *value,
+			  uint16_t len)
+{
+	struct stream_sample sample;
+	size_t size = sizeof(sample) + len;
+	struct batch *batch = client->current;
+
+	if (batch && batch->len + size > STREAM_BATCH_SIZE) {
+		client_enqueue(client, batch);
+		batch = NULL;
+	}
+
+	if (!batch) {
+		batch = batch_new();
+		batch->len = sizeof(struct stream_hdr);
+		client->current = batch;
+	}
+
+	sample.id = id;
+	sample.timestamp = timestamp;
+	sample.len = len;
+
+	memcpy(batch->data + batch->len, &sample, sizeof(sample));
+	memcpy(batch->data + batch->len + sizeof(sample), value, len);
+	batch->len += size;
+	batch->count++;
+
+	if (!client->pending) {
+		client->pending = true;
+		l_queue_push_tail(flush_list, client);
+	}
+
+	if (!flush_scheduled)
+		flush_scheduled = l_idle_oneshot(flush_idle, NULL, NULL);
+}
+
+void stream_publish(struct source *source, const uint8_t *value,
+		    uint16_t len)
+{
+	const struct l_queue_entry *entry;
+	struct topic *topic;
+	struct timespec ts;
+	uint64_t now;
+
+	if (!topic_sources)
+		return;
+
+	topic = l_hashmap_lookup(topic_sources, source);
+	if (!topic)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	for (entry = l_queue_get_entries(topic->clients); entry;
+	     entry = entry->next)
+		client_append(entry->data, topic->id, now, value, len);
+}
+
+/* Subscriptions end silently: the source is gone */
+void stream_source_removed(struct source *source)
+{
+	const struct l_queue_entry *entry;
+	struct client *client;
+	struct topic *topic;
+
+	if (!topic_sources)
+		return;
+
+	topic = l_hashmap_lookup(topic_sources, source);
+	if (!topic)
+		return;
+
+	for (entry = l_queue_get_entries(topic->clients); entry;
+	     entry = entry->next) {
+		client = entry->data;
+		l_queue_remove(client->topics, topic);
+	}
+
+	topic_free(topic);
+}
+
+static void client_subscribe(struct client *client, const uint8_t *buf,
+			     size_t len, uint16_t count)
+{
+	struct stream_hdr *hdr;
+	struct source *source;
+	struct topic *topic;
+	const char *path = (const char *) buf;
+	const char *end = path + len;
+	uint8_t *rsp;
+	uint32_t id;
+	size_t rsp_len = sizeof(*hdr) + count * sizeof(uint32_t);
+	size_t plen;
+	unsigned int i;
+
+	rsp = l_malloc(rsp_len);
+	hdr = (struct stream_hdr *) rsp;
+	hdr->type = STREAM_MSG_SUBSCRIBED;
+	hdr->reserved = 0;
+	hdr->count = count;
+	hdr->dropped = 0;
+
+	for (i = 0; i < count; i++) {
+		id = 0;
+		plen = (path < end ? strnlen(path, end - path) : 0);
+
+		/* Missing or unterminated path */
+		if (path >= end || path + plen == end)
+			source = NULL;
+		else
+			source = source_lookup(path);
+
+		if (source) {
+			topic = topic_get(source);
+			if (!l_queue_find(topic->clients, match_ptr, client)) {
+				l_queue_push_tail(topic->clients, client);
+				l_queue_push_tail(client->topics, topic);
+			}
+
+			id = topic->id;
+		}
+
+		memcpy(rsp + sizeof(*hdr) + i * sizeof(id), &id, sizeof(id));
+		path += plen + 1;
+	}
+
+	if (send(l_io_get_fd(client->io), rsp, rsp_len,
+		 MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		l_error("stream: %s", strerror(errno));
+
+	l_free(rsp);
+}
+
+static void client_unsubscribe(struct client *client, const uint8_t *buf,
+			       size_t len, uint16_t count)
+{
+	struct topic *topic;
+	uint32_t id;
+	unsigned int i;
+
+	for (i = 0; i < count && (i + 1) * sizeof(id) <= len; i++) {
+		memcpy(&id, buf + i * sizeof(id), sizeof(id));
+
+		topic = l_hashmap_lookup(topic_ids, L_UINT_TO_PTR(id));
+		if (!topic || !l_queue_remove(client->topics, topic))
+			continue;
+
+		topic_remove_client(topic, client);
+	}
+}
+
+static bool client_read_cb(struct l_io *io, void *user_data)
+{
+	struct client *client = user_data;
+	uint8_t buf[STREAM_RECV_SIZE];
+	struct stream_hdr hdr;
+	ssize_t len;
+	WATCHDOG_SCOPE("stream");
+
+	len = recv(l_io_get_fd(io), buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+
+	if (len < (ssize_t) sizeof(hdr)) {
+		client_close(client);
+		return true;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	switch (hdr.type) {
+	case STREAM_MSG_SUBSCRIBE:
+		client_subscribe(client, buf + sizeof(hdr),
+				 len - sizeof(hdr), hdr.count);
+		break;
+	case STREAM_MSG_UNSUBSCRIBE:
+		client_unsubscribe(client, buf + sizeof(hdr),
+				   len - sizeof(hdr), hdr.count);
+		break;
+	default:
+		client_close(client);
+		break;
+	}
+
+	return true;
+}
+
+static void client_disconnect_cb(struct l_io *io, void *user_data)
+{
+	client_close(user_data);
+}
+
+static bool accept_cb(struct l_io *io, void *user_data)
+{
+	struct client *client;
+	int fd;
+
+	fd = accept4(l_io_get_fd(io), NULL, NULL,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return true;
+
+	if (l_queue_length(client_list) >= STREAM_MAX_CLIENTS) {
+		close(fd);
+		return true;
+	}
+
+	client = l_new(struct client, 1);
+	client->topics = l_queue_new();
+	client->io = l_io_new(fd);
+	l_io_set_close_on_destroy(client->io, true);
+	l_io_set_read_handler(client->io, client_read_cb, client, NULL);
+	l_io_set_disconnect_handler(client->io, client_disconnect_cb,
+				    client, NULL);
+
+	l_queue_push_tail(client_list, client);
+
+	return true;
+}
+
+int stream_start(const char *path, stream_lookup_func_t lookup)
+{
+	struct sockaddr_un addr;
+	int fd;
+	int err;
+
+	l_info("Starting stream socket %s ...", path);
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Left behind by a previous instance */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, STREAM_MAX_CLIENTS) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	stream_path = l_strdup(path);
+	source_lookup = lookup;
+	client_list = l_queue_new();
+	flush_list = l_queue_new();
+	topic_sources = l_hashmap_new();
+	topic_ids = l_hashmap_new();
+
+	stream_io = l_io_new(fd);
+	l_io_set_close_on_destroy(stream_io, true);
+	l_io_set_read_handler(stream_io, accept_cb, NULL, NULL);
+
+	return 0;
+}
+
+/* Preallocates batches, up to STREAM_POOL_MAX */
+void stream_reserve(unsigned int count)
+{
+	/* Not streaming */
+	if (!stream_io)
+		return;
+
+	while (batch_pool_len < count && batch_pool_len < STREAM_POOL_MAX)
+		batch_release(l_new(struct batch, 1));
+}
+
+void stream_stop(void)
+{
+	struct client *client;
+	struct batch *batch;
+
+	if (!stream_io)
+		return;
+
+	l_io_destroy(stream_io);
+	stream_io = NULL;
+
+	while ((client = l_queue_pop_head(client_list))) {
+		l_io_destroy(client->io);
+		client_free(client);
+	}
+
+	l_queue_destroy(client_list, NULL);
+	l_queue_destroy(flush_list, NULL);
+	client_list = NULL;
+	flush_list = NULL;
+
+	l_hashmap_destroy(topic_sources, NULL);
+	l_hashmap_destroy(topic_ids, NULL);
+	topic_sources = NULL;
+	topic_ids = NULL;
+
+	while ((batch = batch_pool)) {
+		batch_pool = batch->next;
+		l_free(batch);
+	}
+
+	batch_pool_len = 0;
+
+	unlink(stream_path);
+	l_free(stream_path);
+	stream_path = NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Streaming protocol, over a SOCK_SEQPACKET unix socket: one message
+ * per packet, integers in host byte order.
+ *
+ * Client -> modbusd
+ *   SUBSCRIBE:   header, then 'count' NUL terminated source paths
+ *   UNSUBSCRIBE: header, then 'count' uint32_t ids
+ *
+ * modbusd -> client
+ *   SUBSCRIBED:  header, then 'count' uint32_t ids in request order
+ *                (0: unknown path)
+ *   SAMPLES:     header, then 'count' samples. 'dropped' counts the
+ *                samples discarded since the previous batch because
+ *                the client didn't keep up.
+ */
+#define STREAM_MSG_SUBSCRIBE		1
+#define STREAM_MSG_SUBSCRIBED		2
+#define STREAM_MSG_UNSUBSCRIBE		3
+#define STREAM_MSG_SAMPLES		4
+
+struct stream_hdr {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t count;
+	uint32_t dropped;	/* SAMPLES only */
+} __attribute__ ((packed));
+
+struct stream_sample {
+	uint32_t id;
+	uint64_t timestamp;	/* us, CLOCK_MONOTONIC */
+	uint16_t len;		/* Raw value bytes following */
+} __attribute__ ((packed));
+
+struct source;
+
+typedef struct source *(*stream_lookup_func_t) (const char *path);
+
+int stream_start(const char *path, stream_lookup_func_t lookup);
+void stream_stop(void);
+void stream_reserve(unsigned int count);
+
+void stream_publish(struct source *source, const uint8_t *value,
+		    uint16_t len);
+void stream_source_removed(struct source *source);
@@ -0,0 +1,304 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <ell/ell.h>
+
+#include "dbus.h"
+#include "trace.h"
+
+/*
+ * Each thread writes to its own ring, allocated on its first record:
+ * the writer is the only one moving 'head', so no locking is needed.
+ * Dumps copy every ring; records overwritten while copying may be torn.
+ */
+#define TRACE_RING_SIZE		4096	/* records, power of two */
+
+/* Written in the storage directory only: callers can't pick the path */
+#define TRACE_DUMP_FILE		"trace.dump"
+
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	uint64_t head;		/* Total records written */
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+#define TRACE_NAME(id, name, fmt)	name,
+
+static const char *trace_names[] = {
+	TRACE_POINTS(TRACE_NAME)
+};
+
+uint32_t trace_mask;
+
+static struct trace_ring *ring_list;
+static char *dump_path;
+static __thread struct trace_ring *ring;
+
+static struct trace_ring *ring_new(void)
+{
+	struct trace_ring *new;
+
+	new = l_new(struct trace_ring, 1);
+	new->tid = syscall(SYS_gettid);
+	new->head = 0;
+
+	/* Lock-free push: rings are only released at trace_stop() */
+	new->next = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&ring_list, &new->next, new,
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE))
+		;
+
+	return new;
+}
+
+void trace_emit(uint32_t id, uint64_t a, uint64_t b, uint64_t c)
+{
+	struct trace_record *rec;
+	struct timespec ts;
+
+	if (unlikely(!ring))
+		ring = ring_new();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+	rec->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->id = id;
+	rec->tid = ring->tid;
+	rec->arg[0] = a;
+	rec->arg[1] = b;
+	rec->arg[2] = c;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_dump(const char *path)
+{
+	struct trace_header hdr;
+	struct trace_ring *r;
+	uint64_t head;
+	uint64_t first;
+	uint64_t i;
+	FILE *fp;
+	int err = 0;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		  0600);
+	if (fd < 0)
+		return -errno;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r;
+	     r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		hdr.count += (head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE);
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r;
+	     r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = (head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0);
+
+		for (i = first; i < head && hdr.count; i++, hdr.count--)
+			fwrite(&r->records[i & (TRACE_RING_SIZE - 1)],
+			       sizeof(struct trace_record), 1, fp);
+	}
+
+	if (fflush(fp) != 0 || ferror(fp))
+		err = -EIO;
+
+	fclose(fp);
+
+	return err;
+}
+
+static int trace_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(trace_names); i++) {
+		if (strcmp(trace_names[i], name) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+static struct l_dbus_message *method_dump(struct l_dbus *dbus,
+					  struct l_dbus_message *msg,
+					  void *user_data)
+{
+	struct l_dbus_message *reply;
+	int err;
+
+	err = trace_dump(dump_path);
+	if (err < 0)
+		return dbus_error_errno(msg, "Dump", -err);
+
+	reply = l_dbus_message_new_method_return(msg);
+	l_dbus_message_set_arguments(reply, "s", dump_path);
+
+	return reply;
+}
+
+static bool property_get_tracepoints(struct l_dbus *dbus,
+				     struct l_dbus_message *msg,
+				     struct l_dbus_message_builder *builder,
+				     void *user_data)
+{
+	unsigned int i;
+
+	l_dbus_message_builder_enter_array(builder, "s");
+	for (i = 0; i < L_ARRAY_SIZE(trace_names); i++)
+		l_dbus_message_builder_append_basic(builder, 's',
+						    trace_names[i]);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static bool property_get_enabled(struct l_dbus *dbus,
+				 struct l_dbus_message *msg,
+				 struct l_dbus_message_builder *builder,
+				 void *user_data)
+{
+	unsigned int i;
+
+	l_dbus_message_builder_enter_array(builder, "s");
+	for (i = 0; i < L_ARRAY_SIZE(trace_names); i++) {
+		if (trace_mask & (1U << i))
+			l_dbus_message_builder_append_basic(builder, 's',
+							    trace_names[i]);
+	}
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static struct l_dbus_message *property_set_enabled(struct l_dbus *dbus,
+					 struct l_dbus_message *msg,
+					 struct l_dbus_message_iter *new_value,
+					 l_dbus_property_complete_cb_t complete,
+					 void *user_data)
+{
+	struct l_dbus_message_iter iter;
+	const char *name;
+	uint32_t mask = 0;
+	int id;
+
+	if (!l_dbus_message_iter_get_variant(new_value, "as", &iter))
+		return dbus_error_invalid_args(msg);
+
+	while (l_dbus_message_iter_next_entry(&iter, &name)) {
+		id = trace_lookup(name);
+		if (id < 0)
+			return dbus_error_invalid_args(msg);
+
+		mask |= 1U << id;
+	}
+
+	trace_mask = mask;
+
+	complete(dbus, msg, NULL);
+
+	return NULL;
+}
+
+static void setup_interface(struct l_dbus_interface *interface)
+{
+	/* Write all trace rings to a file: see tools/modbus-trace */
+	l_dbus_interface_method(interface, "Dump", 0,
+				method_dump, "s", "", "path");
+
+	/* Available tracepoints */
+	if (!l_dbus_interface_property(interface, "Tracepoints", 0, "as",
+				       property_get_tracepoints,
+				       NULL))
+		l_error("Can't add 'Tracepoints' property");
+
+	/* Tracepoints being recorded: empty disables tracing */
+	if (!l_dbus_interface_property(interface, "Enabled", 0, "as",
+				       property_get_enabled,
+				       property_set_enabled))
+		l_error("Can't add 'Enabled' property");
+}
+
+int trace_start(const char *dir)
+{
+	dump_path = l_strdup_printf("%s/%s", dir, TRACE_DUMP_FILE);
+
+	if (!l_dbus_register_interface(dbus_get_bus(),
+				       TRACE_IFACE,
+				       setup_interface,
+				       NULL, false)) {
+		l_error("dbus: unable to register %s", TRACE_IFACE);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void trace_stop(void)
+{
+	struct trace_ring *r;
+
+	trace_mask = 0;
+
+	l_dbus_unregister_interface(dbus_get_bus(), TRACE_IFACE);
+
+	l_free(dump_path);
+	dump_path = NULL;
+
+	while ((r = ring_list)) {
+		ring_list = r->next;
+		l_free(r);
+	}
+
+	ring = NULL;
+}
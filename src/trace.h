@@ -0,0 +1,99 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Tracepoints: name and how to print their three arguments. Shared by
+ * modbusd and tools/modbus-trace, which decodes dump files.
+ */
+#define TRACE_FMT_SLAVE		"slave=0x%" PRIx64
+#define TRACE_FMT_SOURCE	"source=0x%" PRIx64
+#define TRACE_FMT_ADDRESS	" address=0x%04" PRIx64
+#define TRACE_FMT_REFS		" refs=%" PRIu64
+
+#define TRACE_POINTS(X)							\
+	X(SLAVE_REF, "slave_ref",					\
+	  TRACE_FMT_SLAVE TRACE_FMT_REFS)				\
+	X(SLAVE_UNREF, "slave_unref",					\
+	  TRACE_FMT_SLAVE TRACE_FMT_REFS)				\
+	X(SOURCE_REF, "source_ref",					\
+	  TRACE_FMT_SOURCE TRACE_FMT_REFS)				\
+	X(SOURCE_UNREF, "source_unref",					\
+	  TRACE_FMT_SOURCE TRACE_FMT_REFS)				\
+	X(POLL, "poll",							\
+	  TRACE_FMT_SLAVE TRACE_FMT_ADDRESS " deadline=%" PRIu64)	\
+	X(REQUEST, "request",						\
+	  TRACE_FMT_SLAVE TRACE_FMT_ADDRESS " bytes=%" PRIu64)		\
+	X(RESPONSE, "response",						\
+	  TRACE_FMT_SLAVE TRACE_FMT_ADDRESS " rtt=%" PRIu64)		\
+	X(EXCEPTION, "exception",					\
+	  TRACE_FMT_SLAVE TRACE_FMT_ADDRESS " code=%" PRIu64)		\
+	X(TIMEOUT, "timeout",						\
+	  TRACE_FMT_SLAVE TRACE_FMT_ADDRESS)				\
+	X(CONNECT, "connect",						\
+	  TRACE_FMT_SLAVE " err=%" PRId64)				\
+	X(POLL_START, "poll_start",					\
+	  TRACE_FMT_SLAVE " " TRACE_FMT_SOURCE " interval=%" PRIu64)	\
+	X(SLAVE_DESTROY, "slave_destroy",				\
+	  TRACE_FMT_SLAVE)						\
+	X(SLAVE_FREE, "slave_free",					\
+	  TRACE_FMT_SLAVE)						\
+	X(SOURCE_DESTROY, "source_destroy",				\
+	  TRACE_FMT_SOURCE)
+
+#define TRACE_ENUM(id, name, fmt)	TRACE_##id,
+
+enum trace_point {
+	TRACE_POINTS(TRACE_ENUM)
+	TRACE_MAX
+};
+
+#define TRACE_MAGIC		0x52544d4b	/* "KMTR" */
+#define TRACE_VERSION		1
+
+/* Dump file: header followed by 'count' records */
+struct trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t count;
+} __attribute__ ((packed));
+
+struct trace_record {
+	uint64_t timestamp;	/* ns, CLOCK_MONOTONIC */
+	uint32_t id;
+	uint32_t tid;
+	uint64_t arg[3];
+};
+
+/* Enabled tracepoints: tested inline, no call when disabled */
+extern uint32_t trace_mask;
+
+#define trace(_id, _a, _b, _c)						\
+do {									\
+	if (unlikely(trace_mask & (1U << TRACE_##_id)))			\
+		trace_emit(TRACE_##_id, (uint64_t) (_a),		\
+			   (uint64_t) (_b), (uint64_t) (_c));		\
+} while (0)
+
+void trace_emit(uint32_t id, uint64_t a, uint64_t b, uint64_t c);
+
+int trace_start(const char *dir);
+void trace_stop(void);
@@ -0,0 +1,495 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <ell/ell.h>
+#include <modbus.h>
+
+#include "transport.h"
+
+/*
+ * Framing of the slave connection. MBAP requests (TCP, UDP) are framed
+ * here, each with the next transaction id; libmodbus frames RTU
+ * requests (unit id + CRC): RTU over TCP is an RTU context on top of
+ * the connected socket. Responses are read here without blocking:
+ * streams and serial lines are buffered until a frame is complete, and
+ * UDP responses are read a datagram at a time. MBAP responses to
+ * anything but the last request are dropped; RTU frames are sized from
+ * their function code and checked against their CRC.
+ */
+
+#define MODBUS_PORT		502
+#define RTU_BAUD		19200	/* Modbus serial line defaults */
+#define RTU_PARITY		'E'
+#define RTU_CRC_LENGTH		2
+#define MBAP_HEADER_LENGTH	7
+
+static const struct {
+	const char *prefix;
+	enum transport_type type;
+} schemes[] = {
+	{ "tcp://",	TRANSPORT_TCP },
+	{ "rtu+tcp://",	TRANSPORT_RTU_TCP },
+	{ "udp://",	TRANSPORT_UDP },
+	{ "rtu://",	TRANSPORT_RTU },
+};
+
+/* "[data bits][parity][stop bits]", as in 8E1 */
+static int parse_framing(const char *str, struct endpoint *ep)
+{
+	if (strlen(str) != 3 ||
+	    (str[0] != '7' && str[0] != '8') ||
+	    (str[1] != 'N' && str[1] != 'E' && str[1] != 'O') ||
+	    (str[2] != '1' && str[2] != '2'))
+		return -EINVAL;
+
+	ep->data_bit = str[0] - '0';
+	ep->parity = str[1];
+	ep->stop_bit = str[2] - '0';
+
+	return 0;
+}
+
+static int parse_serial(const char *str, struct endpoint *ep)
+{
+	char framing[8] = "";
+	int n;
+
+	ep->port = RTU_BAUD;
+	ep->parity = RTU_PARITY;
+	ep->data_bit = 8;
+	ep->stop_bit = 1;
+
+	n = sscanf(str, "%127[^:]:%d:%7s", ep->host, &ep->port, framing);
+	if (n < 1 || ep->host[0] != '/' || ep->port <= 0)
+		return -EINVAL;
+
+	if (n == 3)
+		return parse_framing(framing, ep);
+
+	return 0;
+}
+
+static int parse_host(const char *str, struct endpoint *ep, bool port)
+{
+	char extra;
+	int n;
+
+	ep->port = MODBUS_PORT;
+
+	n = sscanf(str, "%127[^:]:%d%c", ep->host, &ep->port, &extra);
+	if (n < 1 || n > 2 || (port && n != 2))
+		return -EINVAL;
+
+	if (ep->port <= 0 || ep->port > UINT16_MAX)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * "host:port" (Modbus TCP, as before) or an URI: tcp://, rtu+tcp://
+ * and udp:// take "host[:port]", port 502 by default. rtu:// takes
+ * "device[:baud[:framing]]", 19200 8E1 by default.
+ */
+int transport_parse(const char *address, struct endpoint *ep)
+{
+	unsigned int i;
+	size_t len;
+	int err;
+
+	memset(ep, 0, sizeof(*ep));
+
+	for (i = 0; i < L_ARRAY_SIZE(schemes); i++) {
+		len = strlen(schemes[i].prefix);
+		if (strncmp(address, schemes[i].prefix, len) != 0)
+			continue;
+
+		ep->type = schemes[i].type;
+		if (ep->type == TRANSPORT_RTU)
+			err = parse_serial(address + len, ep);
+		else
+			err = parse_host(address + len, ep, false);
+
+		goto done;
+	}
+
+	ep->type = TRANSPORT_TCP;
+	err = parse_host(address, ep, true);
+
+done:
+	if (err < 0)
+		l_error("Address (%s) not supported: Invalid format", address);
+
+	return err;
+}
+
+/* Socket to connect to the endpoint, 0 for serial lines */
+int transport_socktype(const struct endpoint *ep)
+{
+	switch (ep->type) {
+	case TRANSPORT_TCP:
+	case TRANSPORT_RTU_TCP:
+		return SOCK_STREAM;
+	case TRANSPORT_UDP:
+		return SOCK_DGRAM;
+	case TRANSPORT_RTU:
+		break;
+	}
+
+	return 0;
+}
+
+/* Context framing requests for 'ep' over 'fd', if connected already */
+modbus_t *transport_new(const struct endpoint *ep, int fd)
+{
+	modbus_t *ctx = NULL;
+
+	switch (ep->type) {
+	case TRANSPORT_TCP:
+	case TRANSPORT_UDP:
+		ctx = modbus_new_tcp(ep->host, ep->port);
+		break;
+	case TRANSPORT_RTU_TCP:
+		/* Line settings are unused: never opened as a tty */
+		ctx = modbus_new_rtu(ep->host, RTU_BAUD, RTU_PARITY, 8, 1);
+		break;
+	case TRANSPORT_RTU:
+		ctx = modbus_new_rtu(ep->host, ep->port, ep->parity,
+				     ep->data_bit, ep->stop_bit);
+		break;
+	}
+
+	if (ctx && fd >= 0)
+		modbus_set_socket(ctx, fd);
+
+	return ctx;
+}
+
+/*
+ * Sends 'req', the unit id followed by the PDU. Returns the ADU length
+ * or a negative errno.
+ */
+int transport_send(modbus_t *ctx, const struct endpoint *ep,
+		   struct transport_rx *rx, const uint8_t *req,
+		   unsigned int req_len)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+	unsigned int len = MBAP_HEADER_LENGTH - 1 + req_len;
+	ssize_t sent;
+
+	if (ep->type == TRANSPORT_RTU_TCP || ep->type == TRANSPORT_RTU) {
+		sent = modbus_send_raw_request(ctx, req, req_len);
+		return (sent < 0 ? -EIO : (int) sent);
+	}
+
+	if (len > sizeof(adu))
+		return -EINVAL;
+
+	/* Transaction, protocol (0), length, then unit id and PDU */
+	rx->tid++;
+	adu[0] = rx->tid >> 8;
+	adu[1] = rx->tid & 0xff;
+	adu[2] = 0;
+	adu[3] = 0;
+	adu[4] = req_len >> 8;
+	adu[5] = req_len & 0xff;
+	memcpy(adu + MBAP_HEADER_LENGTH - 1, req, req_len);
+
+	sent = send(modbus_get_socket(ctx), adu, len, MSG_NOSIGNAL);
+	if (sent < 0)
+		return -errno;
+
+	if ((unsigned int) sent != len)
+		return -EIO;
+
+	return len;
+}
+
+static bool mbap_tid_match(const struct transport_rx *rx)
+{
+	return (rx->buf[0] << 8 | rx->buf[1]) == rx->tid;
+}
+
+static int receive_datagram(modbus_t *ctx, struct transport_rx *rx,
+			    unsigned int *offset, unsigned int *pdu_len)
+{
+	uint8_t *adu = rx->buf;
+	ssize_t len;
+
+	rx->len = 0;
+
+	len = recv(modbus_get_socket(ctx), adu, MODBUS_TCP_MAX_ADU_LENGTH,
+		   MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return -EAGAIN;
+
+		/* ICMP unreachable: reported once, the slave may be back */
+		return (errno == ECONNREFUSED ? -EBADMSG : -EIO);
+	}
+
+	/* MBAP: transaction, protocol (0), length, unit */
+	if (len < MBAP_HEADER_LENGTH + 1 || adu[2] || adu[3] ||
+	    (adu[4] << 8 | adu[5]) != len - 6)
+		return -EBADMSG;
+
+	/* Late or duplicated: its request timed out already */
+	if (!mbap_tid_match(rx))
+		return -EBADMSG;
+
+	rx->len = len;
+	rx->frame = len;
+	*offset = MBAP_HEADER_LENGTH;
+	*pdu_len = len - MBAP_HEADER_LENGTH;
+
+	return len;
+}
+
+/* Reads whatever is available, without waiting for more */
+static int rx_fill(int fd, const struct endpoint *ep,
+		   struct transport_rx *rx)
+{
+	ssize_t len;
+
+	/* Serial lines are opened non-blocking by libmodbus */
+	if (ep->type == TRANSPORT_RTU) {
+		len = read(fd, rx->buf + rx->len, sizeof(rx->buf) - rx->len);
+		if (len == 0)
+			return -EAGAIN;
+	} else {
+		len = recv(fd, rx->buf + rx->len, sizeof(rx->buf) - rx->len,
+			   MSG_DONTWAIT);
+		if (len == 0)
+			return -EIO;
+	}
+
+	if (len < 0)
+		return (errno == EAGAIN || errno == EINTR ? -EAGAIN : -EIO);
+
+	rx->len += len;
+
+	return len;
+}
+
+/* Complete MBAP frame at the head of the buffer: its length, or 0 */
+static int mbap_frame(const struct transport_rx *rx)
+{
+	unsigned int len;
+
+	if (rx->len < MBAP_HEADER_LENGTH)
+		return 0;
+
+	/* Transaction, protocol (0), length, unit */
+	len = 6 + (rx->buf[4] << 8 | rx->buf[5]);
+	if (rx->buf[2] || rx->buf[3] || len <= MBAP_HEADER_LENGTH ||
+	    len > MODBUS_TCP_MAX_ADU_LENGTH)
+		return -EBADMSG;
+
+	return (rx->len >= len ? (int) len : 0);
+}
+
+/* Length of an RTU response, from its function code: 0 if unknown yet */
+static int rtu_length(const struct transport_rx *rx)
+{
+	const uint8_t *adu = rx->buf;
+
+	/* Unit id, function */
+	if (rx->len < 2)
+		return 0;
+
+	/* Exception code */
+	if (adu[1] & 0x80)
+		return 2 + 1 + RTU_CRC_LENGTH;
+
+	switch (adu[1]) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+	case MODBUS_FC_REPORT_SLAVE_ID:
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+	case 0x0c:	/* Get comm event log */
+	case 0x14:	/* Read file record */
+	case 0x15:	/* Write file record */
+		/* Byte count, then as many bytes */
+		if (rx->len < 3)
+			return 0;
+
+		return 3 + adu[2] + RTU_CRC_LENGTH;
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+	case 0x08:	/* Diagnostics */
+	case 0x0b:	/* Get comm event counter */
+		return 2 + 4 + RTU_CRC_LENGTH;
+	case MODBUS_FC_READ_EXCEPTION_STATUS:
+		return 2 + 1 + RTU_CRC_LENGTH;
+	case MODBUS_FC_MASK_WRITE_REGISTER:
+		return 2 + 6 + RTU_CRC_LENGTH;
+	case 0x18:	/* Read FIFO queue: 16 bit byte count */
+		if (rx->len < 4)
+			return 0;
+
+		return 4 + (adu[2] << 8 | adu[3]) + RTU_CRC_LENGTH;
+	}
+
+	return -EBADMSG;
+}
+
+/* Modbus CRC-16: polynomial 0xa001 (reflected 0x8005), from 0xffff */
+static uint16_t rtu_crc(const uint8_t *data, unsigned int len)
+{
+	uint16_t crc = 0xffff;
+	unsigned int i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1);
+	}
+
+	return crc;
+}
+
+/* Complete RTU frame at the head of the buffer: its length, or 0 */
+static int rtu_frame(const struct transport_rx *rx)
+{
+	int len;
+
+	len = rtu_length(rx);
+	if (len <= 0)
+		return len;
+
+	if (len > MODBUS_RTU_MAX_ADU_LENGTH)
+		return -EBADMSG;
+
+	return (rx->len >= (unsigned int) len ? len : 0);
+}
+
+static int receive_stream(modbus_t *ctx, const struct endpoint *ep,
+			  struct transport_rx *rx, unsigned int *offset,
+			  unsigned int *pdu_len)
+{
+	bool mbap = (ep->type == TRANSPORT_TCP);
+	int len;
+	int err;
+
+	len = (mbap ? mbap_frame(rx) : rtu_frame(rx));
+	if (len == 0) {
+		err = rx_fill(modbus_get_socket(ctx), ep, rx);
+		if (err < 0)
+			return err;
+
+		len = (mbap ? mbap_frame(rx) : rtu_frame(rx));
+	}
+
+	/* Out of sync: nothing buffered can be trusted */
+	if (len < 0) {
+		transport_flush(ctx, ep, rx);
+		return -EBADMSG;
+	}
+
+	if (len == 0)
+		return -EAGAIN;
+
+	/* Dropped on the next call */
+	rx->frame = len;
+
+	if (mbap) {
+		/* Late: its request timed out already */
+		if (!mbap_tid_match(rx))
+			return -EBADMSG;
+
+		*offset = MBAP_HEADER_LENGTH;
+		*pdu_len = len - MBAP_HEADER_LENGTH;
+
+		return len;
+	}
+
+	/* Noise on the line: resynchronize on the next frame */
+	if (rtu_crc(rx->buf, len - RTU_CRC_LENGTH) !=
+	    (rx->buf[len - 2] | rx->buf[len - 1] << 8)) {
+		transport_flush(ctx, ep, rx);
+		return -EBADMSG;
+	}
+
+	/* Unit id, then the PDU */
+	*offset = 1;
+	*pdu_len = len - 1 - RTU_CRC_LENGTH;
+
+	return len;
+}
+
+/*
+ * Returns the next response found in 'rx->buf', valid until the next
+ * call, and locates its PDU. Returns the ADU length, -EAGAIN if no
+ * response is complete yet, -EBADMSG for a malformed, corrupted or late
+ * response, which is dropped, or -EIO if the connection is unusable.
+ * Call again until -EAGAIN: several responses may be buffered.
+ */
+int transport_receive(modbus_t *ctx, const struct endpoint *ep,
+		      struct transport_rx *rx, unsigned int *offset,
+		      unsigned int *pdu_len)
+{
+	/* Drop the response handed out last */
+	if (rx->frame) {
+		rx->len -= rx->frame;
+		memmove(rx->buf, rx->buf + rx->frame, rx->len);
+		rx->frame = 0;
+	}
+
+	if (ep->type == TRANSPORT_UDP)
+		return receive_datagram(ctx, rx, offset, pdu_len);
+
+	return receive_stream(ctx, ep, rx, offset, pdu_len);
+}
+
+/* Drops whatever is left of a late response */
+void transport_flush(modbus_t *ctx, const struct endpoint *ep,
+		     struct transport_rx *rx)
+{
+	uint8_t buf[MODBUS_TCP_MAX_ADU_LENGTH];
+
+	rx->len = 0;
+	rx->frame = 0;
+
+	/* Serial line: discards the tty input queue */
+	if (ep->type == TRANSPORT_RTU) {
+		modbus_flush(ctx);
+		return;
+	}
+
+	while (recv(modbus_get_socket(ctx), buf, sizeof(buf),
+		    MSG_DONTWAIT) > 0)
+		;
+}
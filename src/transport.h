@@ -0,0 +1,57 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+enum transport_type {
+	TRANSPORT_TCP,		/* tcp://host[:port] or host:port */
+	TRANSPORT_RTU_TCP,	/* rtu+tcp://host[:port]: raw RTU frames */
+	TRANSPORT_UDP,		/* udp://host[:port]: MBAP, one per datagram */
+	TRANSPORT_RTU,		/* rtu://device[:baud[:8E1]]: serial line */
+};
+
+struct endpoint {
+	enum transport_type type;
+	char host[128];		/* Serial: device */
+	int port;		/* Serial: baud rate */
+	char parity;		/* Serial: 'N', 'E' or 'O' */
+	int data_bit;
+	int stop_bit;
+};
+
+/* Responses may arrive in pieces: buffered until complete */
+struct transport_rx {
+	uint8_t buf[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+	unsigned int len;	/* Bytes buffered */
+	unsigned int frame;	/* Handed out last, dropped on the next call */
+	uint16_t tid;		/* MBAP: transaction id of the last request */
+};
+
+int transport_parse(const char *address, struct endpoint *ep);
+int transport_socktype(const struct endpoint *ep);
+modbus_t *transport_new(const struct endpoint *ep, int fd);
+int transport_send(modbus_t *ctx, const struct endpoint *ep,
+		   struct transport_rx *rx, const uint8_t *req,
+		   unsigned int req_len);
+int transport_receive(modbus_t *ctx, const struct endpoint *ep,
+		      struct transport_rx *rx, unsigned int *offset,
+		      unsigned int *pdu_len);
+void transport_flush(modbus_t *ctx, const struct endpoint *ep,
+		     struct transport_rx *rx);
@@ -0,0 +1,1084 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <ell/ell.h>
+
+#include "watchdog.h"
+#include "rt.h"
+#include "source.h"
+#include "uplink.h"
+
+/*
+ * Uplink publisher: MQTT 3.1.1 client sending every value change to a
+ * broker. Samples of all sources are batched into a single message,
+ * sent once UPLINK_BATCH_SIZE bytes or UPLINK_BATCH_MS are reached,
+ * and deflated when that makes it smaller.
+ *
+ * Batches are published with QoS 1, at most UPLINK_WINDOW waiting for
+ * their PUBACK. Whatever can't be sent right away (broker down, window
+ * full) goes to a spool file, a sequence of length-prefixed batches
+ * read back in order once the broker acknowledges the previous ones.
+ * Delivery is at least once: batches in flight at disconnection, or not
+ * acknowledged before a restart, are sent again.
+ *
+ * Compression and spool I/O go through rt_work(), in order. Offsets in
+ * the spool are tracked here as if writes were done already; a read
+ * done before the spool was rewritten (spool_gen) is discarded.
+ *
+ * The broker address is resolved once, and reconnections reuse it.
+ * Numeric addresses are parsed right away; host names go through
+ * rt_work() too, as getaddrinfo() may block on DNS.
+ */
+
+#define UPLINK_BATCH_SIZE	16384	/* Samples, uncompressed */
+#define UPLINK_BATCH_MS		1000
+#define UPLINK_WINDOW		16	/* PUBLISH waiting for PUBACK */
+#define UPLINK_SPOOL_FILE	"uplink.spool"
+#define UPLINK_SPOOL_MAX	(64 * 1024 * 1024)
+#define SPOOL_HDR_LEN		4	/* Big endian batch length */
+#define UPLINK_KEEPALIVE	60	/* seconds */
+#define UPLINK_READ_MAX		256	/* We don't subscribe to anything */
+
+#define CONNECT_TIMEOUT		10	/* seconds, until CONNACK */
+#define RECONNECT_MIN		1	/* seconds */
+#define RECONNECT_MAX		60	/* seconds */
+
+#define MQTT_CONNECT		0x10
+#define MQTT_CONNACK		0x20
+#define MQTT_PUBLISH_QOS1	0x32
+#define MQTT_PUBACK		0x40
+#define MQTT_PINGREQ		0xc0
+#define MQTT_PINGRESP		0xd0
+#define MQTT_DISCONNECT		0xe0
+
+struct message {
+	uint16_t pid;
+	uint8_t *data;
+	uint32_t len;
+	off_t spool_end;	/* Read from the spool: past its record */
+};
+
+/* Write of a length-prefixed batch, or truncation if len is 0 */
+struct spool_op {
+	off_t offset;
+	uint32_t len;
+	int err;
+	uint8_t data[];
+};
+
+/* Up to 'max' batches read from 'offset', before 'end' */
+struct spool_read {
+	unsigned int gen;
+	off_t offset;
+	off_t end;
+	unsigned int max;
+	struct l_queue *messages;
+	bool truncated;		/* Stopped at a record cut short */
+};
+
+/* Batch deflated by rt_work() */
+struct batch_job {
+	uint8_t *batch;
+	size_t batch_len;
+	uint16_t count;
+	uint8_t *data;
+	uint32_t len;
+};
+
+/* Broker host name looked up by rt_work() */
+struct resolve {
+	char *host;
+	int port;
+	int err;
+	bool cancelled;		/* uplink_stop() meanwhile */
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+static char *hostname;
+static int port;
+static char *topic;
+static struct sockaddr_storage broker_addr;
+static socklen_t broker_addr_len;	/* 0 until resolved */
+static struct resolve *resolving;
+
+static struct l_io *io;
+static bool connected;		/* CONNACK received */
+static bool writing;
+static uint8_t *out;
+static size_t out_len;
+static uint8_t in[UPLINK_READ_MAX];
+static size_t in_len;
+static struct l_timeout *connect_to;
+static struct l_timeout *reconnect_to;
+static struct l_timeout *ping_to;
+static bool ping_pending;
+static unsigned int backoff;
+
+static struct l_queue *inflight;
+static uint16_t next_pid;
+
+static uint8_t *batch;
+static size_t batch_len;
+static uint16_t batch_count;
+static struct l_timeout *batch_to;
+
+static int spool_fd = -1;
+static off_t spool_size;
+static off_t spool_read;	/* Next record to send */
+static off_t spool_acked;	/* Records before it were acknowledged */
+static unsigned int spool_gen;	/* Bumped when offsets are rebased */
+static bool spool_reading;
+static uint64_t dropped;
+
+static void uplink_connect(void);
+static void uplink_reconnect(void);
+static void spool_drain(void);
+
+static void message_free(void *data)
+{
+	struct message *msg = data;
+
+	l_free(msg->data);
+	l_free(msg);
+}
+
+static void io_destroy_idle(void *user_data)
+{
+	l_io_destroy(user_data);
+}
+
+static bool write_cb(struct l_io *io, void *user_data)
+{
+	ssize_t ret;
+
+	ret = send(l_io_get_fd(io), out, out_len, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return true;
+
+		writing = false;
+		uplink_reconnect();
+		return false;
+	}
+
+	memmove(out, out + ret, out_len - ret);
+	out_len -= ret;
+
+	writing = (out_len > 0);
+
+	return writing;
+}
+
+static void out_append(const uint8_t *data, size_t len)
+{
+	out = l_realloc(out, out_len + len);
+	memcpy(out + out_len, data, len);
+	out_len += len;
+
+	if (writing)
+		return;
+
+	writing = true;
+	l_io_set_write_handler(io, write_cb, NULL, NULL);
+}
+
+/* MQTT fixed header: type and variable length "remaining length" */
+static void packet_begin(uint8_t type, uint32_t remaining)
+{
+	uint8_t hdr[5];
+	size_t len = 0;
+
+	hdr[len++] = type;
+
+	do {
+		hdr[len] = remaining & 0x7f;
+		remaining >>= 7;
+		if (remaining)
+			hdr[len] |= 0x80;
+		len++;
+	} while (remaining);
+
+	out_append(hdr, len);
+}
+
+static void append_string(const char *str)
+{
+	uint8_t len[2];
+	size_t size = strlen(str);
+
+	len[0] = size >> 8;
+	len[1] = size & 0xff;
+	out_append(len, sizeof(len));
+	out_append((const uint8_t *) str, size);
+}
+
+static void publish_send(struct message *msg)
+{
+	uint8_t pid[2];
+
+	/* Packet identifiers are non-zero */
+	if (++next_pid == 0)
+		next_pid = 1;
+
+	msg->pid = next_pid;
+	pid[0] = msg->pid >> 8;
+	pid[1] = msg->pid & 0xff;
+
+	packet_begin(MQTT_PUBLISH_QOS1, 2 + strlen(topic) + 2 + msg->len);
+	append_string(topic);
+	out_append(pid, sizeof(pid));
+	out_append(msg->data, msg->len);
+
+	l_queue_push_tail(inflight, msg);
+}
+
+static void spool_op_run(void *user_data)
+{
+	struct spool_op *op = user_data;
+
+	if (!op->len) {
+		if (ftruncate(spool_fd, op->offset) < 0)
+			op->err = -errno;
+		return;
+	}
+
+	if (pwrite(spool_fd, op->data, op->len, op->offset) != op->len)
+		op->err = -errno ? : -EIO;
+}
+
+static void spool_op_done(void *user_data)
+{
+	struct spool_op *op = user_data;
+
+	if (!op->err)
+		return;
+
+	l_error("uplink: spool: %s", strerror(-op->err));
+
+	if (op->len)
+		dropped++;
+}
+
+static void spool_truncate(off_t offset)
+{
+	struct spool_op *op;
+
+	op = l_new(struct spool_op, 1);
+	op->offset = offset;
+	spool_gen++;
+
+	rt_work(spool_op_run, spool_op_done, op, l_free);
+}
+
+static void spool_append(const uint8_t *data, uint32_t len)
+{
+	struct spool_op *op;
+
+	if (spool_fd < 0 ||
+	    spool_size + SPOOL_HDR_LEN + len > UPLINK_SPOOL_MAX) {
+		if (dropped++ == 0)
+			l_warn("uplink: spool full, dropping samples");
+		return;
+	}
+
+	op = l_malloc(sizeof(*op) + SPOOL_HDR_LEN + len);
+	op->offset = spool_size;
+	op->len = SPOOL_HDR_LEN + len;
+	op->err = 0;
+	op->data[0] = len >> 24;
+	op->data[1] = len >> 16;
+	op->data[2] = len >> 8;
+	op->data[3] = len;
+	memcpy(op->data + SPOOL_HDR_LEN, data, len);
+
+	rt_work(spool_op_run, spool_op_done, op, l_free);
+
+	spool_size += SPOOL_HDR_LEN + len;
+}
+
+/* Drops what was acknowledged: keeps the file from growing forever */
+static void spool_compact(void)
+{
+	uint8_t buf[4096];
+	off_t from = spool_acked;
+	off_t to = 0;
+	ssize_t len;
+
+	if (spool_fd < 0 || spool_acked == 0)
+		return;
+
+	while (from < spool_size) {
+		len = pread(spool_fd, buf, sizeof(buf), from);
+		if (len <= 0 || pwrite(spool_fd, buf, len, to) != len)
+			break;
+
+		from += len;
+		to += len;
+	}
+
+	spool_size = to;
+	spool_read = 0;
+	spool_acked = 0;
+	spool_gen++;
+
+	if (ftruncate(spool_fd, spool_size) < 0)
+		l_error("uplink: spool: %s", strerror(errno));
+}
+
+static void spool_read_run(void *user_data)
+{
+	struct spool_read *read = user_data;
+	struct message *msg;
+	uint8_t hdr[SPOOL_HDR_LEN];
+	uint32_t len;
+
+	while (read->offset < read->end &&
+	       l_queue_length(read->messages) < read->max) {
+		if (pread(spool_fd, hdr, sizeof(hdr), read->offset) !=
+		    sizeof(hdr))
+			goto truncated;
+
+		len = hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+		if (read->offset + sizeof(hdr) + len > (uint64_t) read->end)
+			goto truncated;
+
+		msg = l_new(struct message, 1);
+		msg->data = l_malloc(len);
+		msg->len = len;
+		if (pread(spool_fd, msg->data, len,
+			  read->offset + sizeof(hdr)) != len) {
+			message_free(msg);
+			goto truncated;
+		}
+
+		read->offset += sizeof(hdr) + len;
+		msg->spool_end = read->offset;
+
+		l_queue_push_tail(read->messages, msg);
+	}
+
+	return;
+
+truncated:
+	read->truncated = true;
+}
+
+static void spool_read_done(void *user_data)
+{
+	struct spool_read *read = user_data;
+	struct message *msg;
+
+	spool_reading = false;
+
+	/* Disconnected or spool rewritten meanwhile: read it again */
+	if (read->gen != spool_gen || !connected)
+		goto again;
+
+	while ((msg = l_queue_pop_head(read->messages))) {
+		spool_read = msg->spool_end;
+		publish_send(msg);
+	}
+
+	if (read->truncated) {
+		/* Last record cut short by a crash */
+		l_warn("uplink: spool truncated at %lld",
+		       (long long) spool_read);
+		spool_size = spool_read;
+		spool_truncate(spool_size);
+	}
+
+again:
+	spool_drain();
+}
+
+static void spool_read_free(void *user_data)
+{
+	struct spool_read *read = user_data;
+
+	l_queue_destroy(read->messages, message_free);
+	l_free(read);
+}
+
+static void spool_drain(void)
+{
+	struct spool_read *read;
+
+	if (spool_reading || !connected || spool_read >= spool_size ||
+	    l_queue_length(inflight) >= UPLINK_WINDOW)
+		return;
+
+	read = l_new(struct spool_read, 1);
+	read->gen = spool_gen;
+	read->offset = spool_read;
+	read->end = spool_size;
+	read->max = UPLINK_WINDOW - l_queue_length(inflight);
+	read->messages = l_queue_new();
+
+	spool_reading = true;
+	rt_work(spool_read_run, spool_read_done, read, spool_read_free);
+}
+
+static void message_submit(uint8_t *data, uint32_t len)
+{
+	struct message *msg;
+
+	/* Behind older spooled batches: keep them in order */
+	if (!connected || spool_size > 0 ||
+	    l_queue_length(inflight) >= UPLINK_WINDOW) {
+		spool_append(data, len);
+		l_free(data);
+		return;
+	}
+
+	msg = l_new(struct message, 1);
+	msg->data = data;
+	msg->len = len;
+
+	publish_send(msg);
+}
+
+static void batch_deflate(void *user_data)
+{
+	struct batch_job *job = user_data;
+	struct uplink_hdr hdr;
+#ifdef HAVE_ZLIB
+	uLongf deflated;
+#endif
+
+	hdr.version = UPLINK_VERSION;
+	hdr.flags = 0;
+	hdr.count = htons(job->count);
+	hdr.length = htonl(job->batch_len);
+
+	job->data = l_malloc(sizeof(hdr) + job->batch_len);
+	job->len = sizeof(hdr) + job->batch_len;
+
+#ifdef HAVE_ZLIB
+	deflated = job->batch_len;
+	if (compress2(job->data + sizeof(hdr), &deflated, job->batch,
+		      job->batch_len, Z_BEST_SPEED) == Z_OK &&
+	    deflated < job->batch_len) {
+		hdr.flags |= UPLINK_FLAG_DEFLATE;
+		job->len = sizeof(hdr) + deflated;
+	} else
+#endif
+		memcpy(job->data + sizeof(hdr), job->batch, job->batch_len);
+
+	memcpy(job->data, &hdr, sizeof(hdr));
+}
+
+static void batch_done(void *user_data)
+{
+	struct batch_job *job = user_data;
+
+	message_submit(job->data, job->len);
+	job->data = NULL;
+}
+
+static void batch_job_free(void *user_data)
+{
+	struct batch_job *job = user_data;
+
+	l_free(job->batch);
+	l_free(job->data);
+	l_free(job);
+}
+
+static void batch_flush(void)
+{
+	struct batch_job *job;
+
+	l_timeout_remove(batch_to);
+	batch_to = NULL;
+
+	if (!batch_count)
+		return;
+
+	/* The buffer goes with the job: a new one is allocated on demand */
+	job = l_new(struct batch_job, 1);
+	job->batch = batch;
+	job->batch_len = batch_len;
+	job->count = batch_count;
+
+	batch = NULL;
+	batch_len = 0;
+	batch_count = 0;
+
+	rt_work(batch_deflate, batch_done, job, batch_job_free);
+}
+
+static void batch_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	WATCHDOG_SCOPE("uplink batch");
+
+	batch_flush();
+}
+
+static void put_be16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = value >> 8;
+	buf[1] = value & 0xff;
+}
+
+void uplink_publish(struct source *source, const uint8_t *value,
+		    uint16_t len)
+{
+	const char *path;
+	struct timespec ts;
+	uint64_t timestamp;
+	size_t path_len;
+	size_t size;
+	uint8_t *ptr;
+	int i;
+
+	if (!hostname)
+		return;
+
+	path = source_get_path(source);
+	path_len = strlen(path);
+	size = 2 + path_len + 8 + 2 + len;
+
+	if (batch_len + size > UPLINK_BATCH_SIZE)
+		batch_flush();
+
+	if (!batch)
+		batch = l_malloc(UPLINK_BATCH_SIZE);
+
+	/* A single sample larger than a batch can't be sent */
+	if (size > UPLINK_BATCH_SIZE)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	timestamp = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	ptr = batch + batch_len;
+	put_be16(ptr, path_len);
+	memcpy(ptr + 2, path, path_len);
+	ptr += 2 + path_len;
+
+	for (i = 7; i >= 0; i--, timestamp >>= 8)
+		ptr[i] = timestamp & 0xff;
+
+	put_be16(ptr + 8, len);
+	memcpy(ptr + 10, value, len);
+
+	batch_len += size;
+	batch_count++;
+
+	if (!batch_to)
+		batch_to = l_timeout_create_ms(UPLINK_BATCH_MS,
+					       batch_to_expired, NULL, NULL);
+}
+
+static void reconnect_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	WATCHDOG_SCOPE("uplink reconnect");
+
+	l_timeout_remove(reconnect_to);
+	reconnect_to = NULL;
+
+	uplink_connect();
+}
+
+static void requeue_live(void *data, void *user_data)
+{
+	struct message *msg = data;
+
+	/* Spooled ones are read again from the spool */
+	if (!msg->spool_end)
+		spool_append(msg->data, msg->len);
+}
+
+static void uplink_close(void)
+{
+	if (io) {
+		/* May run from the io's own handlers */
+		l_io_set_read_handler(io, NULL, NULL, NULL);
+		l_io_set_write_handler(io, NULL, NULL, NULL);
+		l_io_set_disconnect_handler(io, NULL, NULL, NULL);
+		l_idle_oneshot(io_destroy_idle, io, NULL);
+		io = NULL;
+	}
+
+	if (connected)
+		l_info("uplink: disconnected from %s:%d", hostname, port);
+
+	connected = false;
+	writing = false;
+	ping_pending = false;
+	out_len = 0;
+	in_len = 0;
+
+	l_timeout_remove(connect_to);
+	connect_to = NULL;
+	l_timeout_remove(ping_to);
+	ping_to = NULL;
+
+	/* Not acknowledged: sent again after reconnection */
+	l_queue_foreach(inflight, requeue_live, NULL);
+	l_queue_clear(inflight, message_free);
+	spool_read = spool_acked;
+	spool_gen++;
+}
+
+static void uplink_reconnect(void)
+{
+	uplink_close();
+
+	backoff = (backoff ? backoff * 2 : RECONNECT_MIN);
+	if (backoff > RECONNECT_MAX)
+		backoff = RECONNECT_MAX;
+
+	l_timeout_remove(reconnect_to);
+	reconnect_to = l_timeout_create(backoff, reconnect_to_expired,
+					NULL, NULL);
+}
+
+static void ping_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	WATCHDOG_SCOPE("uplink ping");
+
+	/* Previous PINGREQ not answered */
+	if (ping_pending) {
+		l_warn("uplink: %s:%d not responding", hostname, port);
+		uplink_reconnect();
+		return;
+	}
+
+	ping_pending = true;
+	packet_begin(MQTT_PINGREQ, 0);
+
+	l_timeout_modify(ping_to, UPLINK_KEEPALIVE / 2);
+}
+
+static void puback(uint16_t pid)
+{
+	struct message *msg;
+
+	/* QoS 1 acknowledgements come in order */
+	msg = l_queue_peek_head(inflight);
+	if (!msg || msg->pid != pid)
+		return;
+
+	l_queue_pop_head(inflight);
+
+	if (msg->spool_end > spool_acked)
+		spool_acked = msg->spool_end;
+
+	message_free(msg);
+
+	/* Spool entirely delivered */
+	if (spool_size && spool_acked == spool_size &&
+	    l_queue_isempty(inflight)) {
+		spool_size = 0;
+		spool_read = 0;
+		spool_acked = 0;
+		spool_truncate(0);
+
+		if (dropped) {
+			l_warn("uplink: %llu batches dropped",
+			       (unsigned long long) dropped);
+			dropped = 0;
+		}
+	}
+
+	spool_drain();
+}
+
+static bool packet_process(uint8_t type, const uint8_t *data, size_t len)
+{
+	switch (type & 0xf0) {
+	case MQTT_CONNACK:
+		if (len < 2 || data[1] != 0) {
+			l_error("uplink: %s:%d refused connection (%d)",
+				hostname, port, len < 2 ? -1 : data[1]);
+			return false;
+		}
+
+		l_info("uplink: connected to %s:%d", hostname, port);
+
+		l_timeout_remove(connect_to);
+		connect_to = NULL;
+		connected = true;
+		backoff = 0;
+		ping_to = l_timeout_create(UPLINK_KEEPALIVE / 2,
+					   ping_to_expired, NULL, NULL);
+
+		spool_drain();
+		break;
+	case MQTT_PUBACK:
+		if (len >= 2)
+			puback(data[0] << 8 | data[1]);
+		break;
+	case MQTT_PINGRESP:
+		ping_pending = false;
+		break;
+	}
+
+	return true;
+}
+
+static bool read_cb(struct l_io *io, void *user_data)
+{
+	uint32_t remaining;
+	size_t hdr_len;
+	ssize_t ret;
+	int shift;
+	WATCHDOG_SCOPE("uplink read");
+
+	ret = recv(l_io_get_fd(io), in + in_len, sizeof(in) - in_len,
+		   MSG_DONTWAIT);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+
+		uplink_reconnect();
+		return true;
+	}
+
+	in_len += ret;
+
+	for (;;) {
+		/* Fixed header: type, then 1 to 4 bytes of length */
+		remaining = 0;
+		shift = 0;
+		for (hdr_len = 1; hdr_len < in_len && hdr_len <= 4;
+		     hdr_len++) {
+			remaining |= (in[hdr_len] & 0x7f) << shift;
+			shift += 7;
+			if (!(in[hdr_len] & 0x80))
+				break;
+		}
+
+		if (hdr_len >= in_len)
+			return true;
+
+		hdr_len++;
+		if (hdr_len + remaining > sizeof(in)) {
+			l_error("uplink: unexpected packet (0x%02x)", in[0]);
+			uplink_reconnect();
+			return true;
+		}
+
+		if (in_len < hdr_len + remaining)
+			return true;
+
+		if (!packet_process(in[0], in + hdr_len, remaining)) {
+			uplink_reconnect();
+			return true;
+		}
+
+		/* Closed while processing? */
+		if (!io)
+			return true;
+
+		in_len -= hdr_len + remaining;
+		memmove(in, in + hdr_len + remaining, in_len);
+	}
+}
+
+static void disconnect_cb(struct l_io *io, void *user_data)
+{
+	uplink_reconnect();
+}
+
+static void connect_send(void)
+{
+	char client_id[24];
+	char host[64];
+	uint8_t hdr[10] = {
+		0x00, 0x04, 'M', 'Q', 'T', 'T',
+		0x04,			/* Protocol level: 3.1.1 */
+		0x02,			/* Clean session */
+		UPLINK_KEEPALIVE >> 8, UPLINK_KEEPALIVE & 0xff,
+	};
+
+	if (gethostname(host, sizeof(host)) < 0)
+		strcpy(host, "unknown");
+
+	host[sizeof(host) - 1] = '\0';
+
+	/* At most 23 characters: accepted by any 3.1.1 broker */
+	snprintf(client_id, sizeof(client_id), "modbusd-%s", host);
+
+	packet_begin(MQTT_CONNECT, sizeof(hdr) + 2 + strlen(client_id));
+	out_append(hdr, sizeof(hdr));
+	append_string(client_id);
+}
+
+static bool connect_cb(struct l_io *io, void *user_data)
+{
+	socklen_t len;
+	int err = 0;
+	WATCHDOG_SCOPE("uplink connect");
+
+	len = sizeof(err);
+	if (getsockopt(l_io_get_fd(io), SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err) {
+		l_info("uplink: connect() %s:%d (%d)", hostname, port, err);
+		uplink_reconnect();
+		return false;
+	}
+
+	l_io_set_read_handler(io, read_cb, NULL, NULL);
+	l_io_set_disconnect_handler(io, disconnect_cb, NULL, NULL);
+
+	/* From now on, the write handler sends the output buffer */
+	connect_send();
+	l_io_set_write_handler(io, write_cb, NULL, NULL);
+
+	return true;
+}
+
+static void connect_to_expired(struct l_timeout *timeout, void *user_data)
+{
+	WATCHDOG_SCOPE("uplink connect timeout");
+
+	l_info("uplink: %s:%d timed out", hostname, port);
+	uplink_reconnect();
+}
+
+/* flags: AI_NUMERICHOST not to block on DNS */
+static int resolve(const char *host, int port, int flags,
+		   struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char service[8];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | flags;
+	snprintf(service, sizeof(service), "%d", port);
+
+	if (getaddrinfo(host, service, &hints, &res) != 0)
+		return -EHOSTUNREACH;
+
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	*addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+static void broker_connect(void)
+{
+	int enable = 1;
+	int fd;
+	int err;
+
+	fd = socket(broker_addr.ss_family,
+		    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		uplink_reconnect();
+		return;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+	err = connect(fd, (struct sockaddr *) &broker_addr, broker_addr_len);
+	if (err < 0 && errno != EINPROGRESS) {
+		close(fd);
+		uplink_reconnect();
+		return;
+	}
+
+	io = l_io_new(fd);
+	l_io_set_close_on_destroy(io, true);
+	writing = true;
+	l_io_set_write_handler(io, connect_cb, NULL, NULL);
+
+	connect_to = l_timeout_create(CONNECT_TIMEOUT, connect_to_expired,
+				      NULL, NULL);
+}
+
+static void resolve_run(void *user_data)
+{
+	struct resolve *job = user_data;
+
+	job->err = resolve(job->host, job->port, 0, &job->addr,
+			   &job->addr_len);
+}
+
+static void resolve_done(void *user_data)
+{
+	struct resolve *job = user_data;
+
+	if (job->cancelled)
+		return;
+
+	resolving = NULL;
+
+	if (job->err < 0) {
+		l_info("uplink: can't resolve %s", job->host);
+		uplink_reconnect();
+		return;
+	}
+
+	memcpy(&broker_addr, &job->addr, job->addr_len);
+	broker_addr_len = job->addr_len;
+
+	broker_connect();
+}
+
+static void resolve_free(void *user_data)
+{
+	struct resolve *job = user_data;
+
+	l_free(job->host);
+	l_free(job);
+}
+
+static void uplink_connect(void)
+{
+	struct resolve *job;
+
+	if (broker_addr_len ||
+	    resolve(hostname, port, AI_NUMERICHOST, &broker_addr,
+		    &broker_addr_len) == 0) {
+		broker_connect();
+		return;
+	}
+
+	if (resolving)
+		return;
+
+	job = l_new(struct resolve, 1);
+	job->host = l_strdup(hostname);
+	job->port = port;
+
+	resolving = job;
+	rt_work(resolve_run, resolve_done, job, resolve_free);
+}
+
+static int spool_open(const char *dir)
+{
+	char *path;
+	int err;
+
+	path = l_strdup_printf("%s/%s", dir, UPLINK_SPOOL_FILE);
+
+	/* Not O_APPEND: pwrite() is needed to compact it */
+	spool_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (spool_fd < 0) {
+		err = -errno;
+		l_error("uplink: %s: %s", path, strerror(-err));
+		l_free(path);
+		return err;
+	}
+
+	spool_size = lseek(spool_fd, 0, SEEK_END);
+	if (spool_size < 0)
+		spool_size = 0;
+
+	if (spool_size)
+		l_info("uplink: %s: %lld bytes pending", path,
+		       (long long) spool_size);
+
+	l_free(path);
+
+	return 0;
+}
+
+int uplink_start(const char *address, const char *uplink_topic,
+		 const char *spool_dir)
+{
+	char host[128];
+
+	memset(host, 0, sizeof(host));
+	if (sscanf(address, "%127[^:]:%d", host, &port) != 2)
+		return -EINVAL;
+
+	l_info("Starting uplink: %s:%d topic: %s ...", host, port,
+	       uplink_topic);
+
+	/* Without a spool, batches are dropped while disconnected */
+	spool_open(spool_dir);
+
+	hostname = l_strdup(host);
+	topic = l_strdup(uplink_topic);
+	inflight = l_queue_new();
+
+	uplink_connect();
+
+	return 0;
+}
+
+void uplink_stop(void)
+{
+	if (!hostname)
+		return;
+
+	/* Everything not acknowledged yet ends up in the spool */
+	batch_flush();
+	l_timeout_remove(reconnect_to);
+	reconnect_to = NULL;
+
+	l_io_destroy(io);
+	io = NULL;
+	uplink_close();
+	spool_compact();
+
+	if (resolving)
+		resolving->cancelled = true;
+	resolving = NULL;
+	broker_addr_len = 0;
+
+	l_queue_destroy(inflight, message_free);
+	inflight = NULL;
+
+	if (spool_fd >= 0)
+		close(spool_fd);
+	spool_fd = -1;
+
+	l_free(batch);
+	batch = NULL;
+	l_free(out);
+	out = NULL;
+	l_free(hostname);
+	hostname = NULL;
+	l_free(topic);
+	topic = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Uplink batch: payload of a MQTT PUBLISH (QoS 1), integers in network
+ * byte order. The header is followed by 'count' samples, deflated with
+ * zlib if UPLINK_FLAG_DEFLATE is set ('length' is then the inflated
+ * size):
+ *
+ *   path length (uint16), path (no NUL), timestamp (uint64, us since
+ *   the Epoch), value length (uint16), raw value
+ */
+#define UPLINK_VERSION			1
+#define UPLINK_FLAG_DEFLATE		0x01
+
+struct uplink_hdr {
+	uint8_t version;
+	uint8_t flags;
+	uint16_t count;
+	uint32_t length;	/* Samples, uncompressed */
+} __attribute__ ((packed));
+
+struct source;
+
+int uplink_start(const char *address, const char *topic,
+		 const char *spool_dir);
+void uplink_stop(void);
+
+void uplink_publish(struct source *source, const uint8_t *value,
+		    uint16_t len);
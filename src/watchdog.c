@@ -0,0 +1,310 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <ell/ell.h>
+
+#include "dbus.h"
+#include "watchdog.h"
+
+/*
+ * Main loop watchdog. Every scheduler dispatch reports how late it
+ * runs after its deadline (watchdog_dispatch()): any lag means some
+ * handler kept the loop busy, even inside ell (D-Bus marshalling, for
+ * instance). Instrumented callbacks (WATCHDOG_SCOPE) are timed
+ * individually, so a stall can be blamed on the callback that caused
+ * it. Nested scopes count their own calls, but only the outermost one
+ * is charged for a stall.
+ *
+ * Utilisation is the CPU time used by the main thread over wall time,
+ * sampled every WATCHDOG_WINDOW_MS.
+ */
+#define WATCHDOG_WINDOW_MS	1000
+
+static struct l_timeout *window;
+static uint64_t window_wall;		/* us */
+static uint64_t window_cpu;		/* us */
+static double utilisation;
+static uint64_t max_lag;		/* us */
+static uint64_t stalls;
+static uint32_t stall_threshold = WATCHDOG_STALL_MS;
+static struct watchdog_site *site_list;
+static struct watchdog_site *last_site;
+static uint64_t last_elapsed;		/* us, longest since dispatch */
+static unsigned int depth;		/* Scopes entered, not left */
+
+static uint64_t cpu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t watchdog_enter(void)
+{
+	depth++;
+
+	return l_time_now();
+}
+
+void watchdog_leave(struct watchdog_scope *scope)
+{
+	struct watchdog_site *site = scope->site;
+	uint64_t elapsed = l_time_now() - scope->start;
+
+	depth--;
+
+	if (unlikely(!site->registered)) {
+		site->registered = true;
+		site->next = site_list;
+		site_list = site;
+	}
+
+	site->calls++;
+	site->total += elapsed;
+	if (elapsed > site->max)
+		site->max = elapsed;
+
+	/* Inside another scope: its stall is the outer one's */
+	if (depth)
+		return;
+
+	last_site = site;
+	if (elapsed > last_elapsed)
+		last_elapsed = elapsed;
+
+	if (elapsed < (uint64_t) stall_threshold * 1000)
+		return;
+
+	stalls++;
+	l_warn("Stall: %s took %" PRIu64 " ms", site->name, elapsed / 1000);
+}
+
+/* Scheduler dispatch due at 'deadline', running at 'now' */
+void watchdog_dispatch(uint64_t deadline, uint64_t now)
+{
+	uint64_t lag = (now > deadline ? now - deadline : 0);
+
+	if (lag > max_lag)
+		max_lag = lag;
+
+	/* Instrumented callbacks already reported their own stalls */
+	if (lag >= (uint64_t) stall_threshold * 1000 &&
+	    last_elapsed < (uint64_t) stall_threshold * 1000) {
+		stalls++;
+		l_warn("Stall: dispatch %" PRIu64 " ms late "
+		       "(last callback: %s)", lag / 1000,
+		       last_site ? last_site->name : "none");
+	}
+
+	last_site = NULL;
+	last_elapsed = 0;
+}
+
+static void window_expired(struct l_timeout *timeout, void *user_data)
+{
+	uint64_t now = l_time_now();
+	uint64_t cpu = cpu_now();
+
+	if (now > window_wall)
+		utilisation = (double) (cpu - window_cpu) /
+						(now - window_wall);
+	window_wall = now;
+	window_cpu = cpu;
+
+	l_timeout_modify_ms(timeout, WATCHDOG_WINDOW_MS);
+}
+
+static bool property_get_utilisation(struct l_dbus *dbus,
+				     struct l_dbus_message *msg,
+				     struct l_dbus_message_builder *builder,
+				     void *user_data)
+{
+	l_dbus_message_builder_append_basic(builder, 'd', &utilisation);
+
+	return true;
+}
+
+static bool property_get_max_lag(struct l_dbus *dbus,
+				 struct l_dbus_message *msg,
+				 struct l_dbus_message_builder *builder,
+				 void *user_data)
+{
+	l_dbus_message_builder_append_basic(builder, 't', &max_lag);
+
+	return true;
+}
+
+static bool property_get_stalls(struct l_dbus *dbus,
+				struct l_dbus_message *msg,
+				struct l_dbus_message_builder *builder,
+				void *user_data)
+{
+	l_dbus_message_builder_append_basic(builder, 't', &stalls);
+
+	return true;
+}
+
+static bool property_get_threshold(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	l_dbus_message_builder_append_basic(builder, 'u', &stall_threshold);
+
+	return true;
+}
+
+static struct l_dbus_message *property_set_threshold(struct l_dbus *dbus,
+					 struct l_dbus_message *msg,
+					 struct l_dbus_message_iter *new_value,
+					 l_dbus_property_complete_cb_t complete,
+					 void *user_data)
+{
+	uint32_t threshold;
+
+	if (!l_dbus_message_iter_get_variant(new_value, "u", &threshold))
+		return dbus_error_invalid_args(msg);
+
+	if (threshold == 0)
+		return dbus_error_invalid_args(msg);
+
+	stall_threshold = threshold;
+
+	complete(dbus, msg, NULL);
+
+	return NULL;
+}
+
+static bool property_get_callbacks(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct watchdog_site *site;
+
+	l_dbus_message_builder_enter_array(builder, "(sttt)");
+	for (site = site_list; site; site = site->next) {
+		l_dbus_message_builder_enter_struct(builder, "sttt");
+		l_dbus_message_builder_append_basic(builder, 's', site->name);
+		l_dbus_message_builder_append_basic(builder, 't',
+						    &site->calls);
+		l_dbus_message_builder_append_basic(builder, 't',
+						    &site->total);
+		l_dbus_message_builder_append_basic(builder, 't', &site->max);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static struct l_dbus_message *method_reset(struct l_dbus *dbus,
+					   struct l_dbus_message *msg,
+					   void *user_data)
+{
+	struct watchdog_site *site;
+
+	for (site = site_list; site; site = site->next) {
+		site->calls = 0;
+		site->total = 0;
+		site->max = 0;
+	}
+
+	max_lag = 0;
+	stalls = 0;
+
+	return l_dbus_message_new_method_return(msg);
+}
+
+static void setup_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "Reset", 0,
+				method_reset, "", "");
+
+	/* Main thread CPU time over wall time, last second */
+	if (!l_dbus_interface_property(interface, "Utilisation", 0, "d",
+				       property_get_utilisation,
+				       NULL))
+		l_error("Can't add 'Utilisation' property");
+
+	/* Longest scheduler dispatch delay, us */
+	if (!l_dbus_interface_property(interface, "MaxLag", 0, "t",
+				       property_get_max_lag,
+				       NULL))
+		l_error("Can't add 'MaxLag' property");
+
+	if (!l_dbus_interface_property(interface, "Stalls", 0, "t",
+				       property_get_stalls,
+				       NULL))
+		l_error("Can't add 'Stalls' property");
+
+	/* ms: longer callbacks or dispatch delays are logged */
+	if (!l_dbus_interface_property(interface, "StallThreshold", 0, "u",
+				       property_get_threshold,
+				       property_set_threshold))
+		l_error("Can't add 'StallThreshold' property");
+
+	/* Name, calls, total and longest duration (us) */
+	if (!l_dbus_interface_property(interface, "Callbacks", 0, "a(sttt)",
+				       property_get_callbacks,
+				       NULL))
+		l_error("Can't add 'Callbacks' property");
+}
+
+int watchdog_start(void)
+{
+	l_info("Starting watchdog ...");
+
+	if (!l_dbus_register_interface(dbus_get_bus(),
+				       LOOP_IFACE,
+				       setup_interface,
+				       NULL, false)) {
+		l_error("dbus: unable to register %s", LOOP_IFACE);
+		return -EINVAL;
+	}
+
+	window_wall = l_time_now();
+	window_cpu = cpu_now();
+	window = l_timeout_create_ms(WATCHDOG_WINDOW_MS, window_expired,
+				     NULL, NULL);
+
+	return 0;
+}
+
+void watchdog_stop(void)
+{
+	l_timeout_remove(window);
+	window = NULL;
+
+	l_dbus_unregister_interface(dbus_get_bus(), LOOP_IFACE);
+}
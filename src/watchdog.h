@@ -0,0 +1,55 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define WATCHDOG_STALL_MS	50	/* Default stall threshold */
+
+/* One per instrumented callback, registered on first use */
+struct watchdog_site {
+	const char *name;
+	struct watchdog_site *next;
+	bool registered;
+	uint64_t calls;
+	uint64_t total;		/* us */
+	uint64_t max;		/* us */
+};
+
+struct watchdog_scope {
+	struct watchdog_site *site;
+	uint64_t start;
+};
+
+uint64_t watchdog_enter(void);
+void watchdog_leave(struct watchdog_scope *scope);
+void watchdog_dispatch(uint64_t deadline, uint64_t now);
+
+/*
+ * Measures the enclosing callback until it returns, whatever the return
+ * path. Must be the last declaration of the function.
+ */
+#define WATCHDOG_SCOPE(_name)						\
+	static struct watchdog_site __wd_site = { .name = (_name) };	\
+	struct watchdog_scope __wd_scope				\
+		__attribute__ ((cleanup(watchdog_leave))) =		\
+		{ &__wd_site, watchdog_enter() }
+
+int watchdog_start(void);
+void watchdog_stop(void);
@@ -0,0 +1,618 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Control plane load generator: churns slaves and sources through the
+ * modbusd D-Bus API at a given rate and reports the latency of each
+ * method, and modbusd RSS after every churn cycle to reveal leaks.
+ *
+ * Each worker owns one slave id and runs, one call at a time:
+ * AddSlave, AddSource (xN), Get, Set, RemoveSource (xN), RemoveSlave.
+ * Workers wait for each other at the end of a cycle. Every call is
+ * expected to succeed: the first D-Bus error aborts the run, since the
+ * figures would then measure error paths.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <ell/ell.h>
+
+#define SERVICE			"br.org.cesar.modbus"
+#define MANAGER_IFACE		SERVICE ".Manager1"
+#define SLAVE_IFACE		SERVICE ".Slave1"
+#define TICK_MS			10
+
+enum op {
+	OP_ADD_SLAVE,
+	OP_ADD_SOURCE,
+	OP_GET,
+	OP_SET,
+	OP_REMOVE_SOURCE,
+	OP_REMOVE_SLAVE,
+	OP_MAX
+};
+
+static const char *op_names[] = {
+	"AddSlave", "AddSource", "Get", "Set", "RemoveSource", "RemoveSlave"
+};
+
+struct samples {
+	uint32_t *values;	/* us */
+	size_t len;
+	size_t size;
+	unsigned int errors;
+};
+
+struct worker {
+	uint8_t id;
+	enum op op;
+	unsigned int source;	/* Index of the next source */
+	unsigned int cycle;
+	char *path;
+	char **sources;
+	uint64_t sent_at;
+};
+
+static struct l_dbus *dbus;
+static struct l_queue *ready_list;	/* Workers waiting for a token */
+static struct l_timeout *tick;
+static struct worker *workers;
+static struct samples samples[OP_MAX];
+static uint32_t daemon_pid;
+static unsigned int waiting;		/* Workers at the cycle barrier */
+static unsigned int cycle;
+static bool failed;
+static unsigned long first_rss;
+static unsigned long last_rss;
+static double tokens;
+
+static unsigned int opt_slaves = 10;
+static unsigned int opt_first = 100;
+static unsigned int opt_sources = 10;
+static unsigned int opt_cycles = 20;
+static unsigned int opt_rate = 200;	/* calls/s */
+static unsigned int opt_leak = 512;	/* kB */
+static const char *opt_address = "127.0.0.1:1502";
+static bool opt_enable;
+
+static void worker_next(struct worker *worker);
+
+static void samples_add(struct samples *s, uint64_t usec)
+{
+	if (s->len == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->values = l_realloc(s->values, s->size * sizeof(uint32_t));
+	}
+
+	s->values[s->len++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *) a;
+	uint32_t ub = *(const uint32_t *) b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static uint32_t samples_percentile(const struct samples *s, unsigned int pct)
+{
+	size_t i;
+
+	if (!s->len)
+		return 0;
+
+	i = (s->len * pct + 99) / 100;
+
+	return s->values[i ? i - 1 : 0];
+}
+
+static unsigned long daemon_rss(void)
+{
+	char path[64];
+	char line[128];
+	unsigned long rss = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%u/status", daemon_pid);
+
+	fp = fopen(path, "re");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "VmRSS: %lu", &rss) == 1)
+			break;
+	}
+
+	fclose(fp);
+
+	return rss;
+}
+
+static void append_dict_entry(struct l_dbus_message_builder *builder,
+			      const char *key, char type, const void *value)
+{
+	char sig[2] = { type, '\0' };
+
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', key);
+	l_dbus_message_builder_enter_variant(builder, sig);
+	l_dbus_message_builder_append_basic(builder, type, value);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
+static struct l_dbus_message *build_add_slave(struct worker *worker)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *msg;
+	char name[16];
+
+	snprintf(name, sizeof(name), "load%02x", worker->id);
+
+	msg = l_dbus_message_new_method_call(dbus, SERVICE, "/",
+					     MANAGER_IFACE, "AddSlave");
+	builder = l_dbus_message_builder_new(msg);
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	append_dict_entry(builder, "Id", 'y', &worker->id);
+	append_dict_entry(builder, "Name", 's', name);
+	append_dict_entry(builder, "Address", 's', opt_address);
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return msg;
+}
+
+static struct l_dbus_message *build_add_source(struct worker *worker)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *msg;
+	uint16_t address = 1 + worker->source * 4;
+	uint16_t size = 4;
+	uint16_t interval = 1000;
+	char name[16];
+
+	snprintf(name, sizeof(name), "load%u", worker->source);
+
+	msg = l_dbus_message_new_method_call(dbus, SERVICE, worker->path,
+					     SLAVE_IFACE, "AddSource");
+	builder = l_dbus_message_builder_new(msg);
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	append_dict_entry(builder, "Name", 's', name);
+	append_dict_entry(builder, "Type", 's', "holding");
+	append_dict_entry(builder, "Address", 'q', &address);
+	append_dict_entry(builder, "Size", 'q', &size);
+	append_dict_entry(builder, "PollingInterval", 'q', &interval);
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return msg;
+}
+
+static struct l_dbus_message *build_set(struct worker *worker)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *msg;
+
+	msg = l_dbus_message_new_method_call(dbus, SERVICE, worker->path,
+					     L_DBUS_INTERFACE_PROPERTIES,
+					     "Set");
+	builder = l_dbus_message_builder_new(msg);
+	l_dbus_message_builder_append_basic(builder, 's', SLAVE_IFACE);
+
+	if (opt_enable) {
+		l_dbus_message_builder_append_basic(builder, 's', "Enable");
+		l_dbus_message_builder_enter_variant(builder, "b");
+		l_dbus_message_builder_append_basic(builder, 'b', &opt_enable);
+	} else {
+		l_dbus_message_builder_append_basic(builder, 's', "Name");
+		l_dbus_message_builder_enter_variant(builder, "s");
+		l_dbus_message_builder_append_basic(builder, 's', "renamed");
+	}
+
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return msg;
+}
+
+static struct l_dbus_message *build_message(struct worker *worker)
+{
+	struct l_dbus_message *msg;
+
+	switch (worker->op) {
+	case OP_ADD_SLAVE:
+		return build_add_slave(worker);
+	case OP_ADD_SOURCE:
+		return build_add_source(worker);
+	case OP_GET:
+		msg = l_dbus_message_new_method_call(dbus, SERVICE,
+					worker->path,
+					L_DBUS_INTERFACE_PROPERTIES, "Get");
+		l_dbus_message_set_arguments(msg, "ss", SLAVE_IFACE, "Name");
+		return msg;
+	case OP_SET:
+		return build_set(worker);
+	case OP_REMOVE_SOURCE:
+		msg = l_dbus_message_new_method_call(dbus, SERVICE,
+					worker->path, SLAVE_IFACE,
+					"RemoveSource");
+		l_dbus_message_set_arguments(msg, "o",
+					     worker->sources[worker->source]);
+		return msg;
+	case OP_REMOVE_SLAVE:
+		msg = l_dbus_message_new_method_call(dbus, SERVICE, "/",
+					MANAGER_IFACE, "RemoveSlave");
+		l_dbus_message_set_arguments(msg, "o", worker->path);
+		return msg;
+	case OP_MAX:
+		break;
+	}
+
+	return NULL;
+}
+
+static void cycle_done(void)
+{
+	unsigned long rss = daemon_rss();
+	unsigned int i;
+
+	/* First cycle warms up allocator pools and D-Bus match rules */
+	if (cycle == 0)
+		first_rss = rss;
+
+	last_rss = rss;
+
+	printf("cycle %4u: rss %lu kB (%+ld kB)\n", cycle + 1, rss,
+	       (long) (rss - first_rss));
+
+	waiting = 0;
+
+	if (++cycle >= opt_cycles) {
+		l_main_quit();
+		return;
+	}
+
+	for (i = 0; i < opt_slaves; i++)
+		worker_next(&workers[i]);
+}
+
+static void reply_cb(struct l_dbus_message *reply, void *user_data)
+{
+	struct worker *worker = user_data;
+	struct samples *s = &samples[worker->op];
+	const char *name;
+	const char *text;
+	const char *path;
+
+	samples_add(s, l_time_now() - worker->sent_at);
+
+	if (l_dbus_message_get_error(reply, &name, &text)) {
+		s->errors++;
+		fprintf(stderr, "%s(0x%02x): %s: %s\n", op_names[worker->op],
+			worker->id, name, text);
+		failed = true;
+		l_main_quit();
+		return;
+	}
+
+	switch (worker->op) {
+	case OP_ADD_SLAVE:
+		l_free(worker->path);
+		worker->path = NULL;
+		if (l_dbus_message_get_arguments(reply, "o", &path))
+			worker->path = l_strdup(path);
+
+		worker->op = OP_ADD_SOURCE;
+		worker->source = 0;
+		break;
+	case OP_ADD_SOURCE:
+		if (l_dbus_message_get_arguments(reply, "o", &path))
+			worker->sources[worker->source] = l_strdup(path);
+
+		worker->source++;
+
+		if (worker->source == opt_sources)
+			worker->op = OP_GET;
+		break;
+	case OP_GET:
+		worker->op = OP_SET;
+		break;
+	case OP_SET:
+		worker->op = OP_REMOVE_SOURCE;
+		worker->source = 0;
+		break;
+	case OP_REMOVE_SOURCE:
+		l_free(worker->sources[worker->source]);
+		worker->sources[worker->source++] = NULL;
+		if (worker->source == opt_sources)
+			worker->op = OP_REMOVE_SLAVE;
+		break;
+	case OP_REMOVE_SLAVE:
+		worker->op = OP_MAX;
+		break;
+	case OP_MAX:
+		break;
+	}
+
+	worker_next(worker);
+}
+
+static void worker_send(struct worker *worker)
+{
+	struct l_dbus_message *msg = build_message(worker);
+
+	worker->sent_at = l_time_now();
+	l_dbus_send_with_reply(dbus, msg, reply_cb, worker, NULL);
+}
+
+static void worker_next(struct worker *worker)
+{
+	if (worker->op == OP_MAX) {
+		worker->op = OP_ADD_SLAVE;
+		if (++waiting == opt_slaves)
+			cycle_done();
+		return;
+	}
+
+	l_queue_push_tail(ready_list, worker);
+}
+
+static void tick_expired(struct l_timeout *timeout, void *user_data)
+{
+	double max = opt_rate * TICK_MS / 1000.0;
+
+	/* Token bucket: bursts limited to one tick worth of calls */
+	tokens += max;
+	if (tokens > max + 1)
+		tokens = max + 1;
+
+	while (tokens >= 1 && !l_queue_isempty(ready_list)) {
+		worker_send(l_queue_pop_head(ready_list));
+		tokens--;
+	}
+
+	l_timeout_modify_ms(timeout, TICK_MS);
+}
+
+static void pid_reply(struct l_dbus_message *reply, void *user_data)
+{
+	unsigned int i;
+
+	if (!l_dbus_message_get_arguments(reply, "u", &daemon_pid)) {
+		fprintf(stderr, "%s is not running\n", SERVICE);
+		l_main_quit();
+		return;
+	}
+
+	first_rss = daemon_rss();
+	printf("modbusd pid %u: rss %lu kB\n", daemon_pid, first_rss);
+
+	for (i = 0; i < opt_slaves; i++)
+		worker_next(&workers[i]);
+
+	tick = l_timeout_create_ms(TICK_MS, tick_expired, NULL, NULL);
+}
+
+static void ready_cb(void *user_data)
+{
+	struct l_dbus_message *msg;
+
+	msg = l_dbus_message_new_method_call(dbus, "org.freedesktop.DBus",
+					     "/org/freedesktop/DBus",
+					     "org.freedesktop.DBus",
+					     "GetConnectionUnixProcessID");
+	l_dbus_message_set_arguments(msg, "s", SERVICE);
+	l_dbus_send_with_reply(dbus, msg, pid_reply, NULL, NULL);
+}
+
+static void signal_handler(uint32_t signo, void *user_data)
+{
+	switch (signo) {
+	case SIGINT:
+	case SIGTERM:
+		l_main_quit();
+		break;
+	}
+}
+
+static const struct option main_options[] = {
+	{ "slaves",		required_argument,	NULL, 'n' },
+	{ "first",		required_argument,	NULL, 'f' },
+	{ "sources",		required_argument,	NULL, 's' },
+	{ "cycles",		required_argument,	NULL, 'c' },
+	{ "rate",		required_argument,	NULL, 'r' },
+	{ "leak",		required_argument,	NULL, 'L' },
+	{ "address",		required_argument,	NULL, 'a' },
+	{ "enable",		no_argument,		NULL, 'e' },
+	{ "help",		no_argument,		NULL, 'h' },
+	{ }
+};
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "  -n, --slaves <n>       Concurrent slaves (10)\n"
+	       "  -f, --first <id>       First slave id (100)\n"
+	       "  -s, --sources <n>      Sources per slave (10)\n"
+	       "  -c, --cycles <n>       Churn cycles (20)\n"
+	       "  -r, --rate <n>         Calls per second (200)\n"
+	       "  -L, --leak <kB>        RSS growth reported as a leak (512)\n"
+	       "  -a, --address <addr>   Slave address (127.0.0.1:1502)\n"
+	       "  -e, --enable           Set Enable instead of Name\n",
+	       name);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "n:f:s:c:r:L:a:eh",
+				  main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'n':
+			opt_slaves = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			opt_first = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opt_sources = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opt_cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opt_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			opt_leak = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			opt_address = optarg;
+			break;
+		case 'e':
+			opt_enable = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if (opt_slaves < 1 || opt_first < 1 ||
+	    opt_first + opt_slaves - 1 > 247 ||
+	    opt_sources < 1 || opt_cycles < 1 || opt_rate < 1) {
+		fprintf(stderr, "Invalid parameters\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int report(void)
+{
+	struct samples *s;
+	unsigned int i;
+	long growth;
+
+	printf("\n%-13s %8s %6s %8s %8s %8s %8s\n", "call", "count",
+	       "errors", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+	for (i = 0; i < OP_MAX; i++) {
+		s = &samples[i];
+		qsort(s->values, s->len, sizeof(uint32_t), u32_cmp);
+
+		printf("%-13s %8zu %6u %8u %8u %8u %8u\n", op_names[i],
+		       s->len, s->errors, samples_percentile(s, 50),
+		       samples_percentile(s, 90), samples_percentile(s, 99),
+		       samples_percentile(s, 100));
+	}
+
+	if (failed) {
+		printf("\nABORTED: unexpected D-Bus error\n");
+		return 1;
+	}
+
+	if (cycle < 2)
+		return 0;
+
+	growth = last_rss - first_rss;
+	printf("\nrss growth after cycle 1: %+ld kB over %u cycles\n",
+	       growth, cycle - 1);
+
+	if (growth > (long) opt_leak) {
+		printf("LEAK: modbusd grew more than %u kB\n", opt_leak);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int ret;
+
+	if (parse_args(argc, argv) < 0)
+		return EXIT_FAILURE;
+
+	if (!l_main_init())
+		return EXIT_FAILURE;
+
+	dbus = l_dbus_new_default(L_DBUS_SYSTEM_BUS);
+	if (!dbus) {
+		l_main_exit();
+		return EXIT_FAILURE;
+	}
+
+	ready_list = l_queue_new();
+	workers = l_new(struct worker, opt_slaves);
+
+	for (i = 0; i < opt_slaves; i++) {
+		workers[i].id = opt_first + i;
+		workers[i].op = OP_ADD_SLAVE;
+		workers[i].path = NULL;
+		workers[i].sources = l_new(char *, opt_sources);
+		memset(workers[i].sources, 0, opt_sources * sizeof(char *));
+	}
+
+	l_dbus_set_ready_handler(dbus, ready_cb, NULL, NULL);
+
+	l_main_run_with_signal(signal_handler, NULL);
+
+	ret = report();
+
+	l_timeout_remove(tick);
+	l_queue_destroy(ready_list, NULL);
+
+	for (i = 0; i < opt_slaves; i++) {
+		l_free(workers[i].path);
+		l_free(workers[i].sources);
+	}
+
+	l_free(workers);
+
+	for (i = 0; i < OP_MAX; i++)
+		l_free(samples[i].values);
+
+	l_dbus_destroy(dbus);
+	l_main_exit();
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Modbus TCP slave simulator for benchmarks: serves unit ids 1..N on a
+ * loopback port, one thread per connection, with an optional injected
+ * response latency and jitter. Registers and coils change on a share of
+ * the requests so change detection has work to do.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <modbus.h>
+
+static const char *host = "127.0.0.1";
+static int port = 1502;
+static unsigned int units = 1;
+static unsigned int registers = 1024;
+static unsigned int latency;		/* us */
+static unsigned int jitter;		/* us */
+static unsigned int change = 50;	/* % of requests changing data */
+
+struct client {
+	int fd;
+	unsigned int seed;
+};
+
+static void client_delay(struct client *client)
+{
+	struct timespec ts;
+	unsigned int usec = latency;
+
+	if (jitter)
+		usec += rand_r(&client->seed) % (jitter + 1);
+
+	if (!usec)
+		return;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+static void client_change(struct client *client, modbus_mapping_t *map)
+{
+	unsigned int i;
+
+	if ((unsigned int) (rand_r(&client->seed) % 100) >= change)
+		return;
+
+	i = rand_r(&client->seed) % registers;
+	map->tab_registers[i]++;
+	map->tab_input_registers[i]++;
+	map->tab_bits[i] ^= 1;
+	map->tab_input_bits[i] ^= 1;
+}
+
+static void *client_thread(void *user_data)
+{
+	struct client *client = user_data;
+	uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+	modbus_mapping_t *map;
+	modbus_t *ctx;
+	int hdr;
+	int len;
+
+	ctx = modbus_new_tcp(host, port);
+	map = modbus_mapping_new(registers, registers, registers, registers);
+	if (!ctx || !map)
+		goto done;
+
+	modbus_set_socket(ctx, client->fd);
+	hdr = modbus_get_header_length(ctx);
+
+	for (;;) {
+		len = modbus_receive(ctx, query);
+		if (len < 0)
+			break;
+
+		if (len == 0)
+			continue;
+
+		/* Unit id precedes the function code */
+		if (query[hdr - 1] < 1 || query[hdr - 1] > units)
+			continue;
+
+		client_change(client, map);
+		client_delay(client);
+
+		if (modbus_reply(ctx, query, len, map) < 0)
+			break;
+	}
+
+done:
+	if (map)
+		modbus_mapping_free(map);
+
+	if (ctx) {
+		modbus_close(ctx);
+		modbus_free(ctx);
+	} else {
+		close(client->fd);
+	}
+
+	free(client);
+
+	return NULL;
+}
+
+static const struct option main_options[] = {
+	{ "host",		required_argument,	NULL, 'H' },
+	{ "port",		required_argument,	NULL, 'p' },
+	{ "units",		required_argument,	NULL, 'u' },
+	{ "registers",		required_argument,	NULL, 'r' },
+	{ "latency",		required_argument,	NULL, 'l' },
+	{ "jitter",		required_argument,	NULL, 'j' },
+	{ "change",		required_argument,	NULL, 'c' },
+	{ "help",		no_argument,		NULL, 'h' },
+	{ }
+};
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "  -H, --host <addr>      Listen address (127.0.0.1)\n"
+	       "  -p, --port <port>      Listen port (1502)\n"
+	       "  -u, --units <n>        Serve unit ids 1..n (1)\n"
+	       "  -r, --registers <n>    Registers and coils per table (1024)\n"
+	       "  -l, --latency <us>     Response latency (0)\n"
+	       "  -j, --jitter <us>      Random extra latency (0)\n"
+	       "  -c, --change <%%>       Requests changing data (50)\n",
+	       name);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "H:p:u:r:l:j:c:h",
+				  main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'u':
+			units = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			registers = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			jitter = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			change = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if (units < 1 || units > 247 || registers < 1 || registers > 65535) {
+		fprintf(stderr, "Invalid units or registers\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct client *client;
+	pthread_attr_t attr;
+	pthread_t thread;
+	modbus_t *ctx;
+	int server;
+	int fd;
+	int one = 1;
+
+	if (parse_args(argc, argv) < 0)
+		return EXIT_FAILURE;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	ctx = modbus_new_tcp(host, port);
+	if (!ctx)
+		return EXIT_FAILURE;
+
+	server = modbus_tcp_listen(ctx, 1024);
+	if (server < 0) {
+		fprintf(stderr, "listen(%s:%d): %s\n", host, port,
+			modbus_strerror(errno));
+		modbus_free(ctx);
+		return EXIT_FAILURE;
+	}
+
+	printf("Serving %u unit(s) on %s:%d\n", units, host, port);
+	fflush(stdout);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		fd = accept(server, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->seed = fd ^ time(NULL);
+
+		if (pthread_create(&thread, &attr, client_thread, client)) {
+			close(fd);
+			free(client);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(server);
+	modbus_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Decodes trace dumps written by modbusd (Trace1.Dump returns the file
+ * name, in the storage directory) and prints the records of every
+ * thread merged in timestamp order.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef unlikely
+#define unlikely(x)	(x)
+#endif
+
+#include "src/trace.h"
+
+struct point {
+	const char *name;
+	const char *fmt;
+};
+
+#define TRACE_POINT(id, name, fmt)	{ name, fmt },
+
+static const struct point points[] = {
+	TRACE_POINTS(TRACE_POINT)
+};
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct trace_record *ra = a;
+	const struct trace_record *rb = b;
+
+	if (ra->timestamp < rb->timestamp)
+		return -1;
+
+	return (ra->timestamp > rb->timestamp);
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_header hdr;
+	struct trace_record *records;
+	struct trace_record *rec;
+	uint64_t start;
+	uint32_t i;
+	FILE *fp;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <dump file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fp = fopen(argv[1], "r");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION ||
+	    hdr.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+	records = calloc(hdr.count ? hdr.count : 1, sizeof(*records));
+	if (!records) {
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+	hdr.count = fread(records, sizeof(*records), hdr.count, fp);
+	fclose(fp);
+
+	qsort(records, hdr.count, sizeof(*records), record_cmp);
+
+	start = hdr.count ? records[0].timestamp : 0;
+
+	for (i = 0; i < hdr.count; i++) {
+		rec = &records[i];
+
+		printf("%12.6f [%5u] ", (rec->timestamp - start) / 1e9,
+		       rec->tid);
+
+		if (rec->id >= TRACE_MAX) {
+			printf("unknown(%u)\n", rec->id);
+			continue;
+		}
+
+		printf("%-14s", points[rec->id].name);
+		printf(points[rec->id].fmt, rec->arg[0], rec->arg[1],
+		       rec->arg[2]);
+		printf("\n");
+	}
+
+	free(records);
+
+	return EXIT_SUCCESS;
+}